@@ -0,0 +1,112 @@
+#pragma once
+
+#include <glad/glad.h>
+#include <stdint.h>
+#include <vector>
+#include <glm/glm.hpp>
+#include "engine/texture.h"
+
+//
+// An axis aligned box of texels packed into a region readback. The table
+// passed to AsyncReadback::read_regions is clipped to the texture and gets
+// each box's byte offset in the packed data, x fastest, then y, then z
+//
+struct ReadbackRegion {
+    glm::uvec3 origin;                  // First texel of the box
+    glm::uvec3 size;                    // Texels along x,y,z, zero when the box misses the texture
+    size_t offset = 0;                  // Byte offset of the box in the packed data
+};
+
+//
+// Ring of persistently mapped pixel pack buffers for reading GPU data back
+// to the CPU without stalling. Every copy is fenced, and consumers get the
+// newest copy whose fence has signaled, which lags the last issued copy
+// by latency() frames. When every slot is still in flight, a new copy is
+// skipped rather than waited on. Owns its slots, so it can be moved but
+// not copied, and frees them when it is destroyed or assigned over
+//
+struct AsyncReadback {
+
+    AsyncReadback() {}
+    AsyncReadback(size_t slot_size, int depth = 3);
+    ~AsyncReadback();
+
+    AsyncReadback(const AsyncReadback &) = delete;
+    AsyncReadback &operator=(const AsyncReadback &) = delete;
+    AsyncReadback(AsyncReadback &&other);
+    AsyncReadback &operator=(AsyncReadback &&other);
+
+    //
+    // Copy level 0 of a texture into the next free slot and fence it.
+    // Returns false if the copy was skipped because no slot was free
+    //
+    bool read(const Texture3D &texture, GLenum format = GL_RED, GLenum type = GL_FLOAT);
+
+    //
+    // Copy the first bytes of a buffer object into the next free slot, with
+    // the same skipping as read
+    //
+    bool read_buffer(uint32_t buffer, size_t bytes);
+
+    //
+    // Copy a list of boxes of a texture's level 0 back to back into the
+    // next free slot, with the same skipping as read. The clipped region
+    // table travels with the slot, see latest_regions
+    //
+    bool read_regions(const Texture3D &texture, std::vector<ReadbackRegion> regions, GLenum format = GL_RED, GLenum type = GL_FLOAT);
+
+    //
+    // The newest completed copy, or nullptr while none has completed yet.
+    // Polls the fences without waiting, and stays valid until the next read
+    //
+    const void *latest();
+
+    //
+    // Waits for the copy issued as the given frame, i.e. frames_issued right
+    // after its read call, and returns it. Returns nullptr if that copy was
+    // skipped or its slot has since been reused. Stays valid until the next
+    // read
+    //
+    const void *wait(uint64_t frame);
+
+    //
+    // Frames between the last issued copy and the one latest() returns
+    //
+    uint64_t latency() const;
+
+    //
+    // Region table of the copy latest() returns, empty for whole copies
+    //
+    const std::vector<ReadbackRegion> &latest_regions() const;
+
+    bool allocated() const {
+        return !slots.empty();
+    }
+
+    //
+    // Delete the slots and their fences, leaving the readback unallocated.
+    // Needs the GL context, so owners release it before the context goes
+    //
+    void destroy();
+
+    uint64_t frames_issued = 0;         // Copies issued so far, numbering the frames
+    uint64_t frames_skipped = 0;        // Copies skipped because every slot was in flight
+
+private:
+    struct Slot {
+        uint32_t pbo = 0;
+        void *data = nullptr;           // Persistent, coherent read mapping of pbo
+        GLsync fence = 0;
+        uint64_t frame = 0;
+        std::vector<ReadbackRegion> regions;
+    };
+
+    std::vector<Slot> slots;
+    size_t slot_size = 0;
+    int next_slot = 0;
+    int latest_slot = -1;
+
+    void poll();
+    bool begin_slot(size_t bytes);
+    void end_slot();
+};
@@ -7,14 +7,61 @@
 #include "engine/kernel.h"
 #include "engine/model.h"
 #include <glm/glm.hpp>
+#include <vector>
+
+//
+// One body of FluidDebugRenderer::overlay_masks, mirrored by the std430
+// MaskBody struct of fs_overlay_bodies.comp
+//
+struct MaskBody {
+    glm::mat4 inverse_world;            // World to the mesh's local space
+    glm::vec4 least, most;              // xyz: extents of the mask in local space
+    glm::vec4 world_least, world_most;  // xyz: extents of the mask in world space
+    glm::vec4 velocity;                 // xyz: written to the velocity mask
+    glm::vec4 temperature;              // x: written to the temperature mask
+    glm::uvec4 mask;                    // xyz: cells of the mask, w: its texture, replaced by its sampler on upload
+};
+static_assert(sizeof(MaskBody) == 176, "MaskBody must match the std430 layout of fs_overlay_bodies.comp");
+
+//
+// Number of bodies overlay_masks handles in one dispatch
+//
+const int MAX_MASK_BODIES = 256;
+
+//
+// Number of distinct mask textures overlay_masks samples in one dispatch,
+// bound to the texture units from MASK_TEXTURE_UNIT on
+//
+const int MAX_MASK_TEXTURES = 16;
+const int MASK_TEXTURE_UNIT = 4;
+
+//
+// A MASK_TILE^3 block of cells written by overlay_masks, with a bit for
+// every body whose world bounds touch it. Mirrored by the std430 MaskTile
+// struct of fs_overlay_bodies.comp
+//
+const int MASK_TILE = 8;
+
+struct MaskTile {
+    glm::uvec4 origin;                          // xyz: first cell of the tile
+    uint32_t bodies[MAX_MASK_BODIES / 32];
+};
+static_assert(sizeof(MaskTile) == 48, "MaskTile must match the std430 layout of fs_overlay_bodies.comp");
 
 struct FluidDebugRenderer {
 
 private:
     Camera *camera;
     ShaderProgram draw_shader; 
-    KernelProgram overlay_compute_shader; 
+    KernelProgram overlay_bodies_shader;
     uint32_t quad_vao, quad_vbo;
+    uint32_t mask_bodies_ssbo;
+    uint32_t mask_tiles_ssbo;
+    size_t mask_tiles_capacity = 0;
+
+    // TILES THAT HELD A BODY IN THE LATEST overlay_masks, THE NEXT ONE CLEARS THEM
+    std::vector<uint32_t> written_tiles;
+    bool masks_cleared = false;
 
     float plane_width, plane_height, plane_z_offset;
     glm::vec3 grid_offset, grid_worldspace_whd;
@@ -23,7 +70,24 @@ public:
     FluidDebugRenderer(Camera *cam, float plane_width, float plane_height, float plane_z_offset, glm::vec3 grid_offset, glm::vec3 grid_worldspace_whd);
 
 
-    void overlay_mask(Mask mask, Texture3D *grid, glm::vec3 value_to_write);
+    //
+    // The overlay of a mask at its model's current transform, writing
+    // velocity and temperature into the velocity and temperature masks.
+    // Only the solid cells of mask.tex are written, so the mask texture
+    // must outlive the overlay_masks calls that get the body
+    //
+    static MaskBody mask_body(const Mask &mask, glm::vec3 velocity, float temperature);
+
+    //
+    // Writes the solid, velocity and temperature masks of all bodies in one
+    // dispatch over only the tiles the bodies' world bounds touch, plus the
+    // tiles they touched last time, which are cleared. Bodies whose mask
+    // is not among the first MAX_MASK_TEXTURES distinct ones are dropped.
+    // The first call writes every cell, so the masks need no clearing, but
+    // every call must get the same three textures. Issues no barrier, run it as a
+    // ComputeGraph pass that writes the three masks
+    //
+    void overlay_masks(std::vector<MaskBody> bodies, Texture3D *solid_mask, Texture3D *velocity_mask, Texture3D *temperature_mask);
     void draw(Texture3D grid, bool scalar);
 
     void plane_vectors(glm::vec3 *plane_x, glm::vec3 *plane_y); 
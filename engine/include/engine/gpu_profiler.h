@@ -0,0 +1,162 @@
+#pragma once
+
+#include <glad/glad.h>
+#include <functional>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+//
+// One zone of a resolved frame. Times are in milliseconds from the start
+// of the frame, depth is the number of zones it is nested in
+//
+struct GpuZoneTiming {
+    std::string name;
+    int depth;
+    double start_ms, end_ms;
+};
+
+//
+// Rolling statistics of every zone with the same name. A name that is hit
+// several times per frame (e.g. every Jacobi sweep) is summed per frame
+//
+struct GpuZoneStats {
+    std::string name;
+    int depth;                  // Depth the name was first seen at
+    double average_ms;          // Exponential moving average of the per-frame total
+    double last_ms;             // Per-frame total of the latest resolved frame
+    uint32_t calls;             // Hits in the latest resolved frame
+};
+
+//
+// Measures GPU time per zone with GL_TIMESTAMP queries, which nest freely
+// and do not collide with the GL_TIME_ELAPSED queries of KernelTuner. Each
+// frame records into its own slot of a ring, and a slot is only read back
+// once its last query is available, so the profiler never waits on the
+// GPU. When the slot a frame would use is still in flight, that frame is
+// not recorded.
+//
+// Zones are opened with GpuZone, which costs one branch while the profiler
+// is disabled or does not exist. Like Physics, the most recently created
+// profiler is reachable through instance
+//
+struct GpuProfiler {
+
+    static GpuProfiler *instance;
+
+    bool enabled = false;
+
+    // Weight of the newest frame in the rolling averages
+    float smoothing = 0.05f;
+
+    // Called after every resolved frame, e.g. to record it in a trace
+    std::function<void(const GpuProfiler &)> on_resolve;
+
+    GpuProfiler(int depth = 4);
+    ~GpuProfiler();
+
+    GpuProfiler(const GpuProfiler &) = delete;
+    GpuProfiler &operator=(const GpuProfiler &) = delete;
+
+    //
+    // Bracket one frame. Zones opened outside a frame are ignored
+    //
+    void begin_frame();
+    void end_frame();
+
+    void begin(const char *name);
+    void end();
+
+    //
+    // Blocks until every recorded frame has resolved
+    //
+    void wait();
+
+    //
+    // Zones of the newest resolved frame in the order they were opened, and
+    // its length in milliseconds
+    //
+    const std::vector<GpuZoneTiming> &latest_frame() const {
+        return resolved_zones;
+    }
+
+    double latest_frame_ms() const {
+        return resolved_frame_ms;
+    }
+
+    //
+    // When the newest resolved frame started on the GPU, in nanoseconds of
+    // std::chrono::steady_clock
+    //
+    int64_t latest_frame_cpu_ns() const {
+        return resolved_frame_cpu_ns;
+    }
+
+    //
+    // Rolling statistics per zone name, in the order the names first appeared
+    //
+    const std::vector<GpuZoneStats> &stats() const {
+        return zone_stats;
+    }
+
+    uint64_t frames_resolved = 0;
+    uint64_t frames_skipped = 0;
+
+private:
+    struct Zone {
+        std::string name;
+        int depth;
+        uint32_t begin_query, end_query;
+    };
+
+    struct Slot {
+        std::vector<GLuint> queries;    // Pool, grown as zones are added, query 0 starts the frame
+        std::vector<Zone> zones;
+        uint32_t used = 0;
+        uint32_t frame_end = 0;
+        uint64_t frame = 0;
+        int64_t clock_offset_ns = 0;    // steady_clock minus GL_TIMESTAMP when the frame began
+        bool pending = false;
+    };
+
+    std::vector<Slot> slots;
+    uint64_t frame_count = 0;
+    Slot *recording = nullptr;
+
+    // Open zones of the recording frame, -1 for zones opened while not recording
+    std::vector<int> open;
+
+    std::vector<GpuZoneTiming> resolved_zones;
+    double resolved_frame_ms = 0.0;
+    int64_t resolved_frame_cpu_ns = 0;
+    uint64_t resolved_frame = 0;
+    std::vector<GpuZoneStats> zone_stats;
+
+    uint32_t timestamp(Slot &slot);
+    void poll();
+    void resolve(Slot &slot);
+};
+
+//
+// Times the GPU work issued during its lifetime as one zone
+//
+struct GpuZone {
+    GpuZone(const char *name) {
+        if (GpuProfiler::instance && GpuProfiler::instance->enabled) {
+            profiler = GpuProfiler::instance;
+            profiler->begin(name);
+        }
+    }
+
+    ~GpuZone() {
+        if (profiler) {
+            profiler->end();
+        }
+    }
+
+    GpuZone(const GpuZone &) = delete;
+    GpuZone &operator=(const GpuZone &) = delete;
+
+private:
+    GpuProfiler *profiler = nullptr;
+};
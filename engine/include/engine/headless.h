@@ -0,0 +1,25 @@
+#pragma once
+
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#include <stdint.h>
+
+//
+// OpenGL 4.6 core context without a window, for running the simulation
+// on machines with no display server or render node. Prefers Mesa's
+// surfaceless platform (llvmpipe works there), then falls back to the
+// default EGL display. Drivers without 4.6, like llvmpipe on Mesa 22.3,
+// get a 4.5 context instead. Like Window, it loads the GL functions
+// and makes the context current, and exits when no context can be created
+//
+struct HeadlessContext {
+    EGLDisplay display = EGL_NO_DISPLAY;
+    EGLContext context = EGL_NO_CONTEXT;
+    EGLSurface surface = EGL_NO_SURFACE;
+
+    HeadlessContext(int major = 4, int minor = 6);
+    ~HeadlessContext();
+
+    HeadlessContext(const HeadlessContext &) = delete;
+    HeadlessContext &operator=(const HeadlessContext &) = delete;
+};
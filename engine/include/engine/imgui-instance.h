@@ -1,5 +1,6 @@
 #pragma once
 
+#include <glad/glad.h>
 #include <GLFW/glfw3.h>
 #include <stdbool.h>
 #undef  IMGUI_IMPL_OPENGL_LOADER_GLEW
@@ -14,7 +15,7 @@
 struct ImGuiInstance {
     static bool gui_enabled, render_normals, render_skybox;
     static bool cull_back_face;
-    static bool physics_enabled;
+    static bool physics_enabled, gpu_pressure_forces, cpu_fluid_backend, gpu_profiler;
     static bool mask_overlay, fluid_pressure_overlay, fluid_velocity_overlay, fsdebug_scalar;
     static bool msaa, reinhard_hdr, wireframe;
     static bool draw_model_bb, draw_mesh_bb;
@@ -29,6 +30,9 @@ struct ImGuiInstance {
     void draw();
 
     static bool mouse_over_imgui();
+
+private:
+    static void draw_gpu_profiler();
 };
 
 
@@ -5,8 +5,12 @@
 #include <string>
 #include <glm/glm.hpp>
 #include <vector>
+#include <map>
+#include <set>
+#include <functional>
 #include "engine/light.h"
 #include "engine/texture.h"
+#include "engine/shader.h"
 
 //
 // Represents the final, linked shader program that is used by the
@@ -18,16 +22,20 @@ struct KernelProgram {
     // Default constructor so that other things work... not to be used to create an
     // actual shader!
     //
-    KernelProgram(): id(UINT32_MAX) {}
+    KernelProgram(): local_size(0), id(UINT32_MAX) {}
     KernelProgram& operator=(const KernelProgram& other) {
         id = other.id;
+        local_size = other.local_size;
+        uniforms = other.uniforms;
+        return *this;
     }
 
     //
     // Specify the path for the compute shader
-    // to create a shader.
+    // to create a shader. Any defines (e.g. "#define SWEEPS 4\n") are
+    // inserted right after the #version line before compiling.
     //
-    KernelProgram(std::string kernel_path); 
+    KernelProgram(std::string kernel_path, std::string defines = ""); 
 
     //
     // Set the OpenGl state machine's active shader to this one, meaning that
@@ -35,6 +43,29 @@ struct KernelProgram {
     //
     void use();
 
+    //
+    // Delete the linked program. Copies share the id, so none of them may be
+    // used afterwards
+    //
+    void destroy();
+
+    //
+    // Dispatch enough workgroups to cover a w x h x d grid of invocations,
+    // rounding up. Kernels must bounds check the extra invocations.
+    //
+    void dispatch(uint32_t w, uint32_t h, uint32_t d) const;
+
+    //
+    // Dispatch with the workgroup counts stored at offset in a
+    // GL_DISPATCH_INDIRECT_BUFFER, written earlier on the GPU
+    //
+    void dispatch_indirect(uint32_t buffer, GLintptr offset) const;
+
+    //
+    // The workgroup size the kernel was compiled with
+    //
+    glm::uvec3 local_size;
+
     friend bool operator<(const KernelProgram first, const KernelProgram second) {
         return first.id < second.id;
     }
@@ -55,6 +86,11 @@ struct KernelProgram {
     void setMat3(const std::string &name, const glm::mat3 &mat) const;
     void setMat4(const std::string &name, const glm::mat4 &mat) const;
 
+    //
+    // Location of a uniform, -1 (ignored by glUniform*) if it is not active
+    //
+    GLint location(const std::string &name) const;
+
 
 private:
     //
@@ -62,11 +98,126 @@ private:
     //
     uint32_t id;
 
+    //
+    // Uniform locations, reflected when the program is linked
+    //
+    UniformLocations uniforms;
+
     //
     // Helper functions to check for compilation and link errors
     // of the supplied shaders
     //
     static void check_link_errors(uint32_t id);
     static void check_compile_errors(uint32_t id);
+
+    friend struct KernelTuner;
+};
+
+//
+// How a pass touches a resource, which decides the barrier bit that makes
+// an earlier shader write visible to it
+//
+enum ComputeAccess {
+    COMPUTE_ACCESS_IMAGE,               // imageLoad / imageStore
+    COMPUTE_ACCESS_TEXTURE,             // Sampler fetches from any shader
+    COMPUTE_ACCESS_STORAGE,             // Shader storage buffer reads and writes
+    COMPUTE_ACCESS_TEXTURE_UPDATE,      // glGetTexImage, glCopyImageSubData, glClearTexImage, ...
+    COMPUTE_ACCESS_BUFFER_UPDATE,       // glGetBufferSubData, glBufferSubData, glCopyBufferSubData, ...
+    COMPUTE_ACCESS_INDIRECT,            // Commands read by glDispatchComputeIndirect / glDraw*Indirect
+};
+
+//
+// A texture or buffer used by a pass. The id is looked up every time the
+// pass runs, so a pass recorded once keeps following a Texture3DPair or
+// a pressure ring as they are swapped
+//
+struct ComputeResource {
+    std::function<uint32_t()> id;
+    bool buffer;
+    ComputeAccess access;
+
+    static ComputeResource image(const Texture3D &texture);
+    static ComputeResource texture(const Texture3D &texture);
+    static ComputeResource texture_update(const Texture3D &texture);
+    static ComputeResource storage(const uint32_t &buffer);
+    static ComputeResource buffer_update(const uint32_t &buffer);
+    static ComputeResource indirect(const uint32_t &buffer);
+};
+
+//
+// Tracks shader writes that have not been made visible yet, and before each
+// pass issues the narrowest glMemoryBarrier its reads and writes need.
+// Passes with no hazard between them get no barrier at all, so the GPU is
+// free to overlap them
+//
+struct ComputeBarriers {
+
+    ComputeBarriers(): barrier_count(0), pass_count(0) {}
+
+    //
+    // Bracket work that is not recorded in a ComputeGraph. begin_pass issues
+    // whatever barrier the accesses need, end_pass records the writes
+    //
+    void begin_pass(const std::vector<ComputeResource> &reads, const std::vector<ComputeResource> &writes);
+    void end_pass();
+
+    //
+    // Make every tracked write visible to the accesses in bits, for
+    // consumers that do not declare what they read
+    //
+    void flush(GLbitfield bits = GL_ALL_BARRIER_BITS);
+
+    //
+    // Number of barriers issued and passes run, for profiling
+    //
+    uint32_t barrier_count, pass_count;
+
+private:
+    struct Access {
+        uint64_t key;
+        ComputeAccess access;
+    };
+
+    // Resources written by shaders, with the barrier bits issued since
+    std::map<uint64_t, GLbitfield> written;
+
+    // Resources read by shaders since the last image/storage barrier
+    std::set<uint64_t> read;
+
+    std::vector<Access> pass_reads, pass_writes;
+
+    static std::vector<Access> resolve(const std::vector<ComputeResource> &resources);
+    static GLbitfield barrier_bit(ComputeAccess access);
+    static bool shader_write(ComputeAccess access);
+};
+
+//
+// One recorded pass: the resources it reads and writes, and the function
+// that binds them and dispatches
+//
+struct ComputePass {
+    std::string name;
+    std::vector<ComputeResource> reads, writes;
+    std::function<void()> run;
 };
 
+//
+// A list of compute passes recorded once and replayed in order. Barriers
+// come from the declared reads and writes instead of following every pass
+//
+struct ComputeGraph {
+
+    ComputeGraph(): barriers(nullptr) {}
+    ComputeGraph(ComputeBarriers *barriers): barriers(barriers) {}
+
+    void add(std::string name, std::vector<ComputeResource> reads, std::vector<ComputeResource> writes, std::function<void()> run);
+    void replay();
+    void clear();
+
+    bool empty() const {
+        return passes.empty();
+    }
+
+    std::vector<ComputePass> passes;
+    ComputeBarriers *barriers;
+};
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <glad/glad.h>
+#include <stdint.h>
+#include <string>
+#include <map>
+#include <glm/glm.hpp>
+#include "engine/kernel.h"
+
+//
+// Picks the fastest workgroup size for compute kernels on this machine.
+// Every candidate size is compiled through the LOCAL_SIZE_X/Y/Z defines and
+// timed with GL timer queries on a grid of the requested size. Winners are
+// kept in a cache file keyed by GPU, kernel, defines and grid size, so the
+// sweep only ever runs once per machine.
+//
+struct KernelTuner {
+
+    KernelTuner(std::string cache_path);
+
+    //
+    // Compile the kernel with the fastest workgroup size for a w x h x d
+    // grid, tuning it first if the cache has no entry for it yet
+    //
+    KernelProgram load(std::string kernel_path, uint32_t w, uint32_t h, uint32_t d, std::string defines = "");
+
+    //
+    // Write the cache back to disk if anything new was tuned
+    //
+    void save();
+
+    //
+    // Buffers bound at these uniform block bindings while timing, instead of
+    // zeroed scratch blocks, for kernels that take their grid size from one
+    //
+    std::map<GLint, uint32_t> uniform_blocks;
+
+private:
+    std::string cache_path;
+    std::string renderer;
+    std::map<std::string, glm::uvec3> cache;
+    bool dirty;
+
+    glm::uvec3 tune(const std::string &kernel_path, const std::string &defines, uint32_t w, uint32_t h, uint32_t d);
+
+    static std::string local_size_defines(glm::uvec3 local_size);
+};
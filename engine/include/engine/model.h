@@ -10,9 +10,13 @@
 #include "engine/debug.h"
 #include "engine/camera.h"
 #include "engine/physics.h"
+#include "engine/trace.h"
+#include "engine/voxelizer.h"
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 #include <map>
+#include <limits>
+#include <tuple>
 
 //
 // Determines what shader uniforms need to be passed
@@ -46,10 +50,16 @@ enum MeshShaderBits {
 struct Model;
 struct Mesh;
 
+//
+// A mesh's occupancy over its bounding box. tex is bit-packed, see
+// Voxelizer::mask_texture, and may be shared with every other mask of the
+// same asset mesh at the same resolution
+//
 struct Mask {
-    Mask(Texture3D tex, Model *parent, glm::mat4 bind_matrix, glm::vec3 least, glm::vec3 most) 
-    : parent(parent), tex(tex), bind_matrix(bind_matrix), bbox_least(least), bbox_most(most) {}
+    Mask(Texture3D tex, glm::uvec3 cells, Model *parent, glm::mat4 bind_matrix, glm::vec3 least, glm::vec3 most) 
+    : parent(parent), tex(tex), cells(cells), bind_matrix(bind_matrix), bbox_least(least), bbox_most(most) {}
     Texture3D tex;
+    glm::uvec3 cells;
     glm::mat4 bind_matrix;
     Model *parent;
     glm::vec3 bbox_most, bbox_least;
@@ -71,8 +81,13 @@ struct Mesh {
     //
     glm::vec3 bbox_least, bbox_most;
 
-    uint32_t mask_width = 20, mask_height = 20, mask_depth = 20;
-    std::vector<float> mask_data;
+    //
+    // The file this mesh was loaded from and its index among the meshes of
+    // that file. Empty for meshes made from raw vertex data, whose masks
+    // are not cached
+    //
+    std::string asset_path;
+    uint32_t asset_index = 0;
 
     //
     // The constructor takes a (possibly empty) vertex
@@ -105,9 +120,20 @@ struct Mesh {
     glm::mat4 model(); 
 
     //
-    // Get the 3D mask texture for this mesh
+    // Voxelize this mesh into a 3D mask texture with cells of about
+    // cell_size in world space, at the mesh's current scale, see Voxelizer.
+    // Meshes of the same asset share the mask of the first one voxelized at
+    // a resolution. Needs the vertex buffer to be filled. Every mask must be
+    // given back with release_mask
     //
-    Mask get_mask(uint32_t unit);
+    Mask get_mask(uint32_t unit, glm::vec3 cell_size, bool fill_interior = true);
+
+    //
+    // Gives back a mask of get_mask. A shared mask is deleted when the last
+    // mesh that got it gives it back, any other right away. The voxelizer
+    // is deleted along with the last mask
+    //
+    static void release_mask(const Mask &mask);
 
     //
     // The model transformation of the model which contains
@@ -117,10 +143,6 @@ struct Mesh {
 
 private:
 
-    uint64_t hash_position(glm::vec3 position);
-    uint64_t hash_func(uint32_t ix, uint32_t iy, uint32_t iz);
-    void generate_mask_data(std::vector<Vertex> vertices);
-
     //
     // The mesh local->model local transformation
     //
@@ -132,6 +154,22 @@ private:
     //
     GLuint bbox_vao = 0, bbox_vbo = 0;
     static ShaderProgram *bbox_shader;
+    static Voxelizer *voxelizer;
+
+    //
+    // A static map from (asset path, mesh index, resolution, filled) to
+    // voxelized masks and the number of get_mask calls that returned them
+    // and were not released yet. Avoids voxelizing the same mesh more than
+    // once
+    //
+    struct LoadedMask {
+        Texture3D tex;
+        uint32_t users;
+    };
+    static std::map<std::tuple<std::string, uint32_t, uint32_t, uint32_t, uint32_t, bool>, LoadedMask> loaded_masks;
+
+    // MASKS HANDED OUT AND NOT RELEASED YET, SHARED OR NOT
+    static uint32_t live_masks;
 
     //
     // Vertex mesh information for drawing
@@ -252,7 +290,15 @@ struct Model {
     //
     void draw_bounding_box(Camera *camera);
 
-    void pressure_force(Fluidsim::Engine &fs, int num_samples_sides, int num_side_subdivisions, glm::vec3 offset, glm::mat4 object_m) {
+    //
+    // Samples the pressure around the box on the CPU and applies the force.
+    // ptr holds the pressure of the cells in region, read back with
+    // Fluidsim::Engine::read_regions, cells outside of it read as 0
+    //
+    void pressure_force(Fluidsim::Engine &fs, int num_samples_sides, int num_side_subdivisions, glm::vec3 offset, glm::mat4 object_m,
+                        const GLfloat *ptr, const ReadbackRegion &region) {
+        TraceZone zone("pressure_force");
+
         // body is the reactphysics3d dynamic collision body
         // physics_obj->body->applyTorque();
         // physics_obj->body->applyForce()
@@ -267,24 +313,11 @@ struct Model {
         float depth   = (bbox_most.z - bbox_least.z);
         glm::vec4 center_box_offset(-width/2, -height/2, -depth/2, 0.0f); // (Go from corner centered at origin to box centered at origin)
 
-        static int index = 0;
-        int next_index = (index + 1) % 3;
-
-        glMemoryBarrier(GL_ALL_BARRIER_BITS);
-
-        glGetError();
-        glBindBuffer(GL_PIXEL_PACK_BUFFER, Physics::instance->pbos[index]);
-        glBindTexture(GL_TEXTURE_3D, fs.prescpy[index].id);
-        glGetTexImage(GL_TEXTURE_3D, 0, GL_RGBA, GL_FLOAT, 0);
-
-        glBindBuffer(GL_PIXEL_PACK_BUFFER, Physics::instance->pbos[next_index]);
-        GLfloat *ptr = (GLfloat *)glMapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
-
-
-        auto sample_pressure_from_box_coord = [fs, object_m, ptr, offset](glm::vec4 box_coord) {
+        auto sample_pressure_from_box_coord = [&fs, object_m, ptr, &region, offset](glm::vec4 box_coord) {
             glm::vec4 world_coord = object_m * box_coord;
             // Sample from image based on world coords
 
+            // Extents along the texture's x, y and z
             float dim_x = (float)fs.grid_width * fs.sclx;
             float dim_y = (float)fs.grid_height * fs.scly;
             float dim_z = (float)fs.grid_depth * fs.sclz;
@@ -293,14 +326,16 @@ struct Model {
             // float float_cell_y = ((world_coord.y + dim_y / 2.0) / dim_y) * (float)fs.grid_height;
             // float float_cell_z = ((world_coord.z + dim_z / 2.0) / dim_z) * (float)fs.grid_depth;
 
+            // THE GRID IS STORED Y/Z SWAPPED RELATIVE TO THE WORLD, SO THE CELL IS COUNTED ALONG THE TEXTURE'S AXES
             world_coord -= glm::vec4(offset, 0.0f);
-            world_coord /= glm::vec4(dim_x, dim_y, dim_z, 1.0f);
-            world_coord += glm::vec4(0.5f, 0.5f, 0.5f, 0.0f);
-            world_coord *= glm::vec4((float) fs.grid_width, (float) fs.grid_height, (float) fs.grid_depth, 1.0f);
-
-            float float_cell_x = world_coord.x;
-            float float_cell_y = world_coord.y;
-            float float_cell_z = world_coord.z;
+            glm::vec3 grid_coord(world_coord.x, world_coord.z, world_coord.y);
+            grid_coord /= glm::vec3(dim_x, dim_y, dim_z);
+            grid_coord += glm::vec3(0.5f, 0.5f, 0.5f);
+            grid_coord *= glm::vec3((float) fs.grid_width, (float) fs.grid_height, (float) fs.grid_depth);
+
+            float float_cell_x = grid_coord.x;
+            float float_cell_y = grid_coord.y;
+            float float_cell_z = grid_coord.z;
             
             if (float_cell_x >= (float)fs.grid_width) {
                 return 0.0f;
@@ -325,9 +360,15 @@ struct Model {
             float pressure = 0.0f;
 
             if (ptr) {
-                // process pixels
-                auto get_pressure = [fs, ptr] (uint32_t w, uint32_t h, uint32_t d) {
-                    uint32_t pixel_index = 4 * (w + fs.grid_width * d + fs.grid_width * fs.grid_depth * h);
+                // process pixels, (w, h, d) is a texel and the region is packed in texel order
+                auto get_pressure = [ptr, &region] (uint32_t w, uint32_t h, uint32_t d) {
+                    glm::uvec3 cell = glm::uvec3(w, h, d) - region.origin;
+                    if (w < region.origin.x || h < region.origin.y || d < region.origin.z
+                        || cell.x >= region.size.x || cell.y >= region.size.y || cell.z >= region.size.z) {
+                        return 0.0f;
+                    }
+
+                    size_t pixel_index = region.offset / sizeof(GLfloat) + cell.x + region.size.x * (cell.y + region.size.y * cell.z);
                     return ptr[pixel_index];
                 };
                 pressure = get_pressure(cell_x, cell_y, cell_z);
@@ -337,7 +378,6 @@ struct Model {
                 //    std::cout << ptr[i] << ", ";
                 //}
                 //std::cout << ") " << std::endl;
-                glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
             }
 
             return pressure;
@@ -684,15 +724,44 @@ struct Model {
                 physics_obj->apply_force_to_center(force);
             }
         }
+    }
 
+    //
+    // World space bounds of the box pressure_force samples around, grown by
+    // margin on every side
+    //
+    void sample_bounds(glm::mat4 object_m, float margin, glm::vec3 &least, glm::vec3 &most) {
+        glm::vec3 half = 0.5f * (bbox_most - bbox_least) + glm::vec3(margin);
+        least = glm::vec3(std::numeric_limits<float>::max());
+        most = glm::vec3(-std::numeric_limits<float>::max());
+        for (int corner = 0; corner < 8; corner++) {
+            glm::vec4 local((corner & 1) ? half.x : -half.x, (corner & 2) ? half.y : -half.y, (corner & 4) ? half.z : -half.z, 1.0f);
+            glm::vec3 world = glm::vec3(object_m * local);
+            least = glm::min(least, world);
+            most = glm::max(most, world);
+        }
+    }
 
-        // CLEAN UP PIXEL BUFFER
-        glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
-        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
-        glGetError();
-        index = next_index;
+    //
+    // The box fluidsim integrates this model's pressure force over on the
+    // GPU, sampled just outside the surface like pressure_force does
+    //
+    Fluidsim::SurfaceBody surface_body(Fluidsim::Engine &fs, glm::mat4 object_m) {
+        float dv = 1.0001f * sqrt(fs.sclx * fs.sclx + fs.scly * fs.scly + fs.sclz * fs.sclz);
 
+        Fluidsim::SurfaceBody body;
+        body.object_m = object_m;
+        body.extent = glm::vec4(bbox_most - bbox_least, dv);
+        body.samples = glm::uvec4(1);
+        return body;
+    }
 
+    //
+    // Apply a force and torque integrated by Fluidsim::Engine::integrate_surface_forces
+    //
+    void apply_surface_force(const Fluidsim::SurfaceForce &surface_force) {
+        physics_obj->apply_force_to_center(glm::vec3(surface_force.force));
+        physics_obj->apply_torque(glm::vec3(surface_force.torque));
     }
 
     //
@@ -731,9 +800,10 @@ private:
     VertexBuffer *vertex_buffer;
 
     //
-    // The directory this model is loaded from. Used to find textures
-    // and other assets at load-time
+    // The file and directory this model is loaded from. Used to find
+    // textures and other assets at load-time
     //
+    std::string path;
     std::string directory;
 
     //
@@ -5,6 +5,7 @@
 #include <iostream>
 #include <vector>
 #include <btBulletDynamicsCommon.h>
+#include "engine/trace.h"
 
 namespace Fluidsim {
     class Engine;
@@ -53,11 +54,10 @@ struct Physics {
     btDiscreteDynamicsWorld *dynamicsWorld; 
     Fluidsim::Engine *fs = nullptr;
 
-    uint32_t pbos[3];
-
     Physics(); 
 
     void tick(double frame_time, bool tick = false) {
+        TraceZone zone("stepSimulation");
         dynamicsWorld->stepSimulation(frame_time, tick ? 1 : 10);
     }
 };
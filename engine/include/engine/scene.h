@@ -16,6 +16,7 @@ struct Scene {
 
     Scene(std::string filename, VertexBuffer *vertex_buffer);
     ~Scene() {
+        release_mesh_masks();
         delete skybox;
     }
 
@@ -41,21 +42,37 @@ struct Scene {
         return ret_models;
     }
 
-    std::vector<Mask> get_mesh_masks() {
+    //
+    // Voxelized masks of every mesh, with cells of about cell_size in world
+    // space, see Mesh::get_mask. They stay valid until release_mesh_masks,
+    // which the destructor calls
+    //
+    std::vector<Mask> get_mesh_masks(glm::vec3 cell_size) {
         uint32_t i = 0;
         std::vector<Mask> mesh_masks;
         for (std::map<ShaderProgram, std::vector<Model>>::iterator iter = models.begin(); iter != models.end(); iter++) {
             for (Model &model: iter->second) {
                 for (Mesh &mesh: model.get_meshes()) {
                     mesh.parent_model = &model;
-                    mesh_masks.push_back(mesh.get_mask(i));
+                    mesh_masks.push_back(mesh.get_mask(i, cell_size));
                     i = (i + 1) % 16;
                 }
             }
         }
+        issued_masks.insert(issued_masks.end(), mesh_masks.begin(), mesh_masks.end());
         return mesh_masks;
     }
 
+    //
+    // Gives back every mask of get_mesh_masks
+    //
+    void release_mesh_masks() {
+        for (Mask &mask : issued_masks) {
+            Mesh::release_mask(mask);
+        }
+        issued_masks.clear();
+    }
+
 
     Skybox *skybox;
 
@@ -66,4 +83,7 @@ private:
     std::vector<DirLight   > dirlights;
     std::vector<PointLight > pointlights;
     std::vector<Spotlight  > spotlights;
+
+    // MASKS OF get_mesh_masks NOT GIVEN BACK YET
+    std::vector<Mask> issued_masks;
 };
\ No newline at end of file
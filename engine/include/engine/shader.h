@@ -5,9 +5,18 @@
 #include <string>
 #include <glm/glm.hpp>
 #include <vector>
+#include <unordered_map>
 #include "light.h"
 #include "texture.h"
 
+//
+// Location of every active uniform of a linked program by name, array
+// elements included as "name[i]". Filled once at link time so setting a
+// uniform is a hash lookup rather than a glGetUniformLocation call
+//
+typedef std::unordered_map<std::string, GLint> UniformLocations;
+UniformLocations reflect_uniform_locations(uint32_t program);
+
 //
 // Material definitions used by our shaders
 //
@@ -44,6 +53,8 @@ struct ShaderProgram {
     ShaderProgram(): id(UINT32_MAX) {}
     ShaderProgram& operator=(const ShaderProgram& other) {
         id = other.id;
+        uniforms = other.uniforms;
+        return *this;
     }
 
     //
@@ -83,6 +94,11 @@ struct ShaderProgram {
     void setMat3(const std::string &name, const glm::mat3 &mat) const;
     void setMat4(const std::string &name, const glm::mat4 &mat) const;
 
+    //
+    // Location of a uniform, -1 (ignored by glUniform*) if it is not active
+    //
+    GLint location(const std::string &name) const;
+
 
 private:
     //
@@ -90,6 +106,11 @@ private:
     //
     uint32_t id;
 
+    //
+    // Uniform locations, reflected when the program is linked
+    //
+    UniformLocations uniforms;
+
     //
     // Caps on the number of lights you can pass into a shader
     //
@@ -2,6 +2,8 @@
 
 #include <vector>
 #include <string>
+#include <utility>
+#include <algorithm>
 #include <stdint.h>
 #include <glad/glad.h>
 
@@ -26,276 +28,154 @@ struct Texture {
     void use(); 
 };
 
+//
+// GLSL layout qualifier matching a Texture3D internal format, for kernels
+// whose image declarations are parameterized by the field's format
+//
+inline const char *image_format_qualifier(GLenum format) {
+    switch (format) {
+        case GL_R8UI:    return "r8ui";
+        case GL_R32UI:   return "r32ui";
+        case GL_RG32UI:  return "rg32ui";
+        case GL_R16F:    return "r16f";
+        case GL_R32F:    return "r32f";
+        case GL_RGBA32F: return "rgba32f";
+        default:         return "rgba16f";
+    }
+}
+
+//
+// Bytes one texel of a Texture3D internal format takes up
+//
+inline size_t texel_bytes(GLenum format) {
+    switch (format) {
+        case GL_R8UI:    return 1;
+        case GL_R16F:    return 2;
+        case GL_R32UI:   return 4;
+        case GL_R32F:    return 4;
+        case GL_RG32UI:  return 8;
+        case GL_RGBA32F: return 16;
+        default:         return 8;
+    }
+}
+
 struct Texture3D {
     uint32_t id, unit;
     uint32_t width, height, depth;
+    GLenum format;
 
-    Texture3D(): id(UINT32_MAX), unit(UINT32_MAX) {}
-
-    Texture3D(uint32_t width, uint32_t height, uint32_t depth, uint32_t unit, GLint sampling_type=GL_LINEAR) : unit(unit), width(width), height(height), depth(depth) {
-        glGenTextures(1, &id);
-        glBindTexture(GL_TEXTURE_3D, id);
+    Texture3D(): id(UINT32_MAX), unit(UINT32_MAX), format(GL_RGBA16F) {}
 
-        glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-        glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-        glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
-        glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, sampling_type); 
-        glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, sampling_type); 
-
-        glTexImage3D(GL_TEXTURE_3D, 0, GL_RGBA16F, width, height, depth, 0, GL_RGBA, GL_FLOAT, NULL);
-
-        glBindTexture(GL_TEXTURE_3D, 0);
+    Texture3D(uint32_t width, uint32_t height, uint32_t depth, uint32_t unit, GLint sampling_type=GL_LINEAR, GLenum format=GL_RGBA16F) : unit(unit), width(width), height(height), depth(depth), format(format) {
+        allocate(sampling_type, NULL);
     }
 
-    Texture3D(uint32_t width, uint32_t height, uint32_t depth, uint32_t unit, std::vector<float> data, GLint sampling_type=GL_LINEAR) : unit(unit), width(width), height(height), depth(depth) {
-        glGenTextures(1, &id);
-        glBindTexture(GL_TEXTURE_3D, id);
+    //
+    // data always holds 4 floats per texel in RGBA order, channels the
+    // format does not have are dropped and integer formats are rounded
+    //
+    Texture3D(uint32_t width, uint32_t height, uint32_t depth, uint32_t unit, std::vector<float> data, GLint sampling_type=GL_LINEAR, GLenum format=GL_RGBA16F) : unit(unit), width(width), height(height), depth(depth), format(format) {
+        allocate(sampling_type, data.data());
+    }
 
-        glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-        glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-        glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
-        glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, sampling_type); 
-        glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, sampling_type); 
+    bool is_integer() const {
+        return format == GL_R8UI || format == GL_R32UI || format == GL_RG32UI;
+    }
 
-        glTexImage3D(GL_TEXTURE_3D, 0, GL_RGBA16F, width, height, depth, 0, GL_RGBA, GL_FLOAT, data.data());
+    //
+    // Bytes of texel storage, for memory statistics
+    //
+    size_t bytes() const {
+        return (size_t) width * height * depth * texel_bytes(format);
+    }
 
-        glBindTexture(GL_TEXTURE_3D, 0);
+    //
+    // Delete the texture. Copies share the id, so none of them may be used
+    // afterwards
+    //
+    void destroy() {
+        if (id != UINT32_MAX) {
+            glDeleteTextures(1, &id);
+            id = UINT32_MAX;
+        }
     }
 
     void use() {
         glActiveTexture(GL_TEXTURE0 + unit);
         glBindTexture(GL_TEXTURE_3D, id);
-        glBindImageTexture(unit, id, 0, GL_TRUE, 0, GL_READ_WRITE, GL_RGBA16F);
+        glBindImageTexture(unit, id, 0, GL_TRUE, 0, GL_READ_WRITE, format);
     }
 
     void use(uint32_t tex_unit, uint32_t img_unit) {
         glActiveTexture(GL_TEXTURE0 + tex_unit);
         glBindTexture(GL_TEXTURE_3D, id);
-        glBindImageTexture(img_unit, id, 0, GL_TRUE, 0, GL_READ_WRITE, GL_RGBA16F);
+        glBindImageTexture(img_unit, id, 0, GL_TRUE, 0, GL_READ_WRITE, format);
     }
 
-    static std::vector<float> u(uint32_t width, uint32_t height, uint32_t depth) {
-        std::vector<float> data;
-        for (uint32_t h = 0; h < height; h++) {
-            for (uint32_t d = 0; d < depth; d++) {
-                for (uint32_t w = 0; w < width; w++) {
-                    data.push_back(10.0f);
-                    data.push_back(10.0f);
-                    data.push_back(10.0f);
-                    data.push_back(1.0f);
-                }
-            }
+    //
+    // Sets every texel to (r, g, b, a) with glClearTexImage, without a
+    // round trip through host memory. Channels the format does not have are
+    // dropped and integer formats are rounded
+    //
+    void clear(float r, float g = 0.0f, float b = 0.0f, float a = 0.0f) {
+        if (is_integer()) {
+            uint32_t value[4] = {
+                (uint32_t) (std::max(r, 0.0f) + 0.5f), (uint32_t) (std::max(g, 0.0f) + 0.5f),
+                (uint32_t) (std::max(b, 0.0f) + 0.5f), (uint32_t) (std::max(a, 0.0f) + 0.5f)
+            };
+            glClearTexImage(id, 0, GL_RGBA_INTEGER, GL_UNSIGNED_INT, value);
+        } else {
+            float value[4] = { r, g, b, a };
+            glClearTexImage(id, 0, GL_RGBA, GL_FLOAT, value);
         }
-        return data;
     }
-    
-    static std::vector<float> q(uint32_t width, uint32_t height, uint32_t depth) {
-        std::vector<float> data;
-        for (uint32_t h = 0; h < height; h++) {
-            for (uint32_t d = 0; d < depth; d++) {
-                for (uint32_t w = 0; w < width; w++) {
-                    float x = (float)w / (float)width;
-                    float y = (float)h / (float)height;
-                    float z = (float)d / (float)depth;
 
-                    data.push_back(x);
-                    data.push_back(y);
-                    data.push_back(z);
-                    data.push_back(1.0f);
-                }
-            }
+private:
+    void allocate(GLint sampling_type, const float *data) {
+        // Integer textures cannot be filtered
+        if (is_integer()) {
+            sampling_type = GL_NEAREST;
         }
-        return data;
-    }
 
-    static std::vector<float> pressure(uint32_t width, uint32_t height, uint32_t depth) {
-        std::vector<float> data;
-        for (uint32_t h = 0; h < height; h++) {
-            for (uint32_t d = 0; d < depth; d++) {
-                for (uint32_t w = 0; w < width; w++) {
-                    data.push_back(0.0f);
-                    data.push_back(0.0f);
-                    data.push_back(0.0f);
-                    data.push_back(1.0f);
-                }
-            }
-        }
-        return data;
-    }
-
-    static std::vector<float> world_mask(uint32_t width, uint32_t height, uint32_t depth) {
-        std::vector<float> data;
-        for (uint32_t h = 0; h < height; h++) {
-            for (uint32_t d = 0; d < depth; d++) {
-                for (uint32_t w = 0; w < width; w++) {
-                    if (h == 0 || h == height - 1 || d == 0 || d == depth - 1 || w == 0 || w == width - 1) {
-                        // Solid around boundaries
-                        data.push_back(2.0f);
-                        data.push_back(0.0f);
-                        data.push_back(0.0f);
-                        data.push_back(1.0f);
-                    } else if ((h >= (height * 2) / 5 && h <= (height * 3) / 5) &&
-                               (w >= (width * 2) / 5 && w <= (width * 3) / 5) &&
-                               (d >= (depth * 2) / 5 && d <= (depth * 3) / 5)) {
-                        // Box in the center
-                        data.push_back(0.0f);
-                        data.push_back(0.0f);
-                        data.push_back(0.0f);
-                        data.push_back(1.0f);
-                    } else if ((h >= (height * 3) / 10 && h <= (height * 7) / 10) &&
-                               (w >= (width * 3) / 10 && w <= (width * 7) / 10) &&
-                               (d >= (depth * 3) / 10 && d <= (depth * 7) / 10)) {
-                        // Water around the box
-                        data.push_back(2.0f);
-                        data.push_back(0.0f);
-                        data.push_back(0.0f);
-                        data.push_back(1.0f);
-                    } else {
-                        // Water on the Periphery
-                        data.push_back(2.0f);
-                        data.push_back(0.0f);
-                        data.push_back(0.0f);
-                        data.push_back(1.0f);
-                    }
-                }
-            }
-        }
-        return data;
-    }
+        glGenTextures(1, &id);
+        glBindTexture(GL_TEXTURE_3D, id);
 
-    static std::vector<float> zero(uint32_t width, uint32_t height, uint32_t depth) {
-        std::vector<float> data;
-        for (uint32_t h = 0; h < height; h++) {
-            for (uint32_t d = 0; d < depth; d++) {
-                for (uint32_t w = 0; w < width; w++) {
-                    data.push_back(0.0f);
-                    data.push_back(0.0f);
-                    data.push_back(0.0f);
-                    data.push_back(0.0f);
-                }
-            }
-        }
-        return data;
-    }
+        glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, sampling_type); 
+        glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, sampling_type); 
 
-    static std::vector<float> one(uint32_t width, uint32_t height, uint32_t depth) {
-        std::vector<float> data;
-        for (uint32_t h = 0; h < height; h++) {
-            for (uint32_t d = 0; d < depth; d++) {
-                for (uint32_t w = 0; w < width; w++) {
-                    data.push_back(1.0f);
-                    data.push_back(1.0f);
-                    data.push_back(1.0f);
-                    data.push_back(0.0f);
-                }
+        if (!is_integer()) {
+            glTexImage3D(GL_TEXTURE_3D, 0, format, width, height, depth, 0, GL_RGBA, GL_FLOAT, data);
+        } else if (data == NULL) {
+            glTexImage3D(GL_TEXTURE_3D, 0, format, width, height, depth, 0, GL_RGBA_INTEGER, GL_UNSIGNED_INT, NULL);
+        } else {
+            std::vector<uint32_t> rounded((size_t) width * height * depth * 4);
+            for (size_t i = 0; i < rounded.size(); i++) {
+                rounded[i] = (uint32_t) (std::max(data[i], 0.0f) + 0.5f);
             }
+            glTexImage3D(GL_TEXTURE_3D, 0, format, width, height, depth, 0, GL_RGBA_INTEGER, GL_UNSIGNED_INT, rounded.data());
         }
-        return data;
-    }
 
-    static std::vector<float> two(uint32_t width, uint32_t height, uint32_t depth) {
-        std::vector<float> data;
-        for (uint32_t h = 0; h < height; h++) {
-            for (uint32_t d = 0; d < depth; d++) {
-                for (uint32_t w = 0; w < width; w++) {
-                    data.push_back(2.0f);
-                    data.push_back(2.0f);
-                    data.push_back(2.0f);
-                    data.push_back(1.0f);
-                }
-            }
-        }
-        return data;
+        glBindTexture(GL_TEXTURE_3D, 0);
     }
+};
 
-    static std::vector<float> forces(uint32_t width, uint32_t height, uint32_t depth) {
-        std::vector<float> data;
-        for (uint32_t h = 0; h < height; h++) {
-            for (uint32_t d = 0; d < depth; d++) {
-                for (uint32_t w = 0; w < width; w++) {
-                    if (h <= 4) {
-                        data.push_back(0.0f);
-                        data.push_back(-1.0f);
-                        data.push_back(0.0f);
-                        data.push_back(1.0f);
-                    } else {
-                        data.push_back(0.0f);
-                        data.push_back(0.0f);
-                        data.push_back(0.0f);
-                        data.push_back(1.0f);
-                    }
-                }
-            }
-        }
-        return data;
-    }
+//
+// Two identically sized 3D textures for ping-ponging a field between
+// passes: kernels read front and write back, then swap() exchanges the
+// handles so the result becomes the new front without copying anything.
+//
+struct Texture3DPair {
+    Texture3D front;
+    Texture3D back;
 
-    static std::vector<float> temperature(uint32_t width, uint32_t height, uint32_t depth) {
-        std::vector<float> data;
-        for (uint32_t h = 0; h < height; h++) {
-            for (uint32_t d = 0; d < depth; d++) {
-                for (uint32_t w = 0; w < width; w++) {
-                    if (h >= 2 * height / 3) {
-                        data.push_back(293.15f - 200.0f);
-                        data.push_back(0.0f);
-                        data.push_back(0.0f);
-                        data.push_back(0.0f);
-                    } else if (h >= height / 3) {
-                        float r = static_cast <float> (rand()) / static_cast <float> (RAND_MAX);
-                        data.push_back(293.15f - 100.0f);
-                        data.push_back(0.0f);
-                        data.push_back(0.0f);
-                        data.push_back(0.0f);
-                    } else {
-                        data.push_back(293.15f + 500.0f);
-                        data.push_back(0.0f);
-                        data.push_back(0.0f);
-                        data.push_back(0.0f);
-                    }
-                }
-            }
-        }
-        return data;
-    }
+    Texture3DPair() {}
+    Texture3DPair(Texture3D front, Texture3D back) : front(front), back(back) {}
 
-    static std::vector<float> temperatureSolid(uint32_t width, uint32_t height, uint32_t depth) {
-        std::vector<float> data;
-        for (uint32_t h = 0; h < height; h++) {
-            for (uint32_t d = 0; d < depth; d++) {
-                for (uint32_t w = 0; w < width; w++) {
-                    if (h == 0 || h == height - 1 || d == 0 || d == depth - 1 || w == 0 || w == width - 1) {
-                        // sOLID around boundaries
-                        data.push_back(400.0f);
-                        data.push_back(0.0f);
-                        data.push_back(0.0f);
-                        data.push_back(1.0f);
-                    } else if ((h >= (height * 2) / 5 && h <= (height * 3) / 5) &&
-                               (w >= (width * 2) / 5 && w <= (width * 3) / 5) &&
-                               (d >= (depth * 2) / 5 && d <= (depth * 3) / 5)) {
-                        // Box in the center
-                        data.push_back(400.0f);
-                        data.push_back(0.0f);
-                        data.push_back(0.0f);
-                        data.push_back(1.0f);
-                    } else if ((h >= (height * 3) / 10 && h <= (height * 7) / 10) &&
-                               (w >= (width * 3) / 10 && w <= (width * 7) / 10) &&
-                               (d >= (depth * 3) / 10 && d <= (depth * 7) / 10)) {
-                        // Water around the box
-                        data.push_back(400.0f);
-                        data.push_back(0.0f);
-                        data.push_back(0.0f);
-                        data.push_back(1.0f);
-                    } else {
-                        // Water on the Periphery
-                        data.push_back(400.0f);
-                        data.push_back(0.0f);
-                        data.push_back(0.0f);
-                        data.push_back(1.0f);
-                    }
-                }
-            }
-        }
-        return data;
+    void swap() {
+        std::swap(front, back);
     }
 };
 
@@ -0,0 +1,116 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <stdint.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct GpuProfiler;
+
+//
+// Captures CPU zones and the GPU profiler's zones for a number of frames
+// and writes them as Chrome Trace Event JSON, which opens in Perfetto and
+// chrome://tracing. Every CPU thread that opens a zone gets its own track,
+// the GPU gets one more, and frames are marked on the thread that calls
+// begin_frame.
+//
+// GPU zones are placed on the CPU clock with the offset between the two
+// measured when each frame starts, so overlap and stalls between both
+// sides line up. They are only recorded while the GpuProfiler is enabled.
+// Like Physics, the most recently created recorder is reachable through
+// instance
+//
+struct TraceRecorder {
+
+    static TraceRecorder *instance;
+
+    // Used by toggle, e.g. from a hotkey
+    std::string capture_path = "trace.json";
+    int capture_frames = 300;
+
+    TraceRecorder();
+    ~TraceRecorder();
+
+    TraceRecorder(const TraceRecorder &) = delete;
+    TraceRecorder &operator=(const TraceRecorder &) = delete;
+
+    //
+    // Starts a capture that ends after frames calls of begin_frame, or at
+    // stop when frames <= 0. The trace is written to path when it ends
+    //
+    void start(const std::string &path, int frames);
+    void stop();
+    void toggle();
+
+    bool capturing() const {
+        return active;
+    }
+
+    //
+    // Marks the start of a frame, and ends the capture once enough frames
+    // have been recorded
+    //
+    void begin_frame();
+
+    void add_cpu_zone(const char *name, std::chrono::steady_clock::time_point begin, std::chrono::steady_clock::time_point end);
+
+    //
+    // Records the newest resolved frame of a profiler, see
+    // GpuProfiler::on_resolve
+    //
+    void add_gpu_frame(const GpuProfiler &profiler);
+
+private:
+    struct Event {
+        std::string name;
+        int track;
+        int64_t begin_ns, end_ns;
+    };
+
+    std::atomic<bool> active { false };
+    std::mutex mutex;
+
+    std::string path;
+    int frames_left = 0;
+    int frame_index = 0;
+    int64_t capture_start_ns = 0;
+    int64_t frame_start_ns = -1;
+
+    std::vector<Event> events;
+    std::map<std::thread::id, int> tracks;
+    int frame_track = -1;
+
+    int track(std::thread::id thread);
+    void write();
+};
+
+//
+// Times the CPU work of its lifetime as one zone while a trace is captured
+//
+struct TraceZone {
+    TraceZone(const char *name) {
+        if (TraceRecorder::instance && TraceRecorder::instance->capturing()) {
+            recorder = TraceRecorder::instance;
+            this->name = name;
+            begin = std::chrono::steady_clock::now();
+        }
+    }
+
+    ~TraceZone() {
+        if (recorder) {
+            recorder->add_cpu_zone(name, begin, std::chrono::steady_clock::now());
+        }
+    }
+
+    TraceZone(const TraceZone &) = delete;
+    TraceZone &operator=(const TraceZone &) = delete;
+
+private:
+    TraceRecorder *recorder = nullptr;
+    const char *name = nullptr;
+    std::chrono::steady_clock::time_point begin;
+};
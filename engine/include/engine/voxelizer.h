@@ -0,0 +1,71 @@
+#pragma once
+
+#include <glad/glad.h>
+#include <stdint.h>
+#include <glm/glm.hpp>
+#include "engine/kernel.h"
+#include "engine/texture.h"
+
+//
+// Largest number of cells along any axis of a voxelized mask
+//
+const uint32_t MAX_MASK_RESOLUTION = 256;
+
+//
+// Cells along x packed into one texel of a mask
+//
+const uint32_t MASK_WORD_BITS = 32;
+
+//
+// Builds occupancy masks of triangle meshes on the GPU, straight from the
+// vertex and index buffers they are drawn with:
+//
+//   1. Every triangle marks the cells it touches. Each one walks the cell
+//      columns of its projection along its dominant axis and tests the few
+//      cells its plane crosses in each column with the separating axis
+//      test, so big triangles leave no holes and cost what they cover
+//   2. Optionally, cells reachable from the border without crossing the
+//      surface are flood filled as outside, in sweeps along x, y and z
+//      until nothing changes. What is left is the interior
+//   3. The result is bit-packed into the mask, see mask_texture
+//
+// Meshes that are not closed have no interior, the fill leaks through the
+// gaps and only the surface is solid
+//
+struct Voxelizer {
+
+    Voxelizer();
+    ~Voxelizer();
+
+    Voxelizer(const Voxelizer &) = delete;
+    Voxelizer &operator=(const Voxelizer &) = delete;
+
+    //
+    // Cells of the mask along each axis to cover least..most with cells of
+    // cell_size, at least 1 and at most MAX_MASK_RESOLUTION
+    //
+    static glm::uvec3 resolution(glm::vec3 least, glm::vec3 most, glm::vec3 cell_size);
+
+    //
+    // An RG32UI texture for a mask of cells. Texel (x, y, z) holds cells
+    // MASK_WORD_BITS * x + bit, r has the bits of solid cells (surface or
+    // interior) and g the bits of surface cells. That is 2 bits per cell
+    // instead of the 64 of an RGBA16F mask
+    //
+    static Texture3D mask_texture(glm::uvec3 cells, uint32_t unit);
+
+    //
+    // Voxelizes triangle_count triangles of indices in ebo, which point
+    // into the Vertex array in vbo, over the box least..most of their
+    // vertex space, into a mask of cells made by mask_texture. Every texel
+    // of mask is written, so it needs no clearing
+    //
+    void voxelize(uint32_t vbo, uint32_t ebo, uint32_t triangle_count, glm::vec3 least, glm::vec3 most, glm::uvec3 cells, Texture3D *mask, bool fill_interior = true);
+
+private:
+    KernelProgram surface_kernel, fill_kernel, resolve_kernel;
+
+    // PER CELL STATE, REALLOCATED WHEN A MASK OF ANOTHER SIZE COMES ALONG
+    Texture3D state;
+    uint32_t changed_ssbo;
+};
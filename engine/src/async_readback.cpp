@@ -0,0 +1,214 @@
+#include "engine/async_readback.h"
+#include <iostream>
+#include <utility>
+
+//
+// Bytes per texel for the pixel formats and types the readbacks use
+//
+static size_t pixel_size(GLenum format, GLenum type) {
+    size_t components = 4;
+    if (format == GL_RED || format == GL_RED_INTEGER) components = 1;
+    else if (format == GL_RG || format == GL_RG_INTEGER) components = 2;
+    else if (format == GL_RGB || format == GL_RGB_INTEGER) components = 3;
+
+    size_t bytes = 4;
+    if (type == GL_HALF_FLOAT || type == GL_UNSIGNED_SHORT || type == GL_SHORT) bytes = 2;
+    else if (type == GL_UNSIGNED_BYTE || type == GL_BYTE) bytes = 1;
+
+    return components * bytes;
+}
+
+AsyncReadback::AsyncReadback(size_t slot_size, int depth): slots(depth), slot_size(slot_size) {
+    // IMMUTABLE STORAGE SO THE SLOTS CAN STAY MAPPED WHILE THE GPU PACKS INTO THEM
+    for (Slot &slot : slots) {
+        glGenBuffers(1, &slot.pbo);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.pbo);
+        glBufferStorage(GL_PIXEL_PACK_BUFFER, slot_size, nullptr, GL_MAP_READ_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT);
+        slot.data = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, slot_size, GL_MAP_READ_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT);
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+}
+
+AsyncReadback::~AsyncReadback() {
+    destroy();
+}
+
+AsyncReadback::AsyncReadback(AsyncReadback &&other) {
+    *this = std::move(other);
+}
+
+AsyncReadback &AsyncReadback::operator=(AsyncReadback &&other) {
+    if (this != &other) {
+        destroy();
+        slots = std::move(other.slots);
+        slot_size = other.slot_size;
+        next_slot = other.next_slot;
+        latest_slot = other.latest_slot;
+        frames_issued = other.frames_issued;
+        frames_skipped = other.frames_skipped;
+
+        // THE SLOTS HAVE ONE OWNER, THE MOVED FROM READBACK IS LEFT UNALLOCATED
+        other.slots.clear();
+        other.next_slot = 0;
+        other.latest_slot = -1;
+    }
+    return *this;
+}
+
+void AsyncReadback::destroy() {
+    for (Slot &slot : slots) {
+        if (slot.fence) {
+            glDeleteSync(slot.fence);
+        }
+        glDeleteBuffers(1, &slot.pbo);
+    }
+    slots.clear();
+    latest_slot = -1;
+    next_slot = 0;
+}
+
+bool AsyncReadback::read(const Texture3D &texture, GLenum format, GLenum type) {
+    size_t bytes = (size_t) texture.width * texture.height * texture.depth * pixel_size(format, type);
+    if (!begin_slot(bytes)) {
+        return false;
+    }
+
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, slots[next_slot].pbo);
+    glGetTextureImage(texture.id, 0, format, type, bytes, nullptr);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+    slots[next_slot].regions.clear();
+    end_slot();
+    return true;
+}
+
+bool AsyncReadback::read_regions(const Texture3D &texture, std::vector<ReadbackRegion> regions, GLenum format, GLenum type) {
+    // CLIP EVERY BOX TO THE TEXTURE AND PACK THEM BACK TO BACK
+    glm::uvec3 extent(texture.width, texture.height, texture.depth);
+    size_t bytes = 0;
+    for (ReadbackRegion &region : regions) {
+        glm::uvec3 end = glm::min(region.origin + region.size, extent);
+        region.origin = glm::min(region.origin, extent);
+        region.size = glm::max(end, region.origin) - region.origin;
+        region.offset = bytes;
+        bytes += (size_t) region.size.x * region.size.y * region.size.z * pixel_size(format, type);
+    }
+
+    if (!begin_slot(bytes)) {
+        return false;
+    }
+
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, slots[next_slot].pbo);
+    for (const ReadbackRegion &region : regions) {
+        if (region.size.x == 0 || region.size.y == 0 || region.size.z == 0) {
+            continue;
+        }
+
+        size_t region_bytes = (size_t) region.size.x * region.size.y * region.size.z * pixel_size(format, type);
+        glGetTextureSubImage(texture.id, 0, region.origin.x, region.origin.y, region.origin.z, region.size.x, region.size.y, region.size.z,
+                             format, type, region_bytes, (void *) region.offset);
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+    slots[next_slot].regions = regions;
+    end_slot();
+    return true;
+}
+
+bool AsyncReadback::read_buffer(uint32_t buffer, size_t bytes) {
+    if (!begin_slot(bytes)) {
+        return false;
+    }
+
+    glCopyNamedBufferSubData(buffer, slots[next_slot].pbo, 0, 0, bytes);
+    slots[next_slot].regions.clear();
+
+    end_slot();
+    return true;
+}
+
+bool AsyncReadback::begin_slot(size_t bytes) {
+    if (bytes > slot_size) {
+        std::cout << "ERROR::ASYNC_READBACK::COPY OF " << bytes << " BYTES DOES NOT FIT A " << slot_size << " BYTE SLOT" << std::endl;
+        return false;
+    }
+
+    frames_issued++;
+
+    // THE NEXT SLOT IS THE OLDEST ONE, IF IT IS STILL IN FLIGHT SO IS EVERY OTHER
+    poll();
+    if (slots.empty() || slots[next_slot].fence) {
+        frames_skipped++;
+        return false;
+    }
+
+    if (next_slot == latest_slot) {
+        latest_slot = -1;
+    }
+    return true;
+}
+
+void AsyncReadback::end_slot() {
+    Slot &slot = slots[next_slot];
+    slot.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    slot.frame = frames_issued;
+    next_slot = (next_slot + 1) % slots.size();
+}
+
+const void *AsyncReadback::latest() {
+    poll();
+    return latest_slot < 0 ? nullptr : slots[latest_slot].data;
+}
+
+const void *AsyncReadback::wait(uint64_t frame) {
+    for (Slot &slot : slots) {
+        if (slot.frame != frame) {
+            continue;
+        }
+
+        if (slot.fence) {
+            GLenum status = GL_TIMEOUT_EXPIRED;
+            while (status == GL_TIMEOUT_EXPIRED) {
+                status = glClientWaitSync(slot.fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);
+            }
+            if (status == GL_WAIT_FAILED) {
+                std::cout << "ERROR::ASYNC_READBACK::WAIT FAILED" << std::endl;
+                return nullptr;
+            }
+        }
+
+        // THE OLDER SLOTS ARE DONE TOO, LET LATEST CATCH UP WITH THEM
+        poll();
+        return slot.data;
+    }
+    return nullptr;
+}
+
+uint64_t AsyncReadback::latency() const {
+    return latest_slot < 0 ? frames_issued : frames_issued - slots[latest_slot].frame;
+}
+
+const std::vector<ReadbackRegion> &AsyncReadback::latest_regions() const {
+    static const std::vector<ReadbackRegion> none;
+    return latest_slot < 0 ? none : slots[latest_slot].regions;
+}
+
+void AsyncReadback::poll() {
+    // OLDEST FIRST, A SLOT THAT IS NOT DONE MEANS THE NEWER ONES AREN'T EITHER
+    for (size_t i = 0; i < slots.size(); i++) {
+        int index = (next_slot + i) % slots.size();
+        Slot &slot = slots[index];
+        if (!slot.fence) {
+            continue;
+        }
+
+        GLenum status = glClientWaitSync(slot.fence, GL_SYNC_FLUSH_COMMANDS_BIT, 0);
+        if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED) {
+            break;
+        }
+
+        glDeleteSync(slot.fence);
+        slot.fence = 0;
+        latest_slot = index;
+    }
+}
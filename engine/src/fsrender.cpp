@@ -1,9 +1,16 @@
+#include <algorithm>
 #include <iostream>
+#include <limits>
+#include <string>
 #include "engine/fsrender.h"
+#include "engine/voxelizer.h"
 
 FluidDebugRenderer::FluidDebugRenderer(Camera *cam, float plane_width, float plane_height, float plane_z_offset, glm::vec3 grid_offset, glm::vec3 grid_worldspace_whd)
 : draw_shader(ShaderProgram("src/shaders/fsdebug.vert", "src/shaders/fsdebug.frag")), 
-overlay_compute_shader(KernelProgram("src/kernels/fs_overlay.comp")),
+overlay_bodies_shader(KernelProgram("src/kernels/fs_overlay_bodies.comp",
+    "#define MASK_TILE " + std::to_string(MASK_TILE) + "\n#define MAX_BODIES " + std::to_string(MAX_MASK_BODIES) +
+    "\n#define MAX_MASKS " + std::to_string(MAX_MASK_TEXTURES) + "\n#define MASK_TEXTURE_UNIT " + std::to_string(MASK_TEXTURE_UNIT) +
+    "\n#define MASK_WORD_BITS " + std::to_string(MASK_WORD_BITS) + "\n")),
 camera(cam), 
 plane_width(plane_width), 
 plane_height(plane_height), 
@@ -43,6 +50,13 @@ grid_worldspace_whd(grid_worldspace_whd)
 
     glBindBuffer(GL_ARRAY_BUFFER, 0);
     glBindBuffer(GL_VERTEX_ARRAY, 0);
+
+    glGenBuffers(1, &mask_bodies_ssbo);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, mask_bodies_ssbo);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, MAX_MASK_BODIES * sizeof(MaskBody), nullptr, GL_DYNAMIC_DRAW);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+    glGenBuffers(1, &mask_tiles_ssbo);
 }
 
 void FluidDebugRenderer::plane_vectors(glm::vec3 *plane_x, glm::vec3 *plane_y) {
@@ -61,25 +75,163 @@ void FluidDebugRenderer::plane_vectors(glm::vec3 *plane_x, glm::vec3 *plane_y) {
 
 }
 
-void FluidDebugRenderer::overlay_mask(Mask mask, Texture3D *grid, glm::vec3 value_to_write) {
-
-    grid->use(1, 1);
-    mask.tex.use(2, 2);
-
-    overlay_compute_shader.use();
-    overlay_compute_shader.setVec3("u_ValueToWrite", value_to_write);
-    overlay_compute_shader.setVec3("u_Least", glm::vec4(mask.bbox_least, 1.0));
-    overlay_compute_shader.setVec3("u_Most",  glm::vec4(mask.bbox_most, 1.0));
-    overlay_compute_shader.setMat4("u_InverseWorld", glm::inverse(mask.parent->model() * mask.bind_matrix));
-    overlay_compute_shader.setInt("u_Grid", 1);
-    overlay_compute_shader.setInt("u_Mask", 2);
-    overlay_compute_shader.setVec3("u_GridOffset", grid_offset);
-    overlay_compute_shader.setVec3("u_GridDimensions", grid_worldspace_whd);
-    overlay_compute_shader.setVec3("u_GridNumCells", (float)grid->width, (float)grid->height, (float)grid->depth);
-    overlay_compute_shader.setVec3("u_MaskNumCells", (float)mask.tex.width, (float)mask.tex.height, (float)mask.tex.depth);
-
-    glDispatchCompute((GLuint) grid->width, (GLuint) grid->depth, (GLuint) grid->height);
-    glMemoryBarrier(GL_ALL_BARRIER_BITS);
+MaskBody FluidDebugRenderer::mask_body(const Mask &mask, glm::vec3 velocity, float temperature) {
+    glm::mat4 world = mask.parent->model() * mask.bind_matrix;
+
+    MaskBody body;
+    body.inverse_world = glm::inverse(world);
+    body.least = glm::vec4(mask.bbox_least, 1.0f);
+    body.most = glm::vec4(mask.bbox_most, 1.0f);
+    body.velocity = glm::vec4(velocity, 0.0f);
+    body.temperature = glm::vec4(temperature, 0.0f, 0.0f, 0.0f);
+    body.mask = glm::uvec4(mask.cells, mask.tex.id);
+
+    // WORLD BOUNDS OF THE TRANSFORMED BOX, ONLY USED TO BIN BODIES INTO TILES
+    glm::vec3 least(std::numeric_limits<float>::max()), most(-std::numeric_limits<float>::max());
+    for (int corner = 0; corner < 8; corner++) {
+        glm::vec4 local((corner & 1) ? mask.bbox_most.x : mask.bbox_least.x,
+                        (corner & 2) ? mask.bbox_most.y : mask.bbox_least.y,
+                        (corner & 4) ? mask.bbox_most.z : mask.bbox_least.z, 1.0f);
+        glm::vec3 corner_world = glm::vec3(world * local);
+        least = glm::min(least, corner_world);
+        most = glm::max(most, corner_world);
+    }
+    body.world_least = glm::vec4(least, 1.0f);
+    body.world_most = glm::vec4(most, 1.0f);
+    return body;
+}
+
+void FluidDebugRenderer::overlay_masks(std::vector<MaskBody> bodies, Texture3D *solid_mask, Texture3D *velocity_mask, Texture3D *temperature_mask) {
+    if (bodies.size() > (size_t) MAX_MASK_BODIES) {
+        std::cout << "ERROR::FSRENDER::ONLY THE FIRST " << MAX_MASK_BODIES << " OF " << bodies.size() << " MASK BODIES ARE OVERLAID" << std::endl;
+        bodies.resize(MAX_MASK_BODIES);
+    }
+
+    // EVERY DISTINCT MASK GETS A SAMPLER, BODIES ARE UPLOADED WITH ITS INDEX
+    std::vector<uint32_t> mask_textures;
+    size_t kept = 0;
+    for (size_t i = 0; i < bodies.size(); i++) {
+        size_t sampler = std::find(mask_textures.begin(), mask_textures.end(), bodies[i].mask.w) - mask_textures.begin();
+        if (sampler == mask_textures.size()) {
+            if (mask_textures.size() == (size_t) MAX_MASK_TEXTURES) {
+                continue;
+            }
+            mask_textures.push_back(bodies[i].mask.w);
+        }
+        bodies[kept] = bodies[i];
+        bodies[kept].mask.w = sampler;
+        kept++;
+    }
+    if (kept < bodies.size()) {
+        std::cout << "ERROR::FSRENDER::ONLY " << MAX_MASK_TEXTURES << " DISTINCT MASKS ARE OVERLAID, " << bodies.size() - kept << " MASK BODIES ARE DROPPED" << std::endl;
+        bodies.resize(kept);
+    }
+
+    if (!bodies.empty()) {
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, mask_bodies_ssbo);
+        glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, bodies.size() * sizeof(MaskBody), bodies.data());
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    }
+
+    glm::uvec3 cells(solid_mask->width, solid_mask->height, solid_mask->depth);
+    glm::uvec3 tile_counts = (cells + glm::uvec3(MASK_TILE - 1)) / glm::uvec3(MASK_TILE);
+
+    std::vector<MaskTile> tiles;
+    std::vector<uint32_t> tile_indices;
+    std::vector<int32_t> tile_slots((size_t) tile_counts.x * tile_counts.y * tile_counts.z, -1);
+    auto tile_at = [&](uint32_t index) -> MaskTile & {
+        if (tile_slots[index] < 0) {
+            MaskTile tile = {};
+            tile.origin = glm::uvec4(
+                index % tile_counts.x * MASK_TILE,
+                index / tile_counts.x % tile_counts.y * MASK_TILE,
+                index / (tile_counts.x * tile_counts.y) * MASK_TILE, 0);
+            tile_slots[index] = tiles.size();
+            tiles.push_back(tile);
+            tile_indices.push_back(index);
+        }
+        return tiles[tile_slots[index]];
+    };
+
+    // CELLS THAT HELD A BODY LAST TIME GET CLEARED, THE FIRST TIME THAT IS ALL OF THEM
+    if (!masks_cleared) {
+        for (uint32_t index = 0; index < tile_slots.size(); index++) {
+            tile_at(index);
+        }
+        masks_cleared = true;
+    }
+    for (uint32_t index : written_tiles) {
+        tile_at(index);
+    }
+
+    for (size_t i = 0; i < bodies.size(); i++) {
+        // CELLS HOLD GRID POSITIONS WITH Y AND Z SWAPPED, SEE fs_overlay_bodies.comp
+        glm::vec3 least = (glm::vec3(bodies[i].world_least) - grid_offset) / grid_worldspace_whd + 0.5f;
+        glm::vec3 most = (glm::vec3(bodies[i].world_most) - grid_offset) / grid_worldspace_whd + 0.5f;
+        least = glm::floor(least * glm::vec3(cells));
+        most = glm::ceil(most * glm::vec3(cells));
+
+        glm::ivec3 first = glm::max(glm::ivec3(least.x, least.z, least.y), glm::ivec3(0));
+        glm::ivec3 last = glm::min(glm::ivec3(most.x, most.z, most.y), glm::ivec3(cells) - 1);
+        if (first.x > last.x || first.y > last.y || first.z > last.z) {
+            continue;
+        }
+
+        glm::ivec3 first_tile = first / MASK_TILE, last_tile = last / MASK_TILE;
+        for (int z = first_tile.z; z <= last_tile.z; z++) {
+            for (int y = first_tile.y; y <= last_tile.y; y++) {
+                for (int x = first_tile.x; x <= last_tile.x; x++) {
+                    MaskTile &tile = tile_at((z * tile_counts.y + y) * tile_counts.x + x);
+                    tile.bodies[i / 32] |= 1u << (i % 32);
+                }
+            }
+        }
+    }
+
+    written_tiles.clear();
+    for (size_t i = 0; i < tiles.size(); i++) {
+        for (uint32_t bits : tiles[i].bodies) {
+            if (bits) {
+                written_tiles.push_back(tile_indices[i]);
+                break;
+            }
+        }
+    }
+
+    if (tiles.empty()) {
+        return;
+    }
+
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, mask_tiles_ssbo);
+    if (tiles.size() > mask_tiles_capacity) {
+        mask_tiles_capacity = tiles.size();
+        glBufferData(GL_SHADER_STORAGE_BUFFER, mask_tiles_capacity * sizeof(MaskTile), nullptr, GL_DYNAMIC_DRAW);
+    }
+    glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, tiles.size() * sizeof(MaskTile), tiles.data());
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+    solid_mask->use(1, 1);
+    velocity_mask->use(2, 2);
+    temperature_mask->use(3, 3);
+    for (size_t i = 0; i < mask_textures.size(); i++) {
+        glActiveTexture(GL_TEXTURE0 + MASK_TEXTURE_UNIT + i);
+        glBindTexture(GL_TEXTURE_3D, mask_textures[i]);
+    }
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, mask_bodies_ssbo);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, mask_tiles_ssbo);
+
+    // TILES ARE LAID OUT IN ROWS, SO LARGE GRIDS STAY UNDER THE WORKGROUP COUNT LIMITS
+    uint32_t tiles_per_row = std::min<uint32_t>(tiles.size(), 1024);
+    uint32_t rows = (tiles.size() + tiles_per_row - 1) / tiles_per_row;
+
+    overlay_bodies_shader.use();
+    overlay_bodies_shader.setVec3("u_GridOffset", grid_offset);
+    overlay_bodies_shader.setVec3("u_GridDimensions", grid_worldspace_whd);
+    overlay_bodies_shader.setVec3("u_GridNumCells", (float)solid_mask->width, (float)solid_mask->height, (float)solid_mask->depth);
+    overlay_bodies_shader.setInt("u_TileCount", tiles.size());
+    overlay_bodies_shader.setInt("u_TilesPerRow", tiles_per_row);
+
+    overlay_bodies_shader.dispatch(tiles_per_row * MASK_TILE, rows * MASK_TILE, MASK_TILE);
 }
 
 void FluidDebugRenderer::draw(Texture3D grid, bool scalar) {
@@ -0,0 +1,183 @@
+#include <chrono>
+#include <iostream>
+#include "engine/gpu_profiler.h"
+
+GpuProfiler *GpuProfiler::instance = nullptr;
+
+GpuProfiler::GpuProfiler(int depth) {
+    slots.resize(depth < 2 ? 2 : depth);
+    instance = this;
+}
+
+GpuProfiler::~GpuProfiler() {
+    for (Slot &slot : slots) {
+        if (!slot.queries.empty()) {
+            glDeleteQueries(slot.queries.size(), slot.queries.data());
+        }
+    }
+    if (instance == this) {
+        instance = nullptr;
+    }
+}
+
+void GpuProfiler::begin_frame() {
+    recording = nullptr;
+    open.clear();
+
+    // READ BACK EVERY FRAME THAT HAS LANDED, EVEN WHILE DISABLED SO NO SLOT STAYS STUCK
+    poll();
+
+    if (!enabled) {
+        return;
+    }
+
+    Slot &slot = slots[frame_count % slots.size()];
+    if (slot.pending) {
+        frames_skipped++;
+        frame_count++;
+        return;
+    }
+
+    slot.zones.clear();
+    slot.used = 0;
+    slot.frame = frame_count;
+    recording = &slot;
+    timestamp(slot);
+
+    // BOTH CLOCKS NOW, SO THE FRAME CAN BE PLACED ON THE CPU TIMELINE
+    GLint64 gpu_now = 0;
+    glGetInteger64v(GL_TIMESTAMP, &gpu_now);
+    int64_t cpu_now = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    slot.clock_offset_ns = cpu_now - gpu_now;
+}
+
+void GpuProfiler::end_frame() {
+    if (recording) {
+        // ZONES LEFT OPEN END WITH THE FRAME
+        for (int zone : open) {
+            if (zone >= 0) recording->zones[zone].end_query = timestamp(*recording);
+        }
+
+        recording->frame_end = timestamp(*recording);
+        recording->pending = true;
+        recording = nullptr;
+        frame_count++;
+    }
+    open.clear();
+}
+
+void GpuProfiler::begin(const char *name) {
+    if (!recording) {
+        open.push_back(-1);
+        return;
+    }
+
+    Zone zone;
+    zone.name = name;
+    zone.depth = open.size();
+    zone.begin_query = timestamp(*recording);
+    zone.end_query = zone.begin_query;
+
+    open.push_back(recording->zones.size());
+    recording->zones.push_back(zone);
+}
+
+void GpuProfiler::end() {
+    if (open.empty()) {
+        return;
+    }
+
+    int zone = open.back();
+    open.pop_back();
+    if (recording && zone >= 0) {
+        recording->zones[zone].end_query = timestamp(*recording);
+    }
+}
+
+void GpuProfiler::wait() {
+    glFinish();
+    poll();
+}
+
+uint32_t GpuProfiler::timestamp(Slot &slot) {
+    if (slot.used == slot.queries.size()) {
+        size_t grown = slot.queries.empty() ? 64 : slot.queries.size() * 2;
+        size_t first = slot.queries.size();
+        slot.queries.resize(grown);
+        glGenQueries(grown - first, slot.queries.data() + first);
+    }
+
+    glQueryCounter(slot.queries[slot.used], GL_TIMESTAMP);
+    return slot.used++;
+}
+
+void GpuProfiler::poll() {
+    // OLDEST FIRST, SO THE STATISTICS SEE FRAMES IN ORDER
+    for (size_t i = 0; i < slots.size(); i++) {
+        Slot &slot = slots[(frame_count + i) % slots.size()];
+        if (!slot.pending) {
+            continue;
+        }
+
+        GLint available = 0;
+        glGetQueryObjectiv(slot.queries[slot.frame_end], GL_QUERY_RESULT_AVAILABLE, &available);
+        if (available) {
+            resolve(slot);
+        }
+    }
+}
+
+void GpuProfiler::resolve(Slot &slot) {
+    slot.pending = false;
+    if (slot.frame < resolved_frame && frames_resolved > 0) {
+        return;
+    }
+
+    std::vector<GLuint64> times(slot.used);
+    for (uint32_t i = 0; i < slot.used; i++) {
+        glGetQueryObjectui64v(slot.queries[i], GL_QUERY_RESULT, &times[i]);
+    }
+
+    auto ms = [&](uint32_t query) {
+        return (double) (times[query] - times[0]) / 1e6;
+    };
+
+    resolved_zones.clear();
+    for (const Zone &zone : slot.zones) {
+        resolved_zones.push_back({ zone.name, zone.depth, ms(zone.begin_query), ms(zone.end_query) });
+    }
+    resolved_frame_ms = ms(slot.frame_end);
+    resolved_frame_cpu_ns = (int64_t) times[0] + slot.clock_offset_ns;
+    resolved_frame = slot.frame;
+
+    // SUM EACH NAME OVER THE FRAME, THEN FOLD IT INTO THE ROLLING AVERAGE
+    for (GpuZoneStats &stats : zone_stats) {
+        stats.last_ms = 0.0;
+        stats.calls = 0;
+    }
+    for (const GpuZoneTiming &zone : resolved_zones) {
+        GpuZoneStats *stats = nullptr;
+        for (GpuZoneStats &candidate : zone_stats) {
+            if (candidate.name == zone.name) {
+                stats = &candidate;
+                break;
+            }
+        }
+        if (!stats) {
+            zone_stats.push_back({ zone.name, zone.depth, -1.0, 0.0, 0 });
+            stats = &zone_stats.back();
+        }
+
+        stats->last_ms += zone.end_ms - zone.start_ms;
+        stats->calls++;
+    }
+    for (GpuZoneStats &stats : zone_stats) {
+        stats.average_ms = stats.average_ms < 0.0 ? stats.last_ms : stats.average_ms + smoothing * (stats.last_ms - stats.average_ms);
+    }
+
+    frames_resolved++;
+
+    if (on_resolve) {
+        on_resolve(*this);
+    }
+}
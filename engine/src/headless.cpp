@@ -0,0 +1,98 @@
+#include <glad/glad.h>
+#include <stdlib.h>
+#include <string.h>
+#include <iostream>
+#include "engine/headless.h"
+
+static bool has_extension(const char *extensions, const char *name) {
+    if (extensions == nullptr) {
+        return false;
+    }
+
+    size_t length = strlen(name);
+    for (const char *at = strstr(extensions, name); at != nullptr; at = strstr(at + length, name)) {
+        bool starts = at == extensions || at[-1] == ' ';
+        bool ends = at[length] == ' ' || at[length] == '\0';
+        if (starts && ends) return true;
+    }
+    return false;
+}
+
+HeadlessContext::HeadlessContext(int major, int minor) {
+
+    // SURFACELESS NEEDS NO DISPLAY SERVER OR RENDER NODE, OTHERWISE TAKE WHATEVER EGL DEFAULTS TO
+    const char *client_extensions = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+    PFNEGLGETPLATFORMDISPLAYEXTPROC get_platform_display = (PFNEGLGETPLATFORMDISPLAYEXTPROC) eglGetProcAddress("eglGetPlatformDisplayEXT");
+    if (get_platform_display && has_extension(client_extensions, "EGL_MESA_platform_surfaceless")) {
+        display = get_platform_display(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+    }
+    if (display == EGL_NO_DISPLAY) {
+        display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+    }
+
+    if (display == EGL_NO_DISPLAY || !eglInitialize(display, NULL, NULL) || !eglBindAPI(EGL_OPENGL_API)) {
+        std::cout << "ERROR::HEADLESS::NO EGL DISPLAY WITH DESKTOP OPENGL" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    // NOTHING IS EVER DRAWN TO A DEFAULT FRAMEBUFFER, SO NO CONFIG IS NEEDED WHEN THE DRIVER ALLOWS IT
+    const char *extensions = eglQueryString(display, EGL_EXTENSIONS);
+    EGLConfig config = EGL_NO_CONFIG_KHR;
+    if (!has_extension(extensions, "EGL_KHR_no_config_context") || !has_extension(extensions, "EGL_KHR_surfaceless_context")) {
+        const EGLint config_attribs[] = {
+            EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+            EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+            EGL_NONE
+        };
+        EGLint count = 0;
+        if (!eglChooseConfig(display, config_attribs, &config, 1, &count) || count == 0) {
+            std::cout << "ERROR::HEADLESS::NO PBUFFER CONFIG" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    auto create_context = [&](int context_major, int context_minor) {
+        const EGLint context_attribs[] = {
+            EGL_CONTEXT_MAJOR_VERSION, context_major,
+            EGL_CONTEXT_MINOR_VERSION, context_minor,
+            EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+            EGL_NONE
+        };
+        return eglCreateContext(display, config, EGL_NO_CONTEXT, context_attribs);
+    };
+
+    // OLDER MESA LLVMPIPE STOPS AT 4.5, WHICH THE KERNELS STILL COMPILE FOR (SEE KernelProgram)
+    context = create_context(major, minor);
+    if (context == EGL_NO_CONTEXT && major * 10 + minor > 45) {
+        context = create_context(4, 5);
+    }
+    if (context == EGL_NO_CONTEXT) {
+        std::cout << "ERROR::HEADLESS::FAILED TO CREATE OPENGL " << major << "." << minor << " OR 4.5 CONTEXT, LLVMPIPE NEEDS MESA 20.3 OR NEWER" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    // A 1x1 PBUFFER STANDS IN FOR THE SURFACE WHEN THE CONTEXT CAN'T BE MADE CURRENT WITHOUT ONE
+    if (config != EGL_NO_CONFIG_KHR) {
+        const EGLint pbuffer_attribs[] = { EGL_WIDTH, 1, EGL_HEIGHT, 1, EGL_NONE };
+        surface = eglCreatePbufferSurface(display, config, pbuffer_attribs);
+    }
+
+    if (!eglMakeCurrent(display, surface, surface, context)) {
+        std::cout << "ERROR::HEADLESS::FAILED TO MAKE CONTEXT CURRENT" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    if (!gladLoadGLLoader((GLADloadproc) eglGetProcAddress)) {
+        std::cout << "Failed to initialize GLAD" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+}
+
+HeadlessContext::~HeadlessContext() {
+    eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    if (surface != EGL_NO_SURFACE) {
+        eglDestroySurface(display, surface);
+    }
+    eglDestroyContext(display, context);
+    eglTerminate(display);
+}
@@ -1,4 +1,7 @@
 #include "engine/imgui-instance.h"
+#include "engine/gpu_profiler.h"
+
+#include <algorithm>
 
 bool ImGuiInstance::gui_enabled = false; 
 bool ImGuiInstance::render_normals = true; 
@@ -9,6 +12,9 @@ bool ImGuiInstance::fluid_pressure_overlay = true;
 bool ImGuiInstance::fluid_velocity_overlay = false;
 bool ImGuiInstance::fsdebug_scalar = false;
 bool ImGuiInstance::physics_enabled = false;
+bool ImGuiInstance::gpu_pressure_forces = true;
+bool ImGuiInstance::cpu_fluid_backend = false;
+bool ImGuiInstance::gpu_profiler = false;
 bool ImGuiInstance::draw_model_bb = false;
 bool ImGuiInstance::msaa = false;
 bool ImGuiInstance::reinhard_hdr = true;
@@ -67,6 +73,9 @@ void ImGuiInstance::draw() {
         ImGui::Text("Render Settings");
 
         ImGui::Checkbox("Physics Enabled", &physics_enabled);
+        ImGui::Checkbox("GPU Pressure Forces", &gpu_pressure_forces);
+        ImGui::Checkbox("CPU Fluid Backend", &cpu_fluid_backend);
+        ImGui::Checkbox("GPU Profiler", &gpu_profiler);
         if (ImGui::Button("Tick Physics") && !physics_enabled) {
             Physics::instance->tick(1.0 / 60.0, true);
         }
@@ -110,10 +119,83 @@ void ImGuiInstance::draw() {
         ImGui::Text("counter = %d", counter);
 
         ImGui::End();
+
+        if (gpu_profiler) {
+            draw_gpu_profiler();
+        }
+
         ImGui::Render();
         ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
 }
 
+//
+// Per-zone rolling averages of the GPU profiler, and a timeline of the
+// newest resolved frame with one row per nesting depth
+//
+void ImGuiInstance::draw_gpu_profiler() {
+    GpuProfiler *profiler = GpuProfiler::instance;
+    if (!profiler) {
+        return;
+    }
+
+    ImGui::Begin("GPU Profiler", &gpu_profiler);
+    ImGui::Text("Frame %.3f ms (%llu resolved, %llu skipped)", profiler->latest_frame_ms(),
+                (unsigned long long) profiler->frames_resolved, (unsigned long long) profiler->frames_skipped);
+    ImGui::SliderFloat("Smoothing", &profiler->smoothing, 0.01f, 1.0f);
+
+    // ZONE COLORS ARE HASHED FROM THE NAME SO THEY STAY PUT BETWEEN FRAMES
+    auto zone_color = [](const std::string &name, float alpha) {
+        uint32_t hash = 2166136261u;
+        for (char c : name) hash = (hash ^ (uint8_t) c) * 16777619u;
+        return (ImU32) ImColor::HSV((hash % 360) / 360.0f, 0.6f, 0.8f, alpha);
+    };
+
+    ImGui::Separator();
+    ImGui::Columns(3, "gpu_profiler_zones");
+    ImGui::Text("Zone"); ImGui::NextColumn();
+    ImGui::Text("Average ms"); ImGui::NextColumn();
+    ImGui::Text("Last ms (calls)"); ImGui::NextColumn();
+    ImGui::Separator();
+    for (const GpuZoneStats &stats : profiler->stats()) {
+        ImGui::TextColored(ImColor(zone_color(stats.name, 1.0f)), "%*s%s", stats.depth * 2, "", stats.name.c_str()); ImGui::NextColumn();
+        ImGui::Text("%.3f", stats.average_ms); ImGui::NextColumn();
+        ImGui::Text("%.3f (%u)", stats.last_ms, stats.calls); ImGui::NextColumn();
+    }
+    ImGui::Columns(1);
+    ImGui::Separator();
+
+    const std::vector<GpuZoneTiming> &zones = profiler->latest_frame();
+    int depth = 1;
+    for (const GpuZoneTiming &zone : zones) {
+        depth = std::max(depth, zone.depth + 1);
+    }
+
+    const float row_height = ImGui::GetTextLineHeightWithSpacing();
+    ImVec2 origin = ImGui::GetCursorScreenPos();
+    float width = std::max(ImGui::GetContentRegionAvail().x, 100.0f);
+    double frame_ms = std::max(profiler->latest_frame_ms(), 1e-6);
+
+    ImDrawList *draw_list = ImGui::GetWindowDrawList();
+    draw_list->AddRectFilled(origin, ImVec2(origin.x + width, origin.y + depth * row_height), IM_COL32(30, 30, 30, 255));
+
+    for (const GpuZoneTiming &zone : zones) {
+        ImVec2 least(origin.x + (float) (zone.start_ms / frame_ms) * width, origin.y + zone.depth * row_height);
+        ImVec2 most(origin.x + (float) (zone.end_ms / frame_ms) * width, least.y + row_height - 1.0f);
+        most.x = std::max(most.x, least.x + 1.0f);
+
+        draw_list->AddRectFilled(least, most, zone_color(zone.name, 1.0f));
+        if (most.x - least.x > ImGui::CalcTextSize(zone.name.c_str()).x) {
+            draw_list->AddText(least, IM_COL32(0, 0, 0, 255), zone.name.c_str());
+        }
+        if (ImGui::IsMouseHoveringRect(least, most)) {
+            ImGui::SetTooltip("%s\n%.3f ms (at %.3f ms)", zone.name.c_str(), zone.end_ms - zone.start_ms, zone.start_ms);
+        }
+    }
+    ImGui::Dummy(ImVec2(width, depth * row_height));
+
+    ImGui::End();
+}
+
 bool ImGuiInstance::mouse_over_imgui() {
     return ImGui::GetIO().WantCaptureMouse;
 }
\ No newline at end of file
@@ -1,5 +1,6 @@
 #include <stdlib.h>
 #include "engine/kernel.h"
+#include "engine/gpu_profiler.h"
 #include <string>
 #include <fstream>
 #include <sstream>
@@ -7,7 +8,8 @@
 #include <string>
 
 KernelProgram::KernelProgram(
-    std::string kernel_path)
+    std::string kernel_path,
+    std::string defines)
 {
 
     std::string kernel_code;
@@ -32,6 +34,24 @@ KernelProgram::KernelProgram(
         exit(EXIT_FAILURE);
     }
 
+    // A 4.5 context compiles the kernels as GLSL 450, they use nothing newer
+    GLint major = 0, minor = 0;
+    glGetIntegerv(GL_MAJOR_VERSION, &major);
+    glGetIntegerv(GL_MINOR_VERSION, &minor);
+    if ((major < 4 || (major == 4 && minor < 6)) && kernel_code.compare(0, 12, "#version 460") == 0) {
+        kernel_code.replace(0, 12, "#version 450");
+    }
+
+    // Inject defines after the #version directive, which has to come first
+    if (!defines.empty()) {
+        size_t insert_at = 0;
+        if (kernel_code.compare(0, 8, "#version") == 0) {
+            insert_at = kernel_code.find('\n');
+            insert_at = insert_at == std::string::npos ? kernel_code.size() : insert_at + 1;
+        }
+        kernel_code.insert(insert_at, defines);
+    }
+
     const char* kernel_code_cstr = kernel_code.c_str();
     uint32_t kernel;
 
@@ -46,60 +66,92 @@ KernelProgram::KernelProgram(
     check_link_errors(id);
 
     glDeleteShader(kernel);
+
+    uniforms = reflect_uniform_locations(id);
+
+    GLint size[3];
+    glGetProgramiv(id, GL_COMPUTE_WORK_GROUP_SIZE, size);
+    local_size = glm::uvec3(size[0], size[1], size[2]);
+}
+
+void KernelProgram::destroy() {
+    if (id != UINT32_MAX) {
+        glDeleteProgram(id);
+        id = UINT32_MAX;
+    }
 }
 
 void KernelProgram::setBool(const std::string &name, bool value) const {
-    glUniform1i(glGetUniformLocation(id, name.c_str()), (int)value); 
+    glUniform1i(location(name), (int)value); 
 }
 
 void KernelProgram::setInt(const std::string &name, int value) const {
-    glUniform1i(glGetUniformLocation(id, name.c_str()), value); 
+    glUniform1i(location(name), value); 
 }
 
 void KernelProgram::setFloat(const std::string &name, float value) const {
-    glUniform1f(glGetUniformLocation(id, name.c_str()), value); 
+    glUniform1f(location(name), value); 
 }
 
 void KernelProgram::setVec2(const std::string &name, const glm::vec2 &value) const {
-    glUniform2fv(glGetUniformLocation(id, name.c_str()), 1, &value[0]); 
+    glUniform2fv(location(name), 1, &value[0]); 
 }
 
 void KernelProgram::setVec2(const std::string &name, float x, float y) const {
-    glUniform2f(glGetUniformLocation(id, name.c_str()), x, y); 
+    glUniform2f(location(name), x, y); 
 }
 
 void KernelProgram::setVec3(const std::string &name, const glm::vec3 &value) const {
-    glUniform3fv(glGetUniformLocation(id, name.c_str()), 1, &value[0]); 
+    glUniform3fv(location(name), 1, &value[0]); 
 }
 
 void KernelProgram::setVec3(const std::string &name, float x, float y, float z) const {
-    glUniform3f(glGetUniformLocation(id, name.c_str()), x, y, z); 
+    glUniform3f(location(name), x, y, z); 
 }
 
 void KernelProgram::setVec4(const std::string &name, const glm::vec4 &value) const {
-    glUniform4fv(glGetUniformLocation(id, name.c_str()), 1, &value[0]); 
+    glUniform4fv(location(name), 1, &value[0]); 
 }
 
 void KernelProgram::setVec4(const std::string &name, float x, float y, float z, float w)  {
-    glUniform4f(glGetUniformLocation(id, name.c_str()), x, y, z, w); 
+    glUniform4f(location(name), x, y, z, w); 
 }
 
 void KernelProgram::setMat2(const std::string &name, const glm::mat2 &mat) const {
-    glUniformMatrix2fv(glGetUniformLocation(id, name.c_str()), 1, GL_FALSE, &mat[0][0]);
+    glUniformMatrix2fv(location(name), 1, GL_FALSE, &mat[0][0]);
 }
 
 void KernelProgram::setMat3(const std::string &name, const glm::mat3 &mat) const {
-    glUniformMatrix3fv(glGetUniformLocation(id, name.c_str()), 1, GL_FALSE, &mat[0][0]);
+    glUniformMatrix3fv(location(name), 1, GL_FALSE, &mat[0][0]);
 }
 
 void KernelProgram::setMat4(const std::string &name, const glm::mat4 &mat) const {
-    glUniformMatrix4fv(glGetUniformLocation(id, name.c_str()), 1, GL_FALSE, &mat[0][0]);
+    glUniformMatrix4fv(location(name), 1, GL_FALSE, &mat[0][0]);
+}
+
+GLint KernelProgram::location(const std::string &name) const {
+    auto it = uniforms.find(name);
+    return it == uniforms.end() ? -1 : it->second;
 }
 
 void KernelProgram::use() {
     glUseProgram(id);
 }
 
+void KernelProgram::dispatch(uint32_t w, uint32_t h, uint32_t d) const {
+    glDispatchCompute(
+        (GLuint) (w + local_size.x - 1) / local_size.x,
+        (GLuint) (h + local_size.y - 1) / local_size.y,
+        (GLuint) (d + local_size.z - 1) / local_size.z
+    );
+}
+
+void KernelProgram::dispatch_indirect(uint32_t buffer, GLintptr offset) const {
+    glBindBuffer(GL_DISPATCH_INDIRECT_BUFFER, buffer);
+    glDispatchComputeIndirect(offset);
+    glBindBuffer(GL_DISPATCH_INDIRECT_BUFFER, 0);
+}
+
 void KernelProgram::check_link_errors(uint32_t shader)
 {
     GLint success;
@@ -123,4 +175,156 @@ void KernelProgram::check_compile_errors(uint32_t shader)
         glGetShaderInfoLog(shader, 1024, NULL, infoLog);
         std::cout << "Error compiling shader:\n" << infoLog << std::endl;
     }
-}
\ No newline at end of file
+}
+
+ComputeResource ComputeResource::image(const Texture3D &texture) {
+    const Texture3D *t = &texture;
+    return { [t]() { return t->id; }, false, COMPUTE_ACCESS_IMAGE };
+}
+
+ComputeResource ComputeResource::texture(const Texture3D &texture) {
+    const Texture3D *t = &texture;
+    return { [t]() { return t->id; }, false, COMPUTE_ACCESS_TEXTURE };
+}
+
+ComputeResource ComputeResource::texture_update(const Texture3D &texture) {
+    const Texture3D *t = &texture;
+    return { [t]() { return t->id; }, false, COMPUTE_ACCESS_TEXTURE_UPDATE };
+}
+
+ComputeResource ComputeResource::storage(const uint32_t &buffer) {
+    const uint32_t *b = &buffer;
+    return { [b]() { return *b; }, true, COMPUTE_ACCESS_STORAGE };
+}
+
+ComputeResource ComputeResource::buffer_update(const uint32_t &buffer) {
+    const uint32_t *b = &buffer;
+    return { [b]() { return *b; }, true, COMPUTE_ACCESS_BUFFER_UPDATE };
+}
+
+ComputeResource ComputeResource::indirect(const uint32_t &buffer) {
+    const uint32_t *b = &buffer;
+    return { [b]() { return *b; }, true, COMPUTE_ACCESS_INDIRECT };
+}
+
+std::vector<ComputeBarriers::Access> ComputeBarriers::resolve(const std::vector<ComputeResource> &resources) {
+    std::vector<Access> accesses;
+    accesses.reserve(resources.size());
+    for (const ComputeResource &resource : resources) {
+        // Textures and buffers have separate id namespaces
+        uint64_t key = ((uint64_t) resource.buffer << 32) | resource.id();
+        accesses.push_back({ key, resource.access });
+    }
+    return accesses;
+}
+
+GLbitfield ComputeBarriers::barrier_bit(ComputeAccess access) {
+    switch (access) {
+        case COMPUTE_ACCESS_IMAGE:           return GL_SHADER_IMAGE_ACCESS_BARRIER_BIT;
+        case COMPUTE_ACCESS_TEXTURE:         return GL_TEXTURE_FETCH_BARRIER_BIT;
+        case COMPUTE_ACCESS_STORAGE:         return GL_SHADER_STORAGE_BARRIER_BIT;
+        case COMPUTE_ACCESS_TEXTURE_UPDATE:  return GL_TEXTURE_UPDATE_BARRIER_BIT;
+        case COMPUTE_ACCESS_BUFFER_UPDATE:   return GL_BUFFER_UPDATE_BARRIER_BIT;
+        case COMPUTE_ACCESS_INDIRECT:        return GL_COMMAND_BARRIER_BIT;
+    }
+    return GL_ALL_BARRIER_BITS;
+}
+
+bool ComputeBarriers::shader_write(ComputeAccess access) {
+    return access == COMPUTE_ACCESS_IMAGE || access == COMPUTE_ACCESS_STORAGE;
+}
+
+void ComputeBarriers::begin_pass(const std::vector<ComputeResource> &reads, const std::vector<ComputeResource> &writes) {
+    pass_reads = resolve(reads);
+    pass_writes = resolve(writes);
+
+    GLbitfield needed = 0;
+
+    // Read after write: the reader's kind of access has to see the write
+    for (const Access &r : pass_reads) {
+        auto it = written.find(r.key);
+        if (it != written.end()) {
+            needed |= barrier_bit(r.access) & ~it->second;
+        }
+    }
+
+    for (const Access &w : pass_writes) {
+        // Write after write
+        auto it = written.find(w.key);
+        if (it != written.end()) {
+            needed |= barrier_bit(w.access) & ~it->second;
+        }
+
+        // Write after read, the earlier readers must be done with the data
+        if (shader_write(w.access) && read.count(w.key)) {
+            needed |= barrier_bit(w.access);
+        }
+    }
+
+    if (needed) {
+        glMemoryBarrier(needed);
+        barrier_count++;
+
+        for (auto &entry : written) {
+            entry.second |= needed;
+        }
+        if (needed & (GL_SHADER_IMAGE_ACCESS_BARRIER_BIT | GL_SHADER_STORAGE_BARRIER_BIT)) {
+            read.clear();
+        }
+    }
+}
+
+void ComputeBarriers::end_pass() {
+    for (const Access &r : pass_reads) {
+        if (r.access == COMPUTE_ACCESS_IMAGE || r.access == COMPUTE_ACCESS_TEXTURE || r.access == COMPUTE_ACCESS_STORAGE) {
+            read.insert(r.key);
+        }
+    }
+
+    // Writes made by other GL commands are ordered with everything after them
+    for (const Access &w : pass_writes) {
+        if (shader_write(w.access)) {
+            written[w.key] = 0;
+        } else {
+            written.erase(w.key);
+        }
+    }
+
+    pass_count++;
+}
+
+void ComputeBarriers::flush(GLbitfield bits) {
+    GLbitfield needed = 0;
+    for (const auto &entry : written) {
+        needed |= bits & ~entry.second;
+    }
+
+    if (needed) {
+        glMemoryBarrier(needed);
+        barrier_count++;
+
+        for (auto &entry : written) {
+            entry.second |= needed;
+        }
+        if (needed & (GL_SHADER_IMAGE_ACCESS_BARRIER_BIT | GL_SHADER_STORAGE_BARRIER_BIT)) {
+            read.clear();
+        }
+    }
+}
+
+void ComputeGraph::add(std::string name, std::vector<ComputeResource> reads, std::vector<ComputeResource> writes, std::function<void()> run) {
+    passes.push_back({ name, reads, writes, run });
+}
+
+void ComputeGraph::replay() {
+    for (ComputePass &pass : passes) {
+        GpuZone zone(pass.name.c_str());
+        barriers->begin_pass(pass.reads, pass.writes);
+        pass.run();
+        barriers->end_pass();
+    }
+}
+
+void ComputeGraph::clear() {
+    passes.clear();
+}
@@ -0,0 +1,202 @@
+#include "engine/kernel_tuner.h"
+#include "engine/texture.h"
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <vector>
+
+//
+// Workgroup shapes to try, all within the 1024 invocations every GL 4.3+
+// implementation has to support
+//
+static const glm::uvec3 candidates[] = {
+    { 4, 4, 4 },
+    { 8, 4, 4 },
+    { 8, 8, 2 },
+    { 8, 8, 4 },
+    { 16, 4, 2 },
+    { 16, 8, 1 },
+    { 32, 2, 2 },
+    { 32, 4, 1 },
+};
+
+static const int timed_dispatches = 5;
+
+KernelTuner::KernelTuner(std::string cache_path): cache_path(cache_path), dirty(false) {
+    renderer = std::string((const char *) glGetString(GL_RENDERER));
+
+    std::ifstream file(cache_path);
+    std::string line;
+    while (std::getline(file, line)) {
+        // <key> TAB <x> <y> <z>
+        size_t split = line.rfind('\t');
+        if (split == std::string::npos) continue;
+
+        std::istringstream value(line.substr(split + 1));
+        glm::uvec3 local_size;
+        if (value >> local_size.x >> local_size.y >> local_size.z) {
+            cache[line.substr(0, split)] = local_size;
+        }
+    }
+}
+
+KernelProgram KernelTuner::load(std::string kernel_path, uint32_t w, uint32_t h, uint32_t d, std::string defines) {
+    std::string flat_defines = defines;
+    for (char &c : flat_defines) {
+        if (c == '\n' || c == '\t') c = ' ';
+    }
+
+    std::ostringstream key;
+    key << renderer << '\t' << kernel_path << '\t' << flat_defines << '\t' << w << 'x' << h << 'x' << d;
+
+    auto it = cache.find(key.str());
+    glm::uvec3 local_size;
+    if (it != cache.end()) {
+        local_size = it->second;
+    } else {
+        local_size = tune(kernel_path, defines, w, h, d);
+        cache[key.str()] = local_size;
+        dirty = true;
+    }
+
+    return KernelProgram(kernel_path, local_size_defines(local_size) + defines);
+}
+
+void KernelTuner::save() {
+    if (!dirty) return;
+
+    std::ofstream file(cache_path);
+    if (!file) {
+        std::cout << "ERROR::KERNEL_TUNER::COULD_NOT_WRITE_CACHE " << cache_path << std::endl;
+        return;
+    }
+
+    for (auto &entry : cache) {
+        file << entry.first << '\t' << entry.second.x << ' ' << entry.second.y << ' ' << entry.second.z << '\n';
+    }
+    dirty = false;
+}
+
+glm::uvec3 KernelTuner::tune(const std::string &kernel_path, const std::string &defines, uint32_t w, uint32_t h, uint32_t d) {
+    GLint max_invocations;
+    glGetIntegerv(GL_MAX_COMPUTE_WORK_GROUP_INVOCATIONS, &max_invocations);
+
+    // Every image and sampler the kernel uses gets its own scratch grid, and
+    // every uniform block not in uniform_blocks a zeroed scratch buffer, the
+    // contents do not matter for timing
+    std::vector<Texture3D> scratch;
+    std::vector<uint32_t> scratch_blocks;
+
+    uint32_t query;
+    glGenQueries(1, &query);
+
+    glm::uvec3 best = candidates[0];
+    GLuint64 best_time = UINT64_MAX;
+
+    for (const glm::uvec3 &candidate : candidates) {
+        if (candidate.x * candidate.y * candidate.z > (uint32_t) max_invocations) continue;
+
+        KernelProgram kernel(kernel_path, local_size_defines(candidate) + defines);
+        kernel.use();
+
+        GLint num_uniforms = 0;
+        glGetProgramiv(kernel.id, GL_ACTIVE_UNIFORMS, &num_uniforms);
+
+        uint32_t unit = 0;
+        for (GLint i = 0; i < num_uniforms; i++) {
+            char name[256];
+            GLint size;
+            GLenum type;
+            glGetActiveUniform(kernel.id, i, sizeof(name), NULL, &size, &type, name);
+
+            if (type != GL_IMAGE_3D && type != GL_SAMPLER_3D) continue;
+
+            // Arrays of samplers/images get one scratch texture per element
+            GLint location = glGetUniformLocation(kernel.id, name);
+            for (GLint element = 0; element < size; element++) {
+                if (unit == scratch.size()) {
+                    scratch.push_back(Texture3D(w, h, d, 0));
+                }
+                scratch[unit].use(unit, unit);
+                glUniform1i(location + element, unit);
+                unit++;
+            }
+        }
+
+        GLint num_blocks = 0;
+        glGetProgramiv(kernel.id, GL_ACTIVE_UNIFORM_BLOCKS, &num_blocks);
+        for (GLint i = 0; i < num_blocks; i++) {
+            GLint binding, data_size;
+            glGetActiveUniformBlockiv(kernel.id, i, GL_UNIFORM_BLOCK_BINDING, &binding);
+            glGetActiveUniformBlockiv(kernel.id, i, GL_UNIFORM_BLOCK_DATA_SIZE, &data_size);
+
+            auto given = uniform_blocks.find(binding);
+            if (given != uniform_blocks.end()) {
+                glBindBufferBase(GL_UNIFORM_BUFFER, binding, given->second);
+                continue;
+            }
+
+            std::vector<char> zeros(data_size, 0);
+            uint32_t block;
+            glGenBuffers(1, &block);
+            glBindBuffer(GL_UNIFORM_BUFFER, block);
+            glBufferData(GL_UNIFORM_BUFFER, data_size, zeros.data(), GL_STATIC_DRAW);
+            glBindBufferBase(GL_UNIFORM_BUFFER, binding, block);
+            scratch_blocks.push_back(block);
+        }
+
+        // Warm up once so compilation and cache misses are not timed
+        kernel.dispatch(w, h, d);
+        glMemoryBarrier(GL_ALL_BARRIER_BITS);
+        glFinish();
+
+        auto cpu_start = std::chrono::steady_clock::now();
+
+        glBeginQuery(GL_TIME_ELAPSED, query);
+        for (int i = 0; i < timed_dispatches; i++) {
+            kernel.dispatch(w, h, d);
+            glMemoryBarrier(GL_ALL_BARRIER_BITS);
+        }
+        glEndQuery(GL_TIME_ELAPSED);
+
+        GLuint64 elapsed;
+        glGetQueryObjectui64v(query, GL_QUERY_RESULT, &elapsed);
+
+        // Software rasterizers report nonsense like 1ns for timer queries,
+        // fall back to wall clock time (the query result above already waited)
+        if (elapsed < 1000) {
+            elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - cpu_start).count();
+        }
+
+        if (elapsed < best_time) {
+            best_time = elapsed;
+            best = candidate;
+        }
+
+        glDeleteProgram(kernel.id);
+    }
+
+    glDeleteQueries(1, &query);
+    for (Texture3D &tex : scratch) {
+        glDeleteTextures(1, &tex.id);
+    }
+    if (!scratch_blocks.empty()) {
+        glDeleteBuffers(scratch_blocks.size(), scratch_blocks.data());
+    }
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+
+    std::cout << "Tuned " << kernel_path << " for " << w << "x" << h << "x" << d << ": "
+              << best.x << "x" << best.y << "x" << best.z
+              << " (" << best_time / timed_dispatches / 1000 << " us)" << std::endl;
+
+    return best;
+}
+
+std::string KernelTuner::local_size_defines(glm::uvec3 local_size) {
+    std::ostringstream defines;
+    defines << "#define LOCAL_SIZE_X " << local_size.x << "\n"
+            << "#define LOCAL_SIZE_Y " << local_size.y << "\n"
+            << "#define LOCAL_SIZE_Z " << local_size.z << "\n";
+    return defines.str();
+}
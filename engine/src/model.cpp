@@ -1,14 +1,17 @@
 #include <glm/gtc/matrix_transform.hpp>
 #include <assimp/pbrmaterial.h>
 #include <iostream>
-#include <set>
 #include <tgmath.h>
 #include "engine/model.h"
 #include "engine/imgui-instance.h"
+#include "engine/trace.h"
 
 std::map<std::string, Texture> Model::loaded_textures = {};
 
 ShaderProgram *Mesh::bbox_shader = nullptr;
+Voxelizer *Mesh::voxelizer = nullptr;
+std::map<std::tuple<std::string, uint32_t, uint32_t, uint32_t, uint32_t, bool>, Mesh::LoadedMask> Mesh::loaded_masks = {};
+uint32_t Mesh::live_masks = 0;
 ShaderProgram *Model::bbox_shader = nullptr;
 
 Mesh::Mesh(
@@ -42,62 +45,68 @@ Mesh::Mesh(
         bbox_most.z = std::max(position.z, bbox_most.z);
     }
 
-    generate_mask_data(vertices);
-
     vertex_buffer_index = vertex_buffer->add_data(vertices, indices);
 }
 
 
-uint64_t Mesh::hash_position(glm::vec3 position) {
-    float x = (position.x - bbox_least.x) / (bbox_most.x - bbox_least.x) * (float) mask_width;
-    float y = (position.y - bbox_least.y) / (bbox_most.y - bbox_least.y) * (float) mask_height;
-    float z = (position.z - bbox_least.z) / (bbox_most.z - bbox_least.z) * (float) mask_depth;
+Mask Mesh::get_mask(uint32_t unit, glm::vec3 cell_size, bool fill_interior) {
+    if (!vertex_buffer->filled) {
+        std::cout << "ERROR::MESH::MASK REQUESTED BEFORE THE VERTEX BUFFER WAS FILLED" << std::endl;
+        exit(EXIT_FAILURE);
+    }
 
-    uint32_t ix = static_cast<uint32_t> (std::floor(x));
-    uint32_t iy = static_cast<uint32_t> (std::floor(y));
-    uint32_t iz = static_cast<uint32_t> (std::floor(z));
+    // WORLD CELL SIZE IN THE MESH'S VERTEX SPACE
+    glm::mat4 world = model();
+    glm::vec3 scale(glm::length(glm::vec3(world[0])), glm::length(glm::vec3(world[1])), glm::length(glm::vec3(world[2])));
+    glm::uvec3 cells = Voxelizer::resolution(bbox_least, bbox_most, cell_size / scale);
+
+    auto key = std::make_tuple(asset_path, asset_index, cells.x, cells.y, cells.z, fill_interior);
+    if (!asset_path.empty() && loaded_masks.count(key) > 0) {
+        LoadedMask &loaded = loaded_masks[key];
+        loaded.users++;
+        live_masks++;
+        return Mask(loaded.tex, cells, parent_model, bind_matrix, bbox_least, bbox_most);
+    }
 
-    return hash_func(ix, iy, iz);
-}
+    if (voxelizer == nullptr) {
+        voxelizer = new Voxelizer();
+    }
+    Texture3D mask = Voxelizer::mask_texture(cells, unit);
+    voxelizer->voxelize(vertex_buffer->vbo, vertex_buffer->ebos[vertex_buffer_index], indices_size / 3, bbox_least, bbox_most, cells, &mask, fill_interior);
 
-uint64_t Mesh::hash_func(uint32_t ix, uint32_t iy, uint32_t iz) {
-    uint64_t hash = iz << 32 + iy << 16 + ix;
-    return hash * 2654435761 >> 16;
+    if (!asset_path.empty()) {
+        loaded_masks[key] = { mask, 1 };
+    }
+    live_masks++;
+    return Mask(mask, cells, parent_model, bind_matrix, bbox_least, bbox_most);
 }
 
-void Mesh::generate_mask_data(std::vector<Vertex> vertices) {
-
-    std::set<uint64_t> spatial_hm;
-
-    for (Vertex &vert: vertices) {
-        float pos_hash = hash_position(vert.position);
-        spatial_hm.insert(pos_hash);
+void Mesh::release_mask(const Mask &mask) {
+    if (live_masks == 0) {
+        std::cout << "ERROR::MESH::MASK RELEASED MORE OFTEN THAN IT WAS HANDED OUT" << std::endl;
+        return;
     }
 
-    mask_data.reserve(4 * mask_width * mask_height * mask_depth);
-    for (uint32_t h = 0; h < mask_height; h++) {
-        for (uint32_t d = 0; d < mask_depth; d++) {
-            for (uint32_t w = 0; w < mask_width; w++) {
-
-                uint64_t hash = hash_func(w, h, d);
-                if (spatial_hm.count(hash) > 0) {
-                    mask_data.push_back(1.0f);
-                    mask_data.push_back(0.0f);
-                    mask_data.push_back(0.0f);
-                    mask_data.push_back(1.0f);
-                }  else {
-                    mask_data.push_back(0.0f);
-                    mask_data.push_back(0.0f);
-                    mask_data.push_back(0.0f);
-                    mask_data.push_back(1.0f);
-                }
+    bool shared = false;
+    for (auto iter = loaded_masks.begin(); iter != loaded_masks.end(); iter++) {
+        if (iter->second.tex.id == mask.tex.id) {
+            shared = true;
+            if (--iter->second.users == 0) {
+                iter->second.tex.destroy();
+                loaded_masks.erase(iter);
             }
+            break;
         }
     }
-}
+    if (!shared) {
+        Texture3D tex = mask.tex;
+        tex.destroy();
+    }
 
-Mask Mesh::get_mask(uint32_t unit) {
-    return Mask(Texture3D(mask_width, mask_height, mask_depth, unit, mask_data), parent_model, bind_matrix, bbox_least, bbox_most);
+    if (--live_masks == 0) {
+        delete voxelizer;
+        voxelizer = nullptr;
+    }
 }
 
 glm::mat4 Mesh::model() {
@@ -343,7 +352,8 @@ glm::mat4 Model::convert_matrix(const aiMatrix4x4 &aiMat) {
 // Load model from the specified pathname
 //
 void Model::load_model(std::string pathname, MeshShaderType shader_type, uint32_t shader_flags, bool height_normals) {
-    
+    TraceZone zone("Model::load_model");
+
     Assimp::Importer importer;
     const aiScene* scene = importer.ReadFile(pathname, aiProcess_CalcTangentSpace | aiProcess_FlipUVs | aiProcess_Triangulate | aiProcess_GenNormals | aiProcess_CalcTangentSpace | aiProcess_PreTransformVertices);
     if (!scene || scene->mFlags & AI_SCENE_FLAGS_INCOMPLETE || !scene->mRootNode) 
@@ -351,6 +361,7 @@ void Model::load_model(std::string pathname, MeshShaderType shader_type, uint32_
         std::cout << "Assimp importer error: " << importer.GetErrorString() << std::endl;
         exit(EXIT_FAILURE);
     }
+    path = pathname;
     directory = pathname.substr(0, pathname.find_last_of('/'));
 
     process_node(scene->mRootNode, scene, glm::mat4(1.0f), shader_type, shader_flags, height_normals);
@@ -376,6 +387,8 @@ void Model::process_node(aiNode *node, const aiScene *scene, glm::mat4 transform
         bbox_most.y = std::max(mesh.bbox_most.y, bbox_most.y);
         bbox_most.z = std::max(mesh.bbox_most.z, bbox_most.z);
 
+        mesh.asset_path = path;
+        mesh.asset_index = meshes.size();
         meshes.push_back(mesh);
     }
     for (uint32_t i = 0; i < node->mNumChildren; i++) {
@@ -2,12 +2,14 @@
 #include "engine/scene.h"
 #include "engine/physics.h"
 #include "engine/debug.h"
+#include "engine/trace.h"
 #include <iostream>
 #include <fstream>
 
 using json = nlohmann::json;
 
 Scene::Scene(std::string filename, VertexBuffer *vertex_buffer) {
+    TraceZone zone("scene_load");
     json scene_json;
     std::ifstream i(filename);
     i >> scene_json;
@@ -253,7 +255,8 @@ void Scene::add_lights(std::vector<DirLight *> new_dirlights, std::vector<PointL
 }
 
 void Scene::draw(Camera *camera) {
-    
+    TraceZone zone("Scene::draw");
+
     for (std::map<ShaderProgram, std::vector<Model>>::iterator iter = models.begin(); iter != models.end(); iter++) {
         ShaderProgram shader = iter->first;
         std::vector<Model> models_to_render = iter->second;
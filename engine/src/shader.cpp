@@ -196,6 +196,7 @@ ShaderProgram::ShaderProgram(
         glAttachShader(id, geometry);
     glLinkProgram(id);
     check_link_errors(id);
+    uniforms = reflect_uniform_locations(id);
 
     glDeleteShader(vertex);
     glDeleteShader(fragment);
@@ -205,7 +206,7 @@ ShaderProgram::ShaderProgram(
 
 void ShaderProgram::setBool(const std::string &name, bool value) const {
     glCheckError();
-    glUniform1i(glGetUniformLocation(id, name.c_str()), (int)value); 
+    glUniform1i(location(name), (int)value); 
     glCheckError();
 }
 
@@ -214,72 +215,111 @@ void ShaderProgram::setInt(const std::string &name, int value) const {
         return;
     }
     glCheckError();
-    GLuint location = glGetUniformLocation(id, name.c_str());
+    GLint uniform = location(name);
     glCheckError();
-    glUniform1i(location, (GLint)value); 
+    glUniform1i(uniform, (GLint)value); 
     glCheckError();
 }
 
 void ShaderProgram::setFloat(const std::string &name, float value) const {
     glCheckError();
-    glUniform1f(glGetUniformLocation(id, name.c_str()), value); 
+    glUniform1f(location(name), value); 
     glCheckError();
 }
 
 void ShaderProgram::setVec2(const std::string &name, const glm::vec2 &value) const {
     glCheckError();
-    glUniform2fv(glGetUniformLocation(id, name.c_str()), 1, &value[0]); 
+    glUniform2fv(location(name), 1, &value[0]); 
     glCheckError();
 }
 
 void ShaderProgram::setVec2(const std::string &name, float x, float y) const {
     glCheckError();
-    glUniform2f(glGetUniformLocation(id, name.c_str()), x, y); 
+    glUniform2f(location(name), x, y); 
     glCheckError();
 }
 
 void ShaderProgram::setVec3(const std::string &name, const glm::vec3 &value) const {
     glCheckError();
-    glUniform3fv(glGetUniformLocation(id, name.c_str()), 1, &value[0]); 
+    glUniform3fv(location(name), 1, &value[0]); 
     glCheckError();
 }
 
 void ShaderProgram::setVec3(const std::string &name, float x, float y, float z) const {
     glCheckError();
-    glUniform3f(glGetUniformLocation(id, name.c_str()), x, y, z); 
+    glUniform3f(location(name), x, y, z); 
     glCheckError();
 }
 
 void ShaderProgram::setVec4(const std::string &name, const glm::vec4 &value) const {
     glCheckError();
-    glUniform4fv(glGetUniformLocation(id, name.c_str()), 1, &value[0]); 
+    glUniform4fv(location(name), 1, &value[0]); 
     glCheckError();
 }
 
 void ShaderProgram::setVec4(const std::string &name, float x, float y, float z, float w)  {
     glCheckError();
-    glUniform4f(glGetUniformLocation(id, name.c_str()), x, y, z, w); 
+    glUniform4f(location(name), x, y, z, w); 
     glCheckError();
 }
 
 void ShaderProgram::setMat2(const std::string &name, const glm::mat2 &mat) const {
     glCheckError();
-    glUniformMatrix2fv(glGetUniformLocation(id, name.c_str()), 1, GL_FALSE, &mat[0][0]);
+    glUniformMatrix2fv(location(name), 1, GL_FALSE, &mat[0][0]);
     glCheckError();
 }
 
 void ShaderProgram::setMat3(const std::string &name, const glm::mat3 &mat) const {
     glCheckError();
-    glUniformMatrix3fv(glGetUniformLocation(id, name.c_str()), 1, GL_FALSE, &mat[0][0]);
+    glUniformMatrix3fv(location(name), 1, GL_FALSE, &mat[0][0]);
     glCheckError();
 }
 
 void ShaderProgram::setMat4(const std::string &name, const glm::mat4 &mat) const {
     glCheckError();
-    glUniformMatrix4fv(glGetUniformLocation(id, name.c_str()), 1, GL_FALSE, &mat[0][0]);
+    glUniformMatrix4fv(location(name), 1, GL_FALSE, &mat[0][0]);
     glCheckError();
 }
 
+GLint ShaderProgram::location(const std::string &name) const {
+    auto it = uniforms.find(name);
+    return it == uniforms.end() ? -1 : it->second;
+}
+
+UniformLocations reflect_uniform_locations(uint32_t program) {
+    UniformLocations locations;
+
+    GLint count = 0, max_length = 0;
+    glGetProgramiv(program, GL_ACTIVE_UNIFORMS, &count);
+    glGetProgramiv(program, GL_ACTIVE_UNIFORM_MAX_LENGTH, &max_length);
+
+    std::vector<GLchar> buffer(max_length + 1);
+    for (GLint i = 0; i < count; i++) {
+        GLint size;
+        GLenum type;
+        glGetActiveUniform(program, i, (GLsizei) buffer.size(), NULL, &size, &type, buffer.data());
+        std::string name(buffer.data());
+
+        // Uniform block members have no location
+        GLint location = glGetUniformLocation(program, name.c_str());
+        if (location < 0) continue;
+        locations[name] = location;
+
+        // Arrays are reported as "name[0]", register the bare name and every element
+        size_t bracket = name.rfind("[0]");
+        if (bracket != std::string::npos && bracket + 3 == name.size()) {
+            std::string base = name.substr(0, bracket);
+            locations[base] = location;
+            for (GLint element = 1; element < size; element++) {
+                std::string element_name = base + "[" + std::to_string(element) + "]";
+                locations[element_name] = glGetUniformLocation(program, element_name.c_str());
+            }
+        }
+    }
+
+    return locations;
+}
+
 void ShaderProgram::use() {
     glUseProgram(id);
 }
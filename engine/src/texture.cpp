@@ -2,6 +2,7 @@
 #include <iostream>
 #include <stb_image.h>
 #include "engine/texture.h"
+#include "engine/trace.h"
 #include "log.h"
 
 Cubemap::Cubemap(std::vector<std::string> filenames, uint32_t unit, bool srgb) {
@@ -21,7 +22,10 @@ Cubemap::Cubemap(std::vector<std::string> filenames, uint32_t unit, bool srgb) {
     int width, height, nrChannels;
     unsigned char *data;  
     for(GLuint i = 0; i < filenames.size(); i++) {
-        data = stbi_load(filenames[i].c_str(), &width, &height, &nrChannels, 0);
+        {
+            TraceZone zone("texture_decode");
+            data = stbi_load(filenames[i].c_str(), &width, &height, &nrChannels, 0);
+        }
         if (!data) {
             std::cout << "Could not load cubemap texture file " << i << std::endl;
             exit(EXIT_FAILURE);
@@ -47,7 +51,11 @@ Texture::Texture(std::string filename, uint32_t unit, bool srgb) : unit(unit) {
 
     int width, height, nrChannels;
     stbi_set_flip_vertically_on_load(true);
-    unsigned char *data = stbi_load(filename.c_str(), &width, &height, &nrChannels, 0);
+    unsigned char *data;
+    {
+        TraceZone zone("texture_decode");
+        data = stbi_load(filename.c_str(), &width, &height, &nrChannels, 0);
+    }
     if (data) {
         GLenum format = GL_RED;
         if (nrChannels == 3) {
@@ -0,0 +1,174 @@
+#include <nlohmann/json.hpp>
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+
+#include "engine/trace.h"
+#include "engine/gpu_profiler.h"
+
+using json = nlohmann::json;
+
+TraceRecorder *TraceRecorder::instance = nullptr;
+
+// TRACK 0 IS THE GPU, CPU THREADS ARE NUMBERED FROM 1 IN THE ORDER THEY FIRST OPEN A ZONE
+static const int GPU_TRACK = 0;
+
+static int64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+TraceRecorder::TraceRecorder() {
+    instance = this;
+}
+
+TraceRecorder::~TraceRecorder() {
+    if (active) {
+        stop();
+    }
+    if (instance == this) {
+        instance = nullptr;
+    }
+}
+
+void TraceRecorder::start(const std::string &path, int frames) {
+    if (active) {
+        stop();
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    this->path = path;
+    frames_left = frames;
+    frame_index = 0;
+    capture_start_ns = now_ns();
+    frame_start_ns = -1;
+    events.clear();
+    tracks.clear();
+    frame_track = -1;
+    active = true;
+
+    std::cout << "Capturing trace to " << path << std::endl;
+}
+
+void TraceRecorder::stop() {
+    if (!active) {
+        return;
+    }
+
+    // LET THE GPU CATCH UP SO THE LAST FRAMES OF THE CAPTURE RESOLVE TOO
+    if (GpuProfiler::instance && GpuProfiler::instance->enabled) {
+        GpuProfiler::instance->wait();
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    active = false;
+
+    if (frame_start_ns >= 0) {
+        events.push_back({ "frame " + std::to_string(frame_index - 1), frame_track, frame_start_ns, now_ns() });
+    }
+    write();
+    events.clear();
+}
+
+void TraceRecorder::toggle() {
+    if (active) {
+        stop();
+    } else {
+        start(capture_path, capture_frames);
+    }
+}
+
+void TraceRecorder::begin_frame() {
+    if (!active) {
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        int64_t now = now_ns();
+        if (frame_start_ns >= 0) {
+            events.push_back({ "frame " + std::to_string(frame_index - 1), frame_track, frame_start_ns, now });
+        }
+
+        if (frames_left <= 0 || frame_index < frames_left) {
+            frame_track = track(std::this_thread::get_id());
+            frame_start_ns = now;
+            frame_index++;
+            return;
+        }
+        frame_start_ns = -1;
+    }
+
+    stop();
+}
+
+void TraceRecorder::add_cpu_zone(const char *name, std::chrono::steady_clock::time_point begin, std::chrono::steady_clock::time_point end) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!active) {
+        return;
+    }
+
+    int64_t begin_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(begin.time_since_epoch()).count();
+    int64_t end_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(end.time_since_epoch()).count();
+    events.push_back({ name, track(std::this_thread::get_id()), begin_ns, end_ns });
+}
+
+void TraceRecorder::add_gpu_frame(const GpuProfiler &profiler) {
+    std::lock_guard<std::mutex> lock(mutex);
+    int64_t frame_ns = profiler.latest_frame_cpu_ns();
+    if (!active || frame_ns < capture_start_ns) {
+        return;
+    }
+
+    for (const GpuZoneTiming &zone : profiler.latest_frame()) {
+        events.push_back({ zone.name, GPU_TRACK, frame_ns + (int64_t) (zone.start_ms * 1e6), frame_ns + (int64_t) (zone.end_ms * 1e6) });
+    }
+}
+
+int TraceRecorder::track(std::thread::id thread) {
+    auto found = tracks.find(thread);
+    if (found != tracks.end()) {
+        return found->second;
+    }
+
+    int id = tracks.size() + 1;
+    tracks[thread] = id;
+    return id;
+}
+
+void TraceRecorder::write() {
+    json trace_events = json::array();
+
+    trace_events.push_back({ { "ph", "M" }, { "name", "process_name" }, { "pid", 1 }, { "tid", GPU_TRACK }, { "args", { { "name", "engine" } } } });
+    trace_events.push_back({ { "ph", "M" }, { "name", "thread_name" }, { "pid", 1 }, { "tid", GPU_TRACK }, { "args", { { "name", "GPU" } } } });
+    for (auto &thread : tracks) {
+        std::string name = thread.second == frame_track ? "CPU main" : "CPU " + std::to_string(thread.second);
+        trace_events.push_back({ { "ph", "M" }, { "name", "thread_name" }, { "pid", 1 }, { "tid", thread.second }, { "args", { { "name", name } } } });
+    }
+
+    // COMPLETE EVENTS IN MICROSECONDS FROM THE START OF THE CAPTURE
+    for (const Event &event : events) {
+        trace_events.push_back({
+            { "ph", "X" },
+            { "name", event.name },
+            { "cat", event.track == GPU_TRACK ? "gpu" : "cpu" },
+            { "pid", 1 },
+            { "tid", event.track },
+            { "ts", (event.begin_ns - capture_start_ns) / 1e3 },
+            { "dur", std::max<int64_t>(event.end_ns - event.begin_ns, 0) / 1e3 },
+        });
+    }
+
+    json trace;
+    trace["traceEvents"] = trace_events;
+    trace["displayTimeUnit"] = "ms";
+
+    std::ofstream file(path);
+    file << trace.dump() << std::endl;
+    if (!file) {
+        std::cout << "ERROR::TRACE::FAILED TO WRITE " << path << std::endl;
+        return;
+    }
+
+    std::cout << "Wrote trace of " << frame_index << " frames (" << events.size() << " zones) to " << path << std::endl;
+}
@@ -0,0 +1,109 @@
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include "engine/voxelizer.h"
+#include "engine/vertex.h"
+#include "engine/gpu_profiler.h"
+#include "engine/trace.h"
+
+Voxelizer::Voxelizer() {
+    std::string defines = "#define VERTEX_STRIDE " + std::to_string(sizeof(Vertex) / sizeof(float)) + "\n";
+    surface_kernel = KernelProgram("src/kernels/fs_voxelize_surface.comp", defines);
+    fill_kernel = KernelProgram("src/kernels/fs_voxelize_fill.comp");
+    resolve_kernel = KernelProgram("src/kernels/fs_voxelize_resolve.comp", "#define MASK_WORD_BITS " + std::to_string(MASK_WORD_BITS) + "\n");
+
+    glGenBuffers(1, &changed_ssbo);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, changed_ssbo);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(uint32_t), nullptr, GL_DYNAMIC_READ);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+}
+
+Voxelizer::~Voxelizer() {
+    surface_kernel.destroy();
+    fill_kernel.destroy();
+    resolve_kernel.destroy();
+    glDeleteBuffers(1, &changed_ssbo);
+    if (state.id != UINT32_MAX) {
+        glDeleteTextures(1, &state.id);
+    }
+}
+
+glm::uvec3 Voxelizer::resolution(glm::vec3 least, glm::vec3 most, glm::vec3 cell_size) {
+    glm::vec3 cells = glm::ceil((most - least) / cell_size);
+    cells = glm::clamp(cells, glm::vec3(1.0f), glm::vec3((float) MAX_MASK_RESOLUTION));
+    return glm::uvec3(cells);
+}
+
+Texture3D Voxelizer::mask_texture(glm::uvec3 cells, uint32_t unit) {
+    return Texture3D((cells.x + MASK_WORD_BITS - 1) / MASK_WORD_BITS, cells.y, cells.z, unit, GL_NEAREST, GL_RG32UI);
+}
+
+void Voxelizer::voxelize(uint32_t vbo, uint32_t ebo, uint32_t triangle_count, glm::vec3 least, glm::vec3 most, glm::uvec3 cells, Texture3D *mask, bool fill_interior) {
+    TraceZone zone("voxelize");
+    GpuZone gpu_zone("voxelize");
+
+    if (state.id == UINT32_MAX || state.width != cells.x || state.height != cells.y || state.depth != cells.z) {
+        if (state.id != UINT32_MAX) {
+            glDeleteTextures(1, &state.id);
+        }
+        state = Texture3D(cells.x, cells.y, cells.z, 0, GL_NEAREST, GL_R8UI);
+    }
+
+    uint8_t empty = 0;
+    glClearTexImage(state.id, 0, GL_RED_INTEGER, GL_UNSIGNED_BYTE, &empty);
+    glMemoryBarrier(GL_TEXTURE_UPDATE_BARRIER_BIT);
+
+    // A FLAT AXIS PUTS EVERY VERTEX ON THE LEAST FACE OF ITS ONLY CELL
+    glm::vec3 scale = glm::vec3(cells) / glm::max(most - least, glm::vec3(1e-6f));
+
+    state.use(0, 0);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, vbo);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, ebo);
+
+    surface_kernel.use();
+    surface_kernel.setInt("u_TriangleCount", triangle_count);
+    surface_kernel.setVec3("u_Least", least);
+    surface_kernel.setVec3("u_Scale", scale);
+    surface_kernel.setVec3("u_Cells", glm::vec3(cells));
+    // ONE ROW OF COLUMNS PER INVOCATION, NO TRIANGLE HAS MORE ROWS THAN THE LONGEST AXIS HAS CELLS
+    surface_kernel.dispatch(triangle_count, std::max(cells.x, std::max(cells.y, cells.z)), 1);
+    glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+
+    //
+    // Sweep along every axis until a round marks nothing. Each round gets
+    // around as many corners of the outside as it has sweeps, so even
+    // winding cavities settle in a handful of rounds
+    //
+    if (fill_interior) {
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, changed_ssbo);
+        fill_kernel.use();
+        fill_kernel.setVec3("u_Cells", glm::vec3(cells));
+
+        uint32_t max_rounds = std::max(cells.x, std::max(cells.y, cells.z));
+        uint32_t changed = 1;
+        for (uint32_t round = 0; changed && round < max_rounds; round++) {
+            changed = 0;
+            glBindBuffer(GL_SHADER_STORAGE_BUFFER, changed_ssbo);
+            glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(changed), &changed);
+            glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+            for (int axis = 0; axis < 3; axis++) {
+                fill_kernel.setInt("u_Axis", axis);
+                fill_kernel.dispatch(cells[(axis + 1) % 3], cells[(axis + 2) % 3], 1);
+                glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+            }
+
+            glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+            glBindBuffer(GL_SHADER_STORAGE_BUFFER, changed_ssbo);
+            glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(changed), &changed);
+            glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+        }
+    }
+
+    mask->use(1, 1);
+    resolve_kernel.use();
+    resolve_kernel.setBool("u_FillInterior", fill_interior);
+    resolve_kernel.setVec3("u_Cells", glm::vec3(cells));
+    resolve_kernel.dispatch(mask->width, mask->height, mask->depth);
+    glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT | GL_TEXTURE_FETCH_BARRIER_BIT);
+}
@@ -4,6 +4,7 @@
 #include "log.h"
 #include "engine/window.h"
 #include "engine/imgui-instance.h"
+#include "engine/trace.h"
 
 Window::Window(uint32_t width, uint32_t height, Camera *cam) : cam(cam), width(width), height(height) {
 
@@ -88,6 +89,8 @@ void key_callback(GLFWwindow * window, int key, int scancode, int action, int mo
         glfwSetInputMode(window, GLFW_CURSOR, GLFW_CURSOR_NORMAL);
         user_window->mouse_locked = false;
         ImGuiInstance::gui_enabled = !ImGuiInstance::gui_enabled;
+    } else if (key == GLFW_KEY_F9 && action == GLFW_PRESS && TraceRecorder::instance) {
+        TraceRecorder::instance->toggle();
     }
 }
 
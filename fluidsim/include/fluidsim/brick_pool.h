@@ -0,0 +1,98 @@
+#pragma once
+
+namespace Fluidsim {
+
+//
+// Addressing of the fields stored in the brick pool, injected by
+// Engine::format_defines after the StepParameters block. With BRICK_POOL
+// defined a pooled field is an atlas: its first pool_tile_layers layers
+// hold one tile texel per 8^3 brick, the value of every cell of a brick
+// that is uniform, and the layers after them hold one 8^3 slot per brick
+// that is not. The table at binding 5 has the slot + 1 of every brick in
+// its low 31 bits, 0 for tiles. Without BRICK_POOL the same functions
+// address a dense field directly, so a kernel is written once for both.
+//
+// pool_load / pool_fetch read cells outside the grid as 0 like imageLoad,
+// pool_store drops writes to tiles, which only change by being expanded
+// into a slot. pool_sample filters like GL_LINEAR with GL_CLAMP_TO_EDGE
+// over the grid, with uvw normalized to the grid and not to the atlas
+//
+static const char *const BRICK_POOL_GLSL =
+    "#ifdef BRICK_POOL\n"
+    "layout(std430, binding = 5) buffer BrickTable {\n"
+    "    uint brick_slots[];\n"
+    "};\n"
+    "#endif\n"
+    "uint pool_brick(uvec3 brick) {\n"
+    "    return brick.x + brick_count.x * (brick.y + brick_count.y * brick.z);\n"
+    "}\n"
+    "ivec3 pool_slot_origin(uint slot) {\n"
+    "    uvec3 s = uvec3(slot % brick_count.x, (slot / brick_count.x) % brick_count.y, slot / (brick_count.x * brick_count.y));\n"
+    "    return ivec3(s * 8u + uvec3(0u, 0u, pool_tile_layers));\n"
+    "}\n"
+    "ivec3 pool_tile_texel(uint brick) {\n"
+    "    uvec3 extent = brick_count * 8u;\n"
+    "    return ivec3(brick % extent.x, (brick / extent.x) % extent.y, brick / (extent.x * extent.y));\n"
+    "}\n"
+    "bool pool_outside(ivec3 cell) {\n"
+    "    return any(lessThan(cell, ivec3(0))) || any(greaterThanEqual(cell, ivec3(grid_size)));\n"
+    "}\n"
+    "ivec3 pool_cell(ivec3 cell) {\n"
+    "#ifdef BRICK_POOL\n"
+    "    if (pool_outside(cell)) return ivec3(-1);\n"
+    "    uint brick = pool_brick(uvec3(cell) >> 3u);\n"
+    "    uint slot = brick_slots[brick] & 0x7fffffffu;\n"
+    "    return slot == 0u ? pool_tile_texel(brick) : pool_slot_origin(slot - 1u) + (cell & 7);\n"
+    "#else\n"
+    "    return cell;\n"
+    "#endif\n"
+    "}\n"
+    "ivec3 pool_store_cell(ivec3 cell) {\n"
+    "#ifdef BRICK_POOL\n"
+    "    if (pool_outside(cell)) return ivec3(-1);\n"
+    "    uint slot = brick_slots[pool_brick(uvec3(cell) >> 3u)] & 0x7fffffffu;\n"
+    "    return slot == 0u ? ivec3(-1) : pool_slot_origin(slot - 1u) + (cell & 7);\n"
+    "#else\n"
+    "    return cell;\n"
+    "#endif\n"
+    "}\n"
+    "#define pool_load(field, cell) imageLoad(field, pool_cell(cell))\n"
+    "#define pool_store(field, cell, value) imageStore(field, pool_store_cell(cell), value)\n"
+    "vec4 pool_fetch(sampler3D field, ivec3 cell) {\n"
+    "#ifdef BRICK_POOL\n"
+    "    return pool_outside(cell) ? vec4(0.0) : texelFetch(field, pool_cell(cell), 0);\n"
+    "#else\n"
+    "    return texelFetch(field, cell, 0);\n"
+    "#endif\n"
+    "}\n"
+    "vec4 pool_sample(sampler3D field, vec3 uvw) {\n"
+    "#ifdef BRICK_POOL\n"
+    "    vec3 position = uvw * vec3(grid_size) - 0.5;\n"
+    "    vec3 base = floor(position);\n"
+    "    vec3 t = position - base;\n"
+    "    ivec3 last = ivec3(grid_size) - 1;\n"
+    "    ivec3 lo = clamp(ivec3(base), ivec3(0), last);\n"
+    "    ivec3 hi = clamp(ivec3(base) + 1, ivec3(0), last);\n"
+    "    ivec3 a, b;\n"
+    "    uint brick = pool_brick(uvec3(lo) >> 3u);\n"
+    "    if (all(equal(lo >> 3, hi >> 3))) {\n"
+    "        uint slot = brick_slots[brick] & 0x7fffffffu;\n"
+    "        if (slot == 0u) return texelFetch(field, pool_tile_texel(brick), 0);\n"
+    "        a = pool_slot_origin(slot - 1u) + (lo & 7);\n"
+    "        b = a + (hi - lo);\n"
+    "    } else {\n"
+    "        return mix(mix(mix(texelFetch(field, pool_cell(ivec3(lo.x, lo.y, lo.z)), 0), texelFetch(field, pool_cell(ivec3(hi.x, lo.y, lo.z)), 0), t.x),\n"
+    "                       mix(texelFetch(field, pool_cell(ivec3(lo.x, hi.y, lo.z)), 0), texelFetch(field, pool_cell(ivec3(hi.x, hi.y, lo.z)), 0), t.x), t.y),\n"
+    "                   mix(mix(texelFetch(field, pool_cell(ivec3(lo.x, lo.y, hi.z)), 0), texelFetch(field, pool_cell(ivec3(hi.x, lo.y, hi.z)), 0), t.x),\n"
+    "                       mix(texelFetch(field, pool_cell(ivec3(lo.x, hi.y, hi.z)), 0), texelFetch(field, pool_cell(ivec3(hi.x, hi.y, hi.z)), 0), t.x), t.y), t.z);\n"
+    "    }\n"
+    "    return mix(mix(mix(texelFetch(field, ivec3(a.x, a.y, a.z), 0), texelFetch(field, ivec3(b.x, a.y, a.z), 0), t.x),\n"
+    "                   mix(texelFetch(field, ivec3(a.x, b.y, a.z), 0), texelFetch(field, ivec3(b.x, b.y, a.z), 0), t.x), t.y),\n"
+    "               mix(mix(texelFetch(field, ivec3(a.x, a.y, b.z), 0), texelFetch(field, ivec3(b.x, a.y, b.z), 0), t.x),\n"
+    "                   mix(texelFetch(field, ivec3(a.x, b.y, b.z), 0), texelFetch(field, ivec3(b.x, b.y, b.z), 0), t.x), t.y), t.z);\n"
+    "#else\n"
+    "    return texture(field, uvw);\n"
+    "#endif\n"
+    "}\n";
+
+}
@@ -0,0 +1,145 @@
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+
+#include <fluidsim/cpu_stencils.h>
+#include <fluidsim/step_parameters.h>
+#include <fluidsim/thread_pool.h>
+
+namespace Fluidsim {
+
+//
+// Fields of a CpuSolver that can be copied in and out. The first five are
+// the simulation state, the rest are the inputs of a step, which hold
+// whatever they were last set to
+//
+enum CpuField {
+    CPU_VELOCITY,               // xyz
+    CPU_QUANTITY,               // rgba
+    CPU_TEMPERATURE,            // r
+    CPU_PRESSURE,               // r, the latest solve, which warm starts the next one
+    CPU_WORLD_MASK,             // r, 0 solid, 1 air, >= 2 fluid
+    CPU_DIVERGENCE,             // r, of the forced velocity of the latest step
+    CPU_SOLID_OVERLAY,          // a, 1 where a body is
+    CPU_SOLID_VELOCITY,         // xyz, velocity of the bodies
+    CPU_SOLID_TEMPERATURE,      // r, temperature of the bodies
+    CPU_FORCES,                 // xyz, external force per cell
+    CPU_FIELD_COUNT,
+};
+
+// Bits (1 << CpuField) of the fields a step writes, the state and the divergence
+const uint32_t CPU_STATE_FIELDS = (1u << (CPU_DIVERGENCE + 1)) - 1;
+
+//
+// Convergence of the latest CpuSolver pressure solve, measured the same
+// way as Engine's. The residual stays at -1 when the tolerance is <= 0
+//
+struct CpuSolveStats {
+    int iterations;
+    float residual_l2;
+    float residual_linf;
+};
+
+//
+// Multithreaded CPU implementation of the steps of Engine, for machines
+// without a usable GPU and for checking the kernels against. It follows
+// the Jacobi path of the kernels cell for cell, so both backends agree up
+// to the 16 bit storage of the GPU textures.
+//
+// Every channel is its own float grid with a one cell ghost shell, so the
+// stencils never branch on the grid bounds. Ghost cells read as solid with
+// all values zero, which is what imageLoad returns outside the image on the
+// GPU. The per-cell passes are the StencilTable of the widest instruction
+// set the CPU has, run over blocks of BLOCK_ROWS rows by a run of z planes
+// spread over a ThreadPool. A block is walked plane by plane, so the three
+// planes a stencil reads of its rows stay in cache.
+//
+class CpuSolver {
+public:
+    uint32_t width, height, depth;
+
+    CpuSolver(uint32_t width, uint32_t height, uint32_t depth, unsigned thread_count = std::thread::hardware_concurrency());
+
+    //
+    // Copies a field from or to width * height * depth texels of 4 floats in
+    // RGBA order (the layout of glGetTextureImage with GL_RGBA, GL_FLOAT).
+    // Channels a field does not have are ignored on write and zero on read
+    //
+    void write(CpuField field, const float *rgba);
+    void read(CpuField field, float *rgba);
+
+    //
+    // Mask overlay, advection, forces, divergence, pressure solve and
+    // projection, in the order of Engine::step. max_iterations counts
+    // iterations of two sweeps, tolerance <= 0 always runs all of them
+    //
+    void step(const StepParameters &params, int max_iterations, float tolerance, int residual_check_interval);
+
+    //
+    // Largest |u| over the fluid and air cells
+    //
+    float max_velocity();
+
+    const CpuSolveStats &stats() const {
+        return solve_stats;
+    }
+
+    unsigned thread_count() const {
+        return pool.size();
+    }
+
+    //
+    // Instruction set the stencils run on, "avx2", "sse2", "neon" or "scalar"
+    //
+    const char *instruction_set() const {
+        return stencils->name;
+    }
+
+private:
+    // Padded dimensions, and the distance between neighbours in y and z
+    uint32_t row, slab;
+    size_t cells;
+
+    // Blocks are BLOCK_ROWS rows by block_planes planes, blocks_y by blocks_z of them
+    static constexpr uint32_t BLOCK_ROWS = 16;
+    uint32_t block_planes, blocks_y, blocks_z;
+
+    const StencilTable *stencils;
+    ThreadPool pool;
+    CpuSolveStats solve_stats = { 0, -1.0f, -1.0f };
+
+    // STATE (U AND Q ARE ADVECTED INTO THE NEXT GRIDS, THEN SWAPPED)
+    std::vector<float> u[3], u_next[3];
+    std::vector<float> q[4], q_next[4];
+    std::vector<float> temp, temp_next;
+    std::vector<float> pressure, pressure_next;
+    std::vector<float> mask;
+    std::vector<float> div;
+
+    // INPUTS
+    std::vector<float> solid_overlay;
+    std::vector<float> solid_u[3];
+    std::vector<float> solid_temp;
+    std::vector<float> forces[3];
+
+    size_t index(uint32_t x, uint32_t y, uint32_t z) const {
+        return ((size_t) (z + 1) * (height + 2) + (y + 1)) * row + (x + 1);
+    }
+
+    void channels(CpuField field, std::vector<float> **grids, int *count);
+    void for_slabs(const std::function<void(uint32_t, uint32_t)> &fn);
+    void for_blocks(const std::function<void(const StencilBlock &, uint32_t)> &fn);
+    StencilGrids stencil_grids();
+
+    void apply_world_mask_overlay();
+    void advect(const StepParameters &params);
+    void apply_force(const StepParameters &params);
+    void divergence();
+    void solve_pressure(const StepParameters &params, int max_iterations, float tolerance, int residual_check_interval);
+    void jacobi_sweep(const std::vector<float> &src, std::vector<float> &dst, float pressure_air);
+    bool measure_residual(const std::vector<float> &p, float pressure_air, float tolerance, CpuSolveStats &check);
+    void project();
+};
+
+}
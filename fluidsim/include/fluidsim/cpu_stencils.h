@@ -0,0 +1,74 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <fluidsim/step_parameters.h>
+
+namespace Fluidsim {
+
+//
+// The grids of a CpuSolver and their layout, as the stencils see them.
+// Interior cell (x, y, z) is at ((z + 1) * (height + 2) + y + 1) * row + x + 1
+// of every grid, row being padded to whole vectors of the widest lanes
+//
+struct StencilGrids {
+    uint32_t width, height, depth;
+    size_t row, slab;
+
+    float *u[3], *u_next[3];
+    float *q[4], *q_next[4];
+    float *temp, *temp_next;
+    float *mask;
+    float *div;
+    const float *solid_u[3];
+    const float *solid_temp;
+
+    size_t index(uint32_t x, uint32_t y, uint32_t z) const {
+        return ((size_t) (z + 1) * (height + 2) + (y + 1)) * row + (x + 1);
+    }
+};
+
+//
+// Rows y0..y1 of the planes z0..z1, the unit the stencils are run over
+//
+struct StencilBlock {
+    uint32_t y0, y1;
+    uint32_t z0, z1;
+};
+
+//
+// The per-cell passes of CpuSolver over a block, built once for every
+// instruction set the solver can run on. Each works whole vectors of a
+// row at a time, and the scalar version of itself on the row's tail
+//
+struct StencilTable {
+    const char *name;
+
+    // MacCormack advection of u, q and temp into their next grids
+    void (*advect)(const StencilGrids &grids, const StencilBlock &block, const StepParameters &params);
+
+    // Divergence of u into div, solid neighbours move with their body
+    void (*divergence)(const StencilGrids &grids, const StencilBlock &block);
+
+    // One Jacobi sweep of the pressure from src into dst
+    void (*jacobi)(const StencilGrids &grids, const StencilBlock &block, const float *src, float *dst, float pressure_air);
+
+    // Sum of r^2, max |r| and sum of div^2 over the fluid cells into sums
+    void (*residual)(const StencilGrids &grids, const StencilBlock &block, const float *pressure, float pressure_air, float sums[3]);
+
+    // Subtracts the pressure gradient from u in place, with free slip at solids
+    void (*project)(const StencilGrids &grids, const StencilBlock &block, const float *pressure);
+};
+
+//
+// Stencils for the instruction set the library is compiled for (SSE2 or
+// NEON where the target has them), and with FLUIDSIM_AVX2 the same ones
+// compiled for AVX2, only to be used where the CPU supports it
+//
+const StencilTable &baseline_stencils();
+#ifdef FLUIDSIM_AVX2
+const StencilTable &avx2_stencils();
+#endif
+
+}
@@ -1,11 +1,159 @@
 #pragma once
 
 #include <glm/glm.hpp>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
 
 #include <engine/kernel.h>
+#include <engine/async_readback.h>
+#include <fluidsim/step_parameters.h>
+#include <fluidsim/brick_pool.h>
+#include <fluidsim/cpu_solver.h>
 
 namespace Fluidsim {
 
+//
+// Selects the algorithm used to solve the pressure Poisson equation
+// during the projection step
+//
+enum PressureSolver {
+    PRESSURE_SOLVER_JACOBI,
+    PRESSURE_SOLVER_MULTIGRID_V_CYCLE,
+    PRESSURE_SOLVER_MULTIGRID_FMG,
+};
+
+//
+// One level of the multigrid hierarchy. Level 0 borrows the engine's own
+// pressure, divergence and mask textures, every coarser level halves each
+// dimension
+//
+struct MultigridLevel {
+    uint32_t width, height, depth;
+    Texture3D pressure;
+    Texture3D pressure_next;
+    Texture3D rhs;
+    Texture3D residual;
+    Texture3D world_mask;
+};
+
+//
+// How the engine stores its fields. The brick pool keeps every 8^3 brick
+// either as one tile value, when each of its cells holds the same value in
+// every pooled field, or in a slot of an atlas texture. A brick at rest
+// keeps its slot until all of its fields are uniform, including passive
+// ones like q, so memory only shrinks over regions of uniform fluid, air
+// or solid. With the position gradient fs_initialize_fields writes into q
+// no brick ever is, and the pool saves nothing over dense storage. Pooled
+// fields are read outside the kernels through Engine::dense_view
+//
+enum FieldStorage {
+    FIELD_STORAGE_DENSE,
+    FIELD_STORAGE_BRICK_POOL,
+};
+
+//
+// One quantity stored in the brick pool: the texture holding its current
+// value, and every texture of it (both sides of a pair, the pressure ring)
+// that follows the same brick layout. A brick collapses when the source is
+// uniform over it, and all of the textures take that value as their tile
+//
+struct PooledQuantity {
+    Texture3D *source;
+    std::vector<Texture3D *> textures;
+};
+
+//
+// Convergence information about the most recent pressure solve. The
+// residual is only measured when Engine::pressure_tolerance > 0, otherwise
+// both residual fields are left at -1. It is that of the last check, which
+// can be up to residual_check_interval iterations behind the count
+//
+struct PressureSolveStats {
+    int iterations;             // Jacobi iterations (two sweeps each) or multigrid cycles
+    float residual_l2;          // ||div - A p|| / ||div||
+    float residual_linf;        // max |div - A p|
+};
+
+//
+// Internal formats of the scalar fields, which only use .r. Pressure and
+// divergence default to 32 bit for the accuracy of the pressure solve,
+// advected scalars to 16 bit. The mask classification is compared
+// against exact float values, so world_mask has to be a float format
+//
+struct FieldFormats {
+    GLenum temperature = GL_R16F;
+    GLenum pressure = GL_R32F;
+    GLenum divergence = GL_R32F;
+    GLenum world_mask = GL_R16F;
+};
+
+//
+// Where Engine::step runs. The CPU backend downloads the masks and forces
+// every step and keeps its state resident between steps. A field goes back
+// to its texture only when a dense view, a readback or the surface forces
+// need it, and the whole state when the GPU steps next
+//
+enum Backend {
+    BACKEND_GPU,
+    BACKEND_CPU,
+};
+
+//
+// Fields that can be read back in regions. Pressure and temperature come
+// back as one float per cell, velocity as three
+//
+enum ReadbackField {
+    READBACK_PRESSURE,
+    READBACK_VELOCITY,
+    READBACK_TEMPERATURE,
+    READBACK_FIELD_COUNT,
+};
+
+//
+// A body whose oriented box surface the pressure is integrated over,
+// mirrored by the std430 SurfaceBody struct of fs_surface_force.comp.
+// Engine::integrate_surface_forces fills in the sample counts
+//
+struct SurfaceBody {
+    glm::mat4 object_m;                 // Box space (centered on the box) to world
+    glm::vec4 extent;                   // xyz: box dimensions, w: distance of the samples outside the box
+    glm::uvec4 samples;                 // xyz: samples along each box axis
+};
+static_assert(sizeof(SurfaceBody) == 96, "SurfaceBody must match the std430 layout of fs_surface_force.comp");
+
+//
+// Pressure force and torque (about the body's origin) on one SurfaceBody
+//
+struct SurfaceForce {
+    glm::vec4 force;
+    glm::vec4 torque;
+};
+
+//
+// Largest difference of any cell and channel between the fields of two
+// engines, see field_difference
+//
+struct FieldDifference {
+    float velocity;
+    float quantity;
+    float temperature;
+    float pressure;
+    float world_mask;
+};
+
+//
+// Number of bodies integrate_surface_forces handles in one dispatch
+//
+const int MAX_SURFACE_BODIES = 64;
+
+//
+// Number of max |u| reductions that can be in flight before the oldest is
+// read back
+//
+const int VELOCITY_READBACK_SLOTS = 3;
+
 class Engine {
     // DECLARE SHADERS
 public:
@@ -13,44 +161,321 @@ public:
     KernelProgram fs_advect_diffuse;
     KernelProgram fs_advect_diffuse_free;
     KernelProgram fs_advect_mc;
+    KernelProgram fs_advect_fused;
     KernelProgram fs_apply_force;
     KernelProgram fs_div;
+    KernelProgram fs_force_div;
     KernelProgram fs_jacobi_iter;
+    KernelProgram fs_jacobi_block2;
+    KernelProgram fs_jacobi_block4;
     KernelProgram fs_pressure_proj;
-    KernelProgram fs_write_to;
+    KernelProgram fs_initialize_fields;
+    KernelProgram fs_mg_smooth;
+    KernelProgram fs_mg_residual;
+    KernelProgram fs_mg_restrict;
+    KernelProgram fs_mg_prolong;
+    KernelProgram fs_residual_norm;
+    KernelProgram fs_reduce_norm;
+    KernelProgram fs_brick_activity;
+    KernelProgram fs_brick_compact;
+    KernelProgram fs_brick_dispatch_args;
+    KernelProgram fs_max_velocity;
+    KernelProgram fs_surface_force;
+    KernelProgram fs_brick_slots;
+    std::map<GLenum, KernelProgram> fs_brick_field;     // One per format of the pooled fields
+
+    // DECLARE FIELD FORMATS
+    FieldFormats formats;
 
     // DECLARE GRID SIZE
     uint32_t grid_width, grid_height, grid_depth;
     float sclx, scly, sclz;
 
-    // DECLARE MAXIMUM JACOBI ITERATIONS * 2
+    // DECLARE MAXIMUM JACOBI ITERATIONS * 2 (THE TOLERANCE CAN ONLY END THE SOLVE EARLIER)
     int max_iterations = 10;
+
+    // DECLARE JACOBI SWEEPS PER DISPATCH (1, OR 2/4 FOR THE SHARED MEMORY BLOCKED KERNEL)
+    int jacobi_sweeps_per_dispatch = 2;
+
+    // DECLARE RESIDUAL DRIVEN STOPPING (TOLERANCE <= 0 RUNS THE FULL COUNT, INTERVALS BELOW 1 CHECK
+    // EVERY ITERATION. A JACOBI CHECK IS READ BACK WHILE THE NEXT ONE RUNS, SO THAT SOLVE STOPS ONE CHECK LATE,
+    // MULTIGRID CHECKS EVERY CYCLE AND READS IT RIGHT AWAY)
+    float pressure_tolerance = 1e-2f;
+    int residual_check_interval = 4;
+    PressureSolveStats pressure_stats = { 0, -1.0f, -1.0f };
+    uint32_t residual_partials_ssbo, residual_result_ssbo;
+    uint32_t residual_partial_count;
+    AsyncReadback residual_readback;
+    uint64_t residual_pending = 0;
+
+    // DECLARE MULTIGRID SETTINGS (MG_CYCLES CAPS THE CYCLES OF A SOLVE, WHICH ENDS EARLIER ONCE IT MEETS THE TOLERANCE)
+    PressureSolver pressure_solver;
+    int mg_cycles = 4;
+    int mg_pre_sweeps = 2;
+    int mg_post_sweeps = 2;
+    int mg_coarse_sweeps = 16;
+    float mg_omega = 6.0f / 7.0f;
+    std::vector<MultigridLevel> mg_levels;
     
-    // DECLARE COUNTER FOR WRITING PIXEL BUFFERS
+    // DECLARE ADVECTION PATH (ONE FUSED DISPATCH FOR EVERY FIELD, OR ONE DISPATCH PER FIELD)
+    bool fused_advection = true;
+
+    // DECLARE FORCE/PROJECTION PATH (FORCES AND DIVERGENCE IN ONE PASS, PROJECTION IN PLACE)
+    bool fused_projection = true;
+
+    // DECLARE SPARSE BRICK SCHEDULING (PER-CELL KERNELS ONLY RUN OVER 8^3 BRICKS THAT MOVED, WERE FORCED,
+    // DIVERGED, CHANGED TEMPERATURE OR CHANGED MASK IN THE LAST BRICK_HYSTERESIS STEPS, PLUS A ONE BRICK HALO)
+    bool sparse_bricks = true;
+    float brick_velocity_threshold = 1e-3f;
+    float brick_temperature_threshold = 1e-2f;
+    int brick_hysteresis = 8;
+    uint32_t brick_count_x, brick_count_y, brick_count_z;
+    uint32_t brick_state_ssbo, brick_list_ssbo, brick_dispatch_buffer;
+
+    // DECLARE FIELD STORAGE (THE BRICK POOL ALWAYS DISPATCHES OVER THE BRICK LIST, WITHOUT SPARSE_BRICKS
+    // EVERY BRICK STAYS SCHEDULED. THE ATLASES GROW WHEN THE FREE SLOTS READ BACK A FEW STEPS LATE RUN
+    // BELOW HALF THE HEADROOM, AND ARE COMPACTED WHEN LESS THAN A QUARTER OF THEM IS IN USE. BRICKS WOKEN
+    // WHILE THE POOL IS FULL STAY TILES UNTIL THE GROWTH LANDS, BRICK_POOL_FAILED COUNTS THEM)
+    FieldStorage storage;
+    float brick_pool_headroom = 0.25f;
+    uint32_t brick_pool_capacity = 0;
+    uint32_t brick_pool_used = 0;
+    uint32_t brick_pool_failed = 0;
+    uint32_t brick_pool_tile_layers = 0;
+    uint32_t brick_table_ssbo = 0, brick_pool_ssbo = 0;
+    AsyncReadback brick_pool_readback;
+
+    // DECLARE CFL TIMESTEP (SUBSTEPS OF AT MOST MAX_TIMESTEP, SIZED SO THE FASTEST CELL MOVES AT MOST
+    // CFL_NUMBER CELLS. MAX_VELOCITY IS READ BACK A FEW STEPS LATE WITHOUT STALLING, THEN PADDED)
+    bool adaptive_timestep = true;
+    float cfl_number = 1.0f;
+    float max_timestep = 1.0f / 30.0f;
+    float max_velocity_margin = 1.25f;
+    float max_velocity = 0.0f;
+    int substeps = 0;
+    uint32_t velocity_result_ssbo;
+    AsyncReadback velocity_readback;
+
+    // DECLARE SURFACE FORCE COUPLING (SAMPLES PER CELL ALONG EACH SIDE OF A BODY, AND THE PER-BODY
+    // FORCES READ BACK A FEW FRAMES LATE WITHOUT STALLING)
+    float surface_samples_per_cell = 2.0f;
+    uint32_t surface_bodies_ssbo, surface_forces_ssbo;
+    AsyncReadback surface_force_readback;
+
+    // DECLARE REGION READBACKS (ONE RING PER FIELD, ALLOCATED ON FIRST USE)
+    AsyncReadback region_readbacks[READBACK_FIELD_COUNT];
+
+    // DECLARE BACKEND (THE CPU SOLVER IS CREATED ON FIRST USE, ONLY FOLLOWS THE JACOBI PATH AND DOES
+    // NOT ADVECT THE EXTRA SCALAR FIELDS)
+    Backend backend = BACKEND_GPU;
+    std::unique_ptr<CpuSolver> cpu_solver;
+
+    // DECLARE STEP PARAMETERS (UPLOADED TO THE UNIFORM BUFFER ONCE PER STEP, DT IS SET BY STEP)
+    StepParameters step_params;
+    uint32_t step_params_ubo;
+
+    // DECLARE INDEX OF THE LATEST PRESSURE IN THE PRESSURE RING
     int iter = 0;
 
-    // DECLARE TEXTURES
-    Texture3D u;
-    Texture3D world_mask;
-    Texture3D lin_buffer;
-    Texture3D nearest_buffer;
+    // DECLARE TEXTURES (PAIRS ARE READ FROM FRONT, WRITTEN TO BACK AND SWAPPED)
+    Texture3DPair u;
+    Texture3DPair world_mask;
     Texture3D zero;
-    Texture3D q;
+    Texture3DPair q;
     Texture3D forces;
-    Texture3D temp;
+    Texture3DPair temp;
     Texture3D temp_solid;
     Texture3D divq;
-    Texture3D pres;
-    Texture3D lin_buffer2;
+    Texture3DPair pres;
     Texture3D prescpy[3];
 
-    Engine(uint32_t w, uint32_t h, uint32_t d, float dx, float dy, float dz);
+    // DECLARE EXTRA PASSIVE SCALAR FIELDS (4 SCALARS PER TEXTURE, ONLY ADVECTED BY THE FUSED PATH)
+    std::vector<Texture3DPair> scalars;
+
+    // DECLARE COMPUTE GRAPHS (BARRIERS ARE TRACKED ACROSS BOTH GRAPHS, THE SOLVERS AND ANY
+    // OTHER PASS THAT SHARES THEM, E.G. THE MASK PASSES THAT FEED STEP)
+    ComputeBarriers barriers;
+    ComputeGraph advance_graph;         // Mask overlay, advection, forces and divergence
+    ComputeGraph projection_graph;      // Projection with the solved pressure
+
+    Engine(uint32_t w, uint32_t h, uint32_t d, float dx, float dy, float dz, PressureSolver solver = PRESSURE_SOLVER_JACOBI,
+           FieldFormats field_formats = FieldFormats(), FieldStorage field_storage = FIELD_STORAGE_DENSE);
+
+    //
+    // Frees the fields, buffers, kernels and readbacks. The GL context has
+    // to still be current
+    //
+    ~Engine();
 
     void step(float dt, Texture3D *solid_mask, Texture3D *velocity_mask, Texture3D *temperature_mask);
+
+    //
+    // Advances the simulation by dt in at most max_steps substeps. With
+    // adaptive_timestep the substep is the CFL limit for the latest known
+    // max_velocity (capped at max_timestep) and time that does not fit in
+    // max_steps substeps is dropped. Without it, dt is chopped into fixed
+    // 1/60 steps
+    //
     void step(float dt, Texture3D *solid_mask, Texture3D *velocity_mask, Texture3D *temperature_mask, int max_steps);
 
+    //
+    // Largest stable substep for the latest known max_velocity
+    //
+    float cfl_timestep() const;
+
+    //
+    // Integrates the latest pressure over the surface of every body in one
+    // dispatch and queues the per-body results for readback. grid_offset is
+    // the world position of the grid's center
+    //
+    void integrate_surface_forces(std::vector<SurfaceBody> bodies, glm::vec3 grid_offset);
+
+    //
+    // The newest completed integrate_surface_forces results, one per body in
+    // the order they were given, or nullptr while none has completed
+    //
+    const SurfaceForce *latest_surface_forces();
+
+    //
+    // Queues an async readback of a list of boxes of a field, packed back to
+    // back so only the requested cells are transferred. Returns false when
+    // the copy was skipped because every slot was still in flight
+    //
+    bool read_regions(ReadbackField field, const std::vector<ReadbackRegion> &regions);
+
+    //
+    // The newest completed read_regions copy of a field, or nullptr while none
+    // has completed. regions is set to its clipped table, whose offsets are
+    // in bytes
+    //
+    const float *latest_regions(ReadbackField field, const std::vector<ReadbackRegion> **regions);
+
+    //
+    // The texels covering a world space box, grown by margin cells on every
+    // side. grid_offset is the world position of the grid's center, and
+    // world y runs along the texture's z
+    //
+    ReadbackRegion region_around(glm::vec3 world_min, glm::vec3 world_max, glm::vec3 grid_offset, uint32_t margin = 1) const;
+
     void fluidsim_testing123();
 
+    //
+    // Adds a zero-initialized rgba field that is advected alongside q, and
+    // returns its index in scalars, or -1 when the GPU has no image units
+    // left for another field. Recompiles the fused advection kernel
+    //
+    int add_scalar_field();
+
+    //
+    // The most recently solved pressure field
+    //
+    Texture3D &pressure() {
+        return prescpy[iter];
+    }
+
+    //
+    // A grid sized texture with the cells of field, which is field itself
+    // unless the fields are stored in the brick pool. Pooled fields are
+    // unpacked into a scratch texture per format, which stays valid until
+    // the next dense_view of a field with the same format
+    //
+    Texture3D &dense_view(Texture3D &field);
+
+    //
+    // Moves the slots in use to the front of the brick pool's atlases and
+    // shrinks them to those slots plus brick_pool_headroom. Waits for the
+    // GPU, step only calls it once most of the pool has gone unused
+    //
+    void compact_brick_pool();
+
+    //
+    // Bytes of GPU memory held by the simulated fields: the atlases or the
+    // dense textures, and the dense views handed out so far
+    //
+    size_t field_memory();
+
+private:
+    // Inputs of the current step, copied so the recorded graphs can refer to them
+    Texture3D step_solid_mask, step_velocity_mask, step_temperature_mask;
+
+    // Settings the graphs were recorded with
+    bool recorded_fused_advection = false;
+    bool recorded_fused_projection = false;
+    bool recorded_sparse_bricks = false;
+    size_t recorded_scalar_count = 0;
+
+    // Whether cpu_solver holds the latest state, i.e. the last step ran on the CPU
+    bool cpu_state_current = false;
+
+    // Bits (1 << CpuField) of the fields whose textures lag behind cpu_solver
+    uint32_t stale_fields = 0;
+
+    // Whether every brick of the pool has a slot, as left by expand_brick_pool
+    bool brick_pool_expanded = false;
+
+    // Readbacks of the pool's counts issued up to this frame predate its last resize
+    uint64_t brick_pool_layout_frame = 0;
+
+    // Grid sized scratch textures dense_view unpacks pooled fields into, one per format
+    std::map<GLenum, Texture3D> dense_views;
+
+    void record_step_graphs();
+    void step_cpu();
+    Texture3D *cpu_field_texture(CpuField field);
+    void sync_cpu_state(uint32_t fields);
+    void reset_brick_state();
+    bool brick_list() const;
+    void dispatch_cells(const KernelProgram &kernel);
+    std::string format_defines() const;
+    void load_kernels();
+    void destroy_kernels();
+    void load_fused_advection();
+
+    Texture3D field_texture(uint32_t unit, GLint sampling_type, GLenum format) const;
+    std::vector<PooledQuantity> pooled_quantities();
+    std::vector<ComputeResource> pooled_resources();
+    void bind_brick_pool();
+    void record_brick_pool();
+    void brick_field(Texture3D &field, Texture3D &target, int operation);
+    void collapse_bricks();
+    void allocate_bricks();
+    void update_brick_pool();
+    void resize_brick_pool(uint32_t capacity);
+    void relayout_brick_pool(bool expand_all);
+    void expand_brick_pool();
+    Texture3D &dense_scratch(GLenum format);
+    void upload_field(Texture3D &field, const float *rgba);
+
+    void apply_world_mask_overlay();
+    void advect_fused();
+    void advect_velocity();
+    void advect_q();
+    void advect_temperature();
+    void force_divergence();
+    void apply_force();
+    void divergence();
+    void project();
+
+    void solve_pressure_jacobi();
+    void solve_pressure_multigrid();
+    bool check_pressure_residual(Texture3D &pressure_field);
+    bool read_pressure_residual();
+    void measure_max_velocity();
+    void poll_max_velocity();
+
+    void mg_vcycle(uint32_t level);
+    void mg_smooth(uint32_t level, int sweeps);
+    void mg_residual(uint32_t level);
+    void mg_restrict(uint32_t level, Texture3D &fine);
+    void mg_prolong(uint32_t level, bool accumulate);
+
 };
 
+//
+// Reads the fields of two engines on the same grid back through their dense
+// views and compares them, e.g. the same scene stepped on both backends.
+// Waits for the GPU, every difference is -1 when the grids do not match
+//
+FieldDifference field_difference(Engine &a, Engine &b);
+
 }
\ No newline at end of file
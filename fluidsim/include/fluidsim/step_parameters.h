@@ -0,0 +1,53 @@
+#pragma once
+
+#include <glm/glm.hpp>
+#include <stdint.h>
+
+namespace Fluidsim {
+
+//
+// Parameters shared by the kernels of one step, mirrored by the std140
+// StepParameters uniform block at binding 0. Every vec3/uvec3 packs with
+// the scalar after it into one 16 byte slot, so the members can be laid
+// out without any padding
+//
+struct StepParameters {
+    glm::vec3 scale;                    // Dimensions of a cell in x,y,z
+    float dt;                           // Delta time
+    glm::vec4 velocity_air;             // Ambient velocity of the air
+    glm::vec4 quantity_air;             // Ambient quantity q of the air
+    glm::vec4 temperature_air;          // Ambient temperature of the air
+    float rho;                          // Density
+    float g;                            // Gravitational acceleration
+    float buoyancy_temperature;         // Air temperature the buoyant force is measured against
+    float pressure_air;                 // Ambient pressure of the air
+    glm::uvec3 brick_count;             // Number of 8^3 bricks in x,y,z
+    uint32_t sparse_bricks;             // Non-zero when kernels run over the active brick list
+    glm::uvec3 grid_size;               // Number of cells in x,y,z, pooled fields are larger atlases
+    uint32_t pool_tile_layers;          // Layers at the front of a pooled atlas that hold the tile values
+};
+static_assert(sizeof(StepParameters) == 112, "StepParameters must match the std140 layout of the uniform block");
+
+//
+// The uniform block itself. Engine::format_defines injects it into every
+// kernel it compiles, so the kernels share this one declaration and only
+// this file has to change with the struct
+//
+static const char *const STEP_PARAMETERS_GLSL =
+    "layout(std140, binding = 0) uniform StepParameters {\n"
+    "    vec3 scale;\n"
+    "    float dt;\n"
+    "    vec4 velocity_air;\n"
+    "    vec4 quantity_air;\n"
+    "    vec4 temperature_air;\n"
+    "    float rho;\n"
+    "    float g;\n"
+    "    float buoyancy_temperature;\n"
+    "    float pressure_air;\n"
+    "    uvec3 brick_count;\n"
+    "    uint sparse_bricks;\n"
+    "    uvec3 grid_size;\n"
+    "    uint pool_tile_layers;\n"
+    "};\n";
+
+}
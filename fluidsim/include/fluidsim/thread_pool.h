@@ -0,0 +1,68 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace Fluidsim {
+
+//
+// Fixed set of worker threads for data parallel loops. parallel_for deals
+// the chunks of a range round robin to per-thread queues. Every thread
+// works the front of its own queue and steals from the back of the others
+// once it runs dry, so uneven chunks still balance out. The calling thread
+// takes part as worker 0
+//
+class ThreadPool {
+public:
+    explicit ThreadPool(unsigned thread_count = std::thread::hardware_concurrency());
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    //
+    // Runs fn(chunk_begin, chunk_end) over [begin, end) in chunks of at most
+    // grain, and returns once every chunk is done
+    //
+    void parallel_for(int begin, int end, int grain, const std::function<void(int, int)> &fn);
+
+    //
+    // Number of threads working on a parallel_for, including the caller
+    //
+    unsigned size() const {
+        return (unsigned) queues.size();
+    }
+
+private:
+    struct Task {
+        int begin, end;
+        const std::function<void(int, int)> *fn;
+    };
+
+    struct Queue {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    std::vector<std::unique_ptr<Queue>> queues;
+    std::vector<std::thread> threads;
+
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable finished;
+    uint64_t generation = 0;
+    bool stopping = false;
+    std::atomic<int> remaining { 0 };
+
+    void worker(unsigned index);
+    bool run_one(unsigned index);
+};
+
+}
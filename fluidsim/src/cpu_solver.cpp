@@ -0,0 +1,351 @@
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include "fluidsim/cpu_solver.h"
+
+using namespace Fluidsim;
+
+// ROWS ARE PADDED TO WHOLE VECTORS OF THE WIDEST LANES, AVX2
+const uint32_t ROW_ALIGNMENT = 8;
+
+#ifdef FLUIDSIM_AVX2
+static bool cpu_has_avx2() {
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    return __builtin_cpu_supports("avx2");
+#else
+    return false;
+#endif
+}
+#endif
+
+CpuSolver::CpuSolver(uint32_t width, uint32_t height, uint32_t depth, unsigned thread_count)
+    : width(width), height(height), depth(depth), pool(thread_count) {
+
+    // ROWS ARE PADDED TO WHOLE VECTORS PAST THE GHOST CELLS
+    row = ((width + 2 + ROW_ALIGNMENT - 1) / ROW_ALIGNMENT) * ROW_ALIGNMENT;
+    slab = row * (height + 2);
+    cells = (size_t) slab * (depth + 2);
+
+    // A FEW BLOCKS PER THREAD, AS TALL IN Z AS THAT ALLOWS
+    blocks_y = (height + BLOCK_ROWS - 1) / BLOCK_ROWS;
+    uint32_t wanted = pool.size() * 4;
+    blocks_z = std::min(depth, std::max(1u, (wanted + blocks_y - 1) / blocks_y));
+    block_planes = (depth + blocks_z - 1) / blocks_z;
+    blocks_z = (depth + block_planes - 1) / block_planes;
+
+#ifdef FLUIDSIM_AVX2
+    // THE AVX2 BUILD OF THE STENCILS ONLY RUNS WHERE THE CPU HAS IT
+    stencils = cpu_has_avx2() ? &avx2_stencils() : &baseline_stencils();
+#else
+    stencils = &baseline_stencils();
+#endif
+
+    // EVERY GRID STARTS AT ZERO, WHICH IS ALSO WHAT THE GHOST CELLS KEEP
+    for (std::vector<float> *grid : { &temp, &temp_next, &pressure, &pressure_next, &mask, &div, &solid_overlay, &solid_temp }) {
+        grid->assign(cells, 0.0f);
+    }
+    for (int c = 0; c < 3; c++) {
+        u[c].assign(cells, 0.0f);
+        u_next[c].assign(cells, 0.0f);
+        solid_u[c].assign(cells, 0.0f);
+        forces[c].assign(cells, 0.0f);
+    }
+    for (int c = 0; c < 4; c++) {
+        q[c].assign(cells, 0.0f);
+        q_next[c].assign(cells, 0.0f);
+    }
+}
+
+void CpuSolver::channels(CpuField field, std::vector<float> **grids, int *count) {
+    *count = 1;
+    switch (field) {
+    case CPU_VELOCITY:          *count = 3; for (int c = 0; c < 3; c++) grids[c] = &u[c]; break;
+    case CPU_QUANTITY:          *count = 4; for (int c = 0; c < 4; c++) grids[c] = &q[c]; break;
+    case CPU_TEMPERATURE:       grids[0] = &temp; break;
+    case CPU_PRESSURE:          grids[0] = &pressure; break;
+    case CPU_WORLD_MASK:        grids[0] = &mask; break;
+    case CPU_DIVERGENCE:        grids[0] = &div; break;
+    case CPU_SOLID_OVERLAY:     grids[0] = &solid_overlay; break;
+    case CPU_SOLID_VELOCITY:    *count = 3; for (int c = 0; c < 3; c++) grids[c] = &solid_u[c]; break;
+    case CPU_SOLID_TEMPERATURE: grids[0] = &solid_temp; break;
+    default:                    *count = 3; for (int c = 0; c < 3; c++) grids[c] = &forces[c]; break;
+    }
+}
+
+void CpuSolver::write(CpuField field, const float *rgba) {
+    std::vector<float> *grids[4];
+    int count;
+    channels(field, grids, &count);
+
+    // THE OVERLAY ONLY CARRIES ITS SOLID FLAG IN ALPHA
+    int first = field == CPU_SOLID_OVERLAY ? 3 : 0;
+
+    for_slabs([&](uint32_t z0, uint32_t z1) {
+        for (uint32_t z = z0; z < z1; z++) {
+            for (uint32_t y = 0; y < height; y++) {
+                const float *src = rgba + ((size_t) z * height + y) * width * 4;
+                size_t i = index(0, y, z);
+                for (uint32_t x = 0; x < width; x++) {
+                    for (int c = 0; c < count; c++) {
+                        (*grids[c])[i + x] = src[x * 4 + first + c];
+                    }
+                }
+            }
+        }
+    });
+}
+
+void CpuSolver::read(CpuField field, float *rgba) {
+    std::vector<float> *grids[4];
+    int count;
+    channels(field, grids, &count);
+    int first = field == CPU_SOLID_OVERLAY ? 3 : 0;
+
+    for_slabs([&](uint32_t z0, uint32_t z1) {
+        for (uint32_t z = z0; z < z1; z++) {
+            for (uint32_t y = 0; y < height; y++) {
+                float *dst = rgba + ((size_t) z * height + y) * width * 4;
+                size_t i = index(0, y, z);
+                for (uint32_t x = 0; x < width; x++) {
+                    for (int c = 0; c < 4; c++) {
+                        dst[x * 4 + c] = c >= first && c < first + count ? (*grids[c - first])[i + x] : 0.0f;
+                    }
+                }
+            }
+        }
+    });
+}
+
+//
+// Splits the interior z range into a few slabs per thread, so that stealing
+// can even out slabs with more fluid in them
+//
+void CpuSolver::for_slabs(const std::function<void(uint32_t, uint32_t)> &fn) {
+    int grain = std::max(1, (int) depth / (int) (pool.size() * 4));
+    pool.parallel_for(0, depth, grain, [&](int z0, int z1) { fn(z0, z1); });
+}
+
+//
+// Runs fn(block, block_index) over every block of the interior, see
+// CpuSolver. Block indices run from 0 to blocks_y * blocks_z
+//
+void CpuSolver::for_blocks(const std::function<void(const StencilBlock &, uint32_t)> &fn) {
+    pool.parallel_for(0, blocks_y * blocks_z, 1, [&](int first, int last) {
+        for (uint32_t b = first; b < (uint32_t) last; b++) {
+            uint32_t by = b % blocks_y, bz = b / blocks_y;
+            StencilBlock block = {
+                by * BLOCK_ROWS, std::min(height, (by + 1) * BLOCK_ROWS),
+                bz * block_planes, std::min(depth, (bz + 1) * block_planes),
+            };
+            fn(block, b);
+        }
+    });
+}
+
+//
+// The grids as the stencils see them. Taken again after every swap of a
+// grid with its next one
+//
+StencilGrids CpuSolver::stencil_grids() {
+    StencilGrids grids;
+    grids.width = width;
+    grids.height = height;
+    grids.depth = depth;
+    grids.row = row;
+    grids.slab = slab;
+    for (int c = 0; c < 3; c++) {
+        grids.u[c] = u[c].data();
+        grids.u_next[c] = u_next[c].data();
+        grids.solid_u[c] = solid_u[c].data();
+    }
+    for (int c = 0; c < 4; c++) {
+        grids.q[c] = q[c].data();
+        grids.q_next[c] = q_next[c].data();
+    }
+    grids.temp = temp.data();
+    grids.temp_next = temp_next.data();
+    grids.mask = mask.data();
+    grids.div = div.data();
+    grids.solid_temp = solid_temp.data();
+    return grids;
+}
+
+void CpuSolver::step(const StepParameters &params, int max_iterations, float tolerance, int residual_check_interval) {
+    apply_world_mask_overlay();
+    advect(params);
+    apply_force(params);
+    divergence();
+    solve_pressure(params, max_iterations, tolerance, residual_check_interval);
+    project();
+}
+
+float CpuSolver::max_velocity() {
+    std::vector<float> partials(depth, 0.0f);
+
+    for_slabs([&](uint32_t z0, uint32_t z1) {
+        for (uint32_t z = z0; z < z1; z++) {
+            float speed = 0.0f;
+            for (uint32_t y = 0; y < height; y++) {
+                for (size_t i = index(0, y, z), end = i + width; i < end; i++) {
+                    if (mask[i] != 0.0f) {
+                        speed = std::max(speed, u[0][i] * u[0][i] + u[1][i] * u[1][i] + u[2][i] * u[2][i]);
+                    }
+                }
+            }
+            partials[z] = speed;
+        }
+    });
+
+    return std::sqrt(*std::max_element(partials.begin(), partials.end()));
+}
+
+void CpuSolver::apply_world_mask_overlay() {
+    for_slabs([&](uint32_t z0, uint32_t z1) {
+        for (uint32_t z = z0; z < z1; z++) {
+            for (uint32_t y = 0; y < height; y++) {
+                for (size_t i = index(0, y, z), end = i + width; i < end; i++) {
+                    float current = mask[i];
+                    if (current == 0.0f || current == 1.0f) {
+                        current = 2.0f;
+                    }
+                    if (solid_overlay[i] == 1.0f) {
+                        current = 0.0f;
+                    }
+                    mask[i] = current;
+                }
+            }
+        }
+    });
+}
+
+void CpuSolver::advect(const StepParameters &params) {
+    StencilGrids grids = stencil_grids();
+    for_blocks([&](const StencilBlock &block, uint32_t) {
+        stencils->advect(grids, block, params);
+    });
+
+    for (int c = 0; c < 3; c++) u[c].swap(u_next[c]);
+    for (int c = 0; c < 4; c++) q[c].swap(q_next[c]);
+    temp.swap(temp_next);
+}
+
+void CpuSolver::apply_force(const StepParameters &params) {
+    const float mass = params.rho * params.scale.x * params.scale.y * params.scale.z;
+
+    for_slabs([&](uint32_t z0, uint32_t z1) {
+        for (uint32_t z = z0; z < z1; z++) {
+            for (uint32_t y = 0; y < height; y++) {
+                for (size_t i = index(0, y, z), end = i + width; i < end; i++) {
+                    if (mask[i] == 0.0f) {
+                        continue;
+                    }
+
+                    // SAME (LOPSIDED) AVERAGE AS FS_APPLY_FORCE, LEFT AND RIGHT COUNT TWICE
+                    float temp_avg = (temp[i] + temp[i - 1] + temp[i + 1] + temp[i - row] + temp[i + row]
+                                      + temp[i - 1] + temp[i + 1]) / 7.0f + 1.0f;
+                    float delta_temp = (1.0f / params.buoyancy_temperature) - (1.0f / temp_avg);
+                    float buoyant = -100.0f * (delta_temp * mass * params.g * pressure[i]) / 8.314f;
+                    float gravity = mass * params.g;
+
+                    u[0][i] += forces[0][i] / mass * params.dt;
+                    u[1][i] += (forces[1][i] + buoyant + gravity) / mass * params.dt;
+                    u[2][i] += forces[2][i] / mass * params.dt;
+                }
+            }
+        }
+    });
+}
+
+void CpuSolver::divergence() {
+    StencilGrids grids = stencil_grids();
+    for_blocks([&](const StencilBlock &block, uint32_t) {
+        stencils->divergence(grids, block);
+    });
+}
+
+void CpuSolver::jacobi_sweep(const std::vector<float> &src, std::vector<float> &dst, float pressure_air) {
+    StencilGrids grids = stencil_grids();
+    for_blocks([&](const StencilBlock &block, uint32_t) {
+        stencils->jacobi(grids, block, src.data(), dst.data(), pressure_air);
+    });
+}
+
+//
+// Mirrors Engine::solve_pressure_jacobi, including when the residual is
+// checked and that a check only decides anything once the next one is
+// taken, as the GPU reads each check back a check late. Both backends stop
+// after the same number of iterations and report the same check
+//
+void CpuSolver::solve_pressure(const StepParameters &params, int max_iterations, float tolerance, int residual_check_interval) {
+    solve_stats = { 0, -1.0f, -1.0f };
+    bool converged = false;
+    int next_check = 0;
+
+    // THE CHECK THE GPU WOULD STILL HAVE IN FLIGHT
+    CpuSolveStats pending = { 0, -1.0f, -1.0f };
+    bool pending_converged = false, has_pending = false;
+
+    while (solve_stats.iterations < max_iterations) {
+        if (tolerance > 0.0f && solve_stats.iterations >= next_check) {
+            next_check = solve_stats.iterations + std::max(residual_check_interval, 1);
+            CpuSolveStats check = { 0, -1.0f, -1.0f };
+            bool check_converged = measure_residual(pressure, params.pressure_air, tolerance, check);
+
+            if (has_pending) {
+                solve_stats.residual_l2 = pending.residual_l2;
+                solve_stats.residual_linf = pending.residual_linf;
+                converged = pending_converged;
+            }
+            pending = check;
+            pending_converged = check_converged;
+            has_pending = true;
+            if (converged) break;
+        }
+
+        for (int sweep = 0; sweep < 2; sweep++) {
+            jacobi_sweep(pressure, pressure_next, params.pressure_air);
+            pressure.swap(pressure_next);
+        }
+        solve_stats.iterations++;
+    }
+
+    // REPORT THE LAST CHECK, NOT THE FINAL PRESSURE, THE SAME AS THE GPU
+    if (!converged && has_pending) {
+        solve_stats.residual_l2 = pending.residual_l2;
+        solve_stats.residual_linf = pending.residual_linf;
+    }
+}
+
+bool CpuSolver::measure_residual(const std::vector<float> &p, float pressure_air, float tolerance, CpuSolveStats &check) {
+    // x: sum r^2, y: max |r|, z: sum div^2, ONE PARTIAL PER BLOCK
+    std::vector<glm::vec3> partials(blocks_y * blocks_z, glm::vec3(0.0f));
+
+    StencilGrids grids = stencil_grids();
+    for_blocks([&](const StencilBlock &block, uint32_t b) {
+        float sums[3];
+        stencils->residual(grids, block, p.data(), pressure_air, sums);
+        partials[b] = glm::vec3(sums[0], sums[1], sums[2]);
+    });
+
+    glm::vec3 result(0.0f);
+    for (const glm::vec3 &partial : partials) {
+        result.x += partial.x;
+        result.y = std::max(result.y, partial.y);
+        result.z += partial.z;
+    }
+
+    float r_norm = std::sqrt(result.x);
+    float b_norm = std::sqrt(result.z);
+
+    check.residual_l2 = b_norm > 0.0f ? r_norm / b_norm : r_norm;
+    check.residual_linf = result.y;
+
+    return r_norm <= tolerance * b_norm;
+}
+
+void CpuSolver::project() {
+    StencilGrids grids = stencil_grids();
+    for_blocks([&](const StencilBlock &block, uint32_t) {
+        stencils->project(grids, block, pressure.data());
+    });
+}
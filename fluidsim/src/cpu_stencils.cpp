@@ -0,0 +1,495 @@
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include "fluidsim/cpu_stencils.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+//
+// Built once for the target as is, and with FLUIDSIM_AVX2 once more by
+// cpu_stencils_avx2.cpp with AVX2 enabled. Each build has a namespace of
+// its own, so the linker never swaps the inline functions of one for the
+// other's
+//
+#ifdef CPU_STENCILS_AVX2
+#define STENCILS avx2
+#define STENCIL_TABLE avx2_stencils
+#else
+#define STENCILS baseline
+#define STENCIL_TABLE baseline_stencils
+#endif
+
+namespace Fluidsim {
+namespace STENCILS {
+
+//
+// Lanes of floats and comparison masks for the stencils. Every instruction
+// set provides the same handful of operations, the scalar one also handles
+// the tail of each row. gather loads base[index[lane]] into every lane
+//
+struct Scalar {
+    float v;
+    static const int lanes = 1;
+};
+
+inline Scalar load(const float *p, Scalar) { return { *p }; }
+inline void store(float *p, Scalar a) { *p = a.v; }
+inline Scalar splat(float f, Scalar) { return { f }; }
+inline Scalar gather(const float *base, const int32_t *index, Scalar) { return { base[index[0]] }; }
+inline Scalar operator+(Scalar a, Scalar b) { return { a.v + b.v }; }
+inline Scalar operator-(Scalar a, Scalar b) { return { a.v - b.v }; }
+inline Scalar operator*(Scalar a, Scalar b) { return { a.v * b.v }; }
+inline Scalar operator/(Scalar a, Scalar b) { return { a.v / b.v }; }
+inline Scalar minimum(Scalar a, Scalar b) { return a.v < b.v ? a : b; }
+inline Scalar maximum(Scalar a, Scalar b) { return a.v > b.v ? a : b; }
+inline Scalar absolute(Scalar a) { return { std::fabs(a.v) }; }
+inline Scalar round_down(Scalar a) { return { std::floor(a.v) }; }
+inline bool equal(Scalar a, Scalar b) { return a.v == b.v; }
+inline bool either(bool a, bool b) { return a || b; }
+inline bool every(bool m) { return m; }
+inline Scalar select(bool m, Scalar a, Scalar b) { return m ? a : b; }
+
+#if defined(__AVX2__)
+struct Simd {
+    __m256 v;
+    static const int lanes = 8;
+};
+const char *const LANE_NAME = "avx2";
+
+inline Simd load(const float *p, Simd) { return { _mm256_loadu_ps(p) }; }
+inline void store(float *p, Simd a) { _mm256_storeu_ps(p, a.v); }
+inline Simd splat(float f, Simd) { return { _mm256_set1_ps(f) }; }
+inline Simd gather(const float *base, const int32_t *index, Simd) { return { _mm256_i32gather_ps(base, _mm256_loadu_si256((const __m256i *) index), 4) }; }
+inline Simd operator+(Simd a, Simd b) { return { _mm256_add_ps(a.v, b.v) }; }
+inline Simd operator-(Simd a, Simd b) { return { _mm256_sub_ps(a.v, b.v) }; }
+inline Simd operator*(Simd a, Simd b) { return { _mm256_mul_ps(a.v, b.v) }; }
+inline Simd operator/(Simd a, Simd b) { return { _mm256_div_ps(a.v, b.v) }; }
+inline Simd minimum(Simd a, Simd b) { return { _mm256_min_ps(a.v, b.v) }; }
+inline Simd maximum(Simd a, Simd b) { return { _mm256_max_ps(a.v, b.v) }; }
+inline Simd absolute(Simd a) { return { _mm256_andnot_ps(_mm256_set1_ps(-0.0f), a.v) }; }
+inline Simd round_down(Simd a) { return { _mm256_floor_ps(a.v) }; }
+inline __m256 equal(Simd a, Simd b) { return _mm256_cmp_ps(a.v, b.v, _CMP_EQ_OQ); }
+inline __m256 either(__m256 a, __m256 b) { return _mm256_or_ps(a, b); }
+inline bool every(__m256 m) { return _mm256_movemask_ps(m) == 0xff; }
+inline Simd select(__m256 m, Simd a, Simd b) { return { _mm256_blendv_ps(b.v, a.v, m) }; }
+#elif defined(__SSE2__)
+struct Simd {
+    __m128 v;
+    static const int lanes = 4;
+};
+const char *const LANE_NAME = "sse2";
+
+inline Simd load(const float *p, Simd) { return { _mm_loadu_ps(p) }; }
+inline void store(float *p, Simd a) { _mm_storeu_ps(p, a.v); }
+inline Simd splat(float f, Simd) { return { _mm_set1_ps(f) }; }
+inline Simd gather(const float *base, const int32_t *index, Simd) { return { _mm_setr_ps(base[index[0]], base[index[1]], base[index[2]], base[index[3]]) }; }
+inline Simd operator+(Simd a, Simd b) { return { _mm_add_ps(a.v, b.v) }; }
+inline Simd operator-(Simd a, Simd b) { return { _mm_sub_ps(a.v, b.v) }; }
+inline Simd operator*(Simd a, Simd b) { return { _mm_mul_ps(a.v, b.v) }; }
+inline Simd operator/(Simd a, Simd b) { return { _mm_div_ps(a.v, b.v) }; }
+inline Simd minimum(Simd a, Simd b) { return { _mm_min_ps(a.v, b.v) }; }
+inline Simd maximum(Simd a, Simd b) { return { _mm_max_ps(a.v, b.v) }; }
+inline Simd absolute(Simd a) { return { _mm_andnot_ps(_mm_set1_ps(-0.0f), a.v) }; }
+inline Simd round_down(Simd a) {
+    // NO FLOOR BEFORE SSE4.1, TRUNCATE AND STEP DOWN WHERE THAT ROUNDED UP
+    __m128 truncated = _mm_cvtepi32_ps(_mm_cvttps_epi32(a.v));
+    return { _mm_sub_ps(truncated, _mm_and_ps(_mm_cmpgt_ps(truncated, a.v), _mm_set1_ps(1.0f))) };
+}
+inline __m128 equal(Simd a, Simd b) { return _mm_cmpeq_ps(a.v, b.v); }
+inline __m128 either(__m128 a, __m128 b) { return _mm_or_ps(a, b); }
+inline bool every(__m128 m) { return _mm_movemask_ps(m) == 0xf; }
+inline Simd select(__m128 m, Simd a, Simd b) { return { _mm_or_ps(_mm_and_ps(m, a.v), _mm_andnot_ps(m, b.v)) }; }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+struct Simd {
+    float32x4_t v;
+    static const int lanes = 4;
+};
+const char *const LANE_NAME = "neon";
+
+inline Simd load(const float *p, Simd) { return { vld1q_f32(p) }; }
+inline void store(float *p, Simd a) { vst1q_f32(p, a.v); }
+inline Simd splat(float f, Simd) { return { vdupq_n_f32(f) }; }
+inline Simd gather(const float *base, const int32_t *index, Simd) {
+    float lanes[4] = { base[index[0]], base[index[1]], base[index[2]], base[index[3]] };
+    return { vld1q_f32(lanes) };
+}
+inline Simd operator+(Simd a, Simd b) { return { vaddq_f32(a.v, b.v) }; }
+inline Simd operator-(Simd a, Simd b) { return { vsubq_f32(a.v, b.v) }; }
+inline Simd operator*(Simd a, Simd b) { return { vmulq_f32(a.v, b.v) }; }
+inline Simd operator/(Simd a, Simd b) { return { vdivq_f32(a.v, b.v) }; }
+inline Simd minimum(Simd a, Simd b) { return { vminq_f32(a.v, b.v) }; }
+inline Simd maximum(Simd a, Simd b) { return { vmaxq_f32(a.v, b.v) }; }
+inline Simd absolute(Simd a) { return { vabsq_f32(a.v) }; }
+inline Simd round_down(Simd a) { return { vrndmq_f32(a.v) }; }
+inline uint32x4_t equal(Simd a, Simd b) { return vceqq_f32(a.v, b.v); }
+inline uint32x4_t either(uint32x4_t a, uint32x4_t b) { return vorrq_u32(a, b); }
+inline bool every(uint32x4_t m) { return vminvq_u32(m) != 0; }
+inline Simd select(uint32x4_t m, Simd a, Simd b) { return { vbslq_f32(m, a.v, b.v) }; }
+#else
+typedef Scalar Simd;
+const char *const LANE_NAME = "scalar";
+#endif
+
+//
+// Runs fn(lanes, i, x, y, z) over the cells of a block, whole vectors from
+// the start of every row and single cells for its tail. lanes is a Simd or
+// a Scalar, only its type matters
+//
+template <typename Fn>
+inline void for_cells(const StencilGrids &grids, const StencilBlock &block, Fn fn) {
+    for (uint32_t z = block.z0; z < block.z1; z++) {
+        for (uint32_t y = block.y0; y < block.y1; y++) {
+            size_t first = grids.index(0, y, z);
+            uint32_t x = 0;
+            for (; x + Simd::lanes <= grids.width; x += Simd::lanes) {
+                fn(Simd(), first + x, x, y, z);
+            }
+            for (; x < grids.width; x++) {
+                fn(Scalar(), first + x, x, y, z);
+            }
+        }
+    }
+}
+
+//
+// Texel taps of a trilinear, clamp to edge texture() lookup for every lane.
+// Positions are in cells, so texel centers sit at +0.5
+//
+template <typename F>
+struct Taps {
+    int32_t index[8][F::lanes];
+    F weight[8];
+};
+
+inline int clamp_texel(float i, uint32_t size) {
+    // FAR OUTSIDE (OR NAN) CLAMPS BEFORE THE CONVERSION, WHICH COULD OVERFLOW
+    return !(i >= 0.0f) ? 0 : (i >= (float) size ? (int) size - 1 : (int) i);
+}
+
+template <typename F>
+inline void taps(const StencilGrids &grids, F px, F py, F pz, Taps<F> &result) {
+    const F half = splat(0.5f, F());
+    const F one = splat(1.0f, F());
+
+    F tx = px - half, ty = py - half, tz = pz - half;
+    F bx = round_down(tx), by = round_down(ty), bz = round_down(tz);
+    F fx = tx - bx, fy = ty - by, fz = tz - bz;
+
+    float base[3][F::lanes];
+    store(base[0], bx);
+    store(base[1], by);
+    store(base[2], bz);
+
+    for (int lane = 0; lane < F::lanes; lane++) {
+        int x[2] = { clamp_texel(base[0][lane], grids.width), clamp_texel(base[0][lane] + 1.0f, grids.width) };
+        int y[2] = { clamp_texel(base[1][lane], grids.height), clamp_texel(base[1][lane] + 1.0f, grids.height) };
+        int z[2] = { clamp_texel(base[2][lane], grids.depth), clamp_texel(base[2][lane] + 1.0f, grids.depth) };
+        for (int k = 0; k < 8; k++) {
+            result.index[k][lane] = (int32_t) grids.index(x[k & 1], y[(k >> 1) & 1], z[k >> 2]);
+        }
+    }
+
+    for (int k = 0; k < 8; k++) {
+        int a = k & 1, b = (k >> 1) & 1, c = k >> 2;
+        result.weight[k] = (a ? fx : one - fx) * (b ? fy : one - fy) * (c ? fz : one - fz);
+    }
+}
+
+template <typename F>
+inline F sample(const float *grid, const Taps<F> &at) {
+    F value = splat(0.0f, F());
+    for (int k = 0; k < 8; k++) {
+        value = value + at.weight[k] * gather(grid, at.index[k], F());
+    }
+    return value;
+}
+
+//
+// Advection of the cells [i, i + lanes) of a row, the same update as
+// fs_advect_fused.comp. Every lane is backtraced and the solid and air
+// lanes are then replaced, vectors without fluid skip the backtrace
+//
+template <typename F>
+inline void advect_cells(const StencilGrids &grids, size_t i, uint32_t x, uint32_t y, uint32_t z, const StepParameters &params) {
+    const F zero = splat(0.0f, F());
+    const F one = splat(1.0f, F());
+    const F half = splat(0.5f, F());
+
+    F m = load(grids.mask + i, F());
+    auto solid = equal(m, zero);
+    auto air = equal(m, one);
+
+    // SOLID CELLS TAKE THE BODY'S VALUES, AIR CELLS THE AMBIENT ONES
+    F u_still[3], temp_still;
+    for (int c = 0; c < 3; c++) {
+        u_still[c] = select(solid, load(grids.solid_u[c] + i, F()), splat(params.velocity_air[c], F()));
+    }
+    temp_still = select(solid, load(grids.solid_temp + i, F()), splat(params.temperature_air.x, F()));
+
+    if (every(either(solid, air))) {
+        for (int c = 0; c < 3; c++) store(grids.u_next[c] + i, u_still[c]);
+        for (int c = 0; c < 4; c++) store(grids.q_next[c] + i, splat(params.quantity_air[c], F()));
+        store(grids.temp_next + i, temp_still);
+        return;
+    }
+
+    // FLUID CELLS, BACKTRACE ONCE THE WAY FS_ADVECT_FUSED DOES
+    float lane_x[F::lanes];
+    for (int lane = 0; lane < F::lanes; lane++) {
+        lane_x[lane] = (float) (x + lane) + 0.5f;
+    }
+    const F px = load(lane_x, F()), py = splat(y + 0.5f, F()), pz = splat(z + 0.5f, F());
+    const F sx = splat(params.scale.x, F()), sy = splat(params.scale.y, F()), sz = splat(params.scale.z, F());
+    const F dt = splat(params.dt, F());
+
+    F vx = load(grids.u[0] + i, F()), vy = load(grids.u[1] + i, F()), vz = load(grids.u[2] + i, F());
+    F nx = (px * sx - dt * vx) / sx, ny = (py * sy - dt * vy) / sy, nz = (pz * sz - dt * vz) / sz;
+
+    Taps<F> at_npos;
+    taps(grids, nx, ny, nz, at_npos);
+    vx = zero - sample(grids.u[0], at_npos);
+    vy = zero - sample(grids.u[1], at_npos);
+    vz = zero - sample(grids.u[2], at_npos);
+    F nnx = (nx * sx - dt * vx) / sx, nny = (ny * sy - dt * vy) / sy, nnz = (nz * sz - dt * vz) / sz;
+
+    Taps<F> at_nnpos;
+    taps(grids, nnx, nny, nnz, at_nnpos);
+    vx = sample(grids.u[0], at_nnpos);
+    vy = sample(grids.u[1], at_nnpos);
+    vz = sample(grids.u[2], at_nnpos);
+    nnx = (nnx * sx - dt * vx) / sx;
+    nny = (nny * sy - dt * vy) / sy;
+    nnz = (nnz * sz - dt * vz) / sz;
+    taps(grids, nnx, nny, nnz, at_nnpos);
+
+    // THE CLAMPING BOX SAMPLES TEXEL CENTERS, SO THEY ARE PLAIN CLAMPED FETCHES
+    float box[3][F::lanes];
+    store(box[0], round_down(nx));
+    store(box[1], round_down(ny));
+    store(box[2], round_down(nz));
+
+    int32_t neighbourhood[27][F::lanes];
+    for (int lane = 0; lane < F::lanes; lane++) {
+        for (int k = 0; k < 27; k++) {
+            neighbourhood[k][lane] = (int32_t) grids.index(clamp_texel(box[0][lane] + (float) (k % 3 - 1), grids.width),
+                                                           clamp_texel(box[1][lane] + (float) ((k / 3) % 3 - 1), grids.height),
+                                                           clamp_texel(box[2][lane] + (float) (k / 9 - 1), grids.depth));
+        }
+    }
+
+    auto maccormack = [&](const float *grid) {
+        F phi_next = sample(grid, at_npos) + half * (load(grid + i, F()) - sample(grid, at_nnpos));
+        F lower = gather(grid, neighbourhood[0], F());
+        F upper = lower;
+        for (int k = 1; k < 27; k++) {
+            F value = gather(grid, neighbourhood[k], F());
+            lower = minimum(lower, value);
+            upper = maximum(upper, value);
+        }
+        return minimum(maximum(phi_next, lower), upper);
+    };
+
+    auto still = either(solid, air);
+    for (int c = 0; c < 3; c++) {
+        store(grids.u_next[c] + i, select(still, u_still[c], maccormack(grids.u[c])));
+    }
+    for (int c = 0; c < 4; c++) {
+        store(grids.q_next[c] + i, select(still, splat(params.quantity_air[c], F()), maccormack(grids.q[c])));
+    }
+    store(grids.temp_next + i, select(still, temp_still, sample(grids.temp, at_npos)));
+}
+
+//
+// Divergence of the cells [i, i + lanes) of a row, the same as fs_div.comp
+//
+template <typename F>
+inline void divergence_cells(const StencilGrids &grids, size_t i) {
+    const F zero = splat(0.0f, F());
+    const F half = splat(0.5f, F());
+
+    // SOLID NEIGHBOURS MOVE WITH THE BODY, UP IS -Z LIKE IN THE KERNELS
+    auto value = [&](int c, size_t n) {
+        return select(equal(load(grids.mask + n, F()), zero), load(grids.solid_u[c] + n, F()), load(grids.u[c] + n, F()));
+    };
+    store(grids.div + i, half * ((value(0, i + 1) - value(0, i - 1))
+                                 + (value(1, i + grids.row) - value(1, i - grids.row))
+                                 + (value(2, i - grids.slab) - value(2, i + grids.slab))));
+}
+
+//
+// One Jacobi sweep over the cells [i, i + lanes) of a row, the same update
+// as fs_jacobi_iter_pressure_obstacle.comp
+//
+template <typename F>
+inline void jacobi_cells(const StencilGrids &grids, size_t i, const float *p, float *out, float pressure_air) {
+    const F zero = splat(0.0f, F());
+    const F one = splat(1.0f, F());
+    const F six = splat(6.0f, F());
+    const F air = splat(pressure_air, F());
+
+    F pC = load(p + i, F());
+    F mC = load(grids.mask + i, F());
+
+    F sum = zero;
+    const ptrdiff_t offsets[6] = { -1, 1, -(ptrdiff_t) grids.row, (ptrdiff_t) grids.row, (ptrdiff_t) grids.slab, -(ptrdiff_t) grids.slab };
+    for (ptrdiff_t offset : offsets) {
+        F pN = load(p + i + offset, F());
+        F mN = load(grids.mask + i + offset, F());
+
+        // SOLID NEIGHBOURS DON'T CONTRIBUTE, AIR NEIGHBOURS HOLD THE AMBIENT PRESSURE
+        sum = sum + select(equal(mN, zero), pC, select(equal(mN, one), air, pN));
+    }
+
+    F iter = (sum - load(grids.div + i, F())) / six;
+    store(out + i, select(either(equal(mC, zero), equal(mC, one)), air, iter));
+}
+
+//
+// Residual of the cells [i, i + lanes) of a row, the same as
+// fs_residual_norm.comp, accumulated per lane
+//
+template <typename F>
+struct ResidualSums {
+    F r2, r_max, div2;
+};
+
+template <typename F>
+inline void residual_cells(const StencilGrids &grids, size_t i, const float *p, float pressure_air, ResidualSums<F> &sums) {
+    const F zero = splat(0.0f, F());
+    const F one = splat(1.0f, F());
+    const F air = splat(pressure_air, F());
+
+    F pC = load(p + i, F());
+    F mC = load(grids.mask + i, F());
+
+    F sum = zero;
+    F n = zero;
+    const ptrdiff_t offsets[6] = { -1, 1, -(ptrdiff_t) grids.row, (ptrdiff_t) grids.row, -(ptrdiff_t) grids.slab, (ptrdiff_t) grids.slab };
+    for (ptrdiff_t offset : offsets) {
+        F mN = load(grids.mask + i + offset, F());
+        auto solid = equal(mN, zero);
+        sum = select(solid, sum, sum + select(equal(mN, one), air, load(p + i + offset, F())));
+        n = select(solid, n, n + one);
+    }
+
+    // ONLY FLUID CELLS COUNT
+    auto skip = either(equal(mC, zero), equal(mC, one));
+    F d = load(grids.div + i, F());
+    F r = select(skip, zero, d - (sum - n * pC));
+    d = select(skip, zero, d);
+
+    sums.r2 = sums.r2 + r * r;
+    sums.r_max = maximum(sums.r_max, absolute(r));
+    sums.div2 = sums.div2 + d * d;
+}
+
+//
+// Projection of the cells [i, i + lanes) of a row in place, the same as
+// fs_pressure_proj.comp
+//
+template <typename F>
+inline void project_cells(const StencilGrids &grids, size_t i, const float *p) {
+    const F zero = splat(0.0f, F());
+    const F half = splat(0.5f, F());
+
+    // GRADIENT OF THE PRESSURE, OUTSIDE THE GRID READS AS ZERO
+    F v[3] = {
+        load(grids.u[0] + i, F()) - half * (load(p + i + 1, F()) - load(p + i - 1, F())),
+        load(grids.u[1] + i, F()) - half * (load(p + i + grids.row, F()) - load(p + i - grids.row, F())),
+        load(grids.u[2] + i, F()) - half * (load(p + i - grids.slab, F()) - load(p + i + grids.slab, F())),
+    };
+
+    auto solid = equal(load(grids.mask + i, F()), zero);
+    for (int c = 0; c < 3; c++) {
+        v[c] = select(solid, load(grids.solid_u[c] + i, F()), v[c]);
+    }
+
+    // FREE SLIP, THE NORMAL COMPONENT FOLLOWS THE SOLID NEIGHBOUR (IN KERNEL ORDER)
+    const ptrdiff_t neighbours[6] = { -1, 1, -(ptrdiff_t) grids.row, (ptrdiff_t) grids.row, (ptrdiff_t) grids.slab, -(ptrdiff_t) grids.slab };
+    for (int k = 0; k < 6; k++) {
+        size_t n = i + neighbours[k];
+        v[k / 2] = select(equal(load(grids.mask + n, F()), zero), load(grids.solid_u[k / 2] + n, F()), v[k / 2]);
+    }
+
+    for (int c = 0; c < 3; c++) {
+        store(grids.u[c] + i, v[c]);
+    }
+}
+
+void advect(const StencilGrids &grids, const StencilBlock &block, const StepParameters &params) {
+    for_cells(grids, block, [&](auto lanes, size_t i, uint32_t x, uint32_t y, uint32_t z) {
+        advect_cells<decltype(lanes)>(grids, i, x, y, z, params);
+    });
+}
+
+void divergence(const StencilGrids &grids, const StencilBlock &block) {
+    for_cells(grids, block, [&](auto lanes, size_t i, uint32_t, uint32_t, uint32_t) {
+        divergence_cells<decltype(lanes)>(grids, i);
+    });
+}
+
+void jacobi(const StencilGrids &grids, const StencilBlock &block, const float *src, float *dst, float pressure_air) {
+    for_cells(grids, block, [&](auto lanes, size_t i, uint32_t, uint32_t, uint32_t) {
+        jacobi_cells<decltype(lanes)>(grids, i, src, dst, pressure_air);
+    });
+}
+
+void residual(const StencilGrids &grids, const StencilBlock &block, const float *pressure, float pressure_air, float sums[3]) {
+    ResidualSums<Simd> wide = { splat(0.0f, Simd()), splat(0.0f, Simd()), splat(0.0f, Simd()) };
+    ResidualSums<Scalar> tail = { { 0.0f }, { 0.0f }, { 0.0f } };
+
+    for (uint32_t z = block.z0; z < block.z1; z++) {
+        for (uint32_t y = block.y0; y < block.y1; y++) {
+            size_t first = grids.index(0, y, z);
+            uint32_t x = 0;
+            for (; x + Simd::lanes <= grids.width; x += Simd::lanes) {
+                residual_cells<Simd>(grids, first + x, pressure, pressure_air, wide);
+            }
+            for (; x < grids.width; x++) {
+                residual_cells<Scalar>(grids, first + x, pressure, pressure_air, tail);
+            }
+        }
+    }
+
+    float r2[Simd::lanes], r_max[Simd::lanes], div2[Simd::lanes];
+    store(r2, wide.r2);
+    store(r_max, wide.r_max);
+    store(div2, wide.div2);
+
+    sums[0] = tail.r2.v;
+    sums[1] = tail.r_max.v;
+    sums[2] = tail.div2.v;
+    for (int lane = 0; lane < Simd::lanes; lane++) {
+        sums[0] += r2[lane];
+        sums[1] = std::max(sums[1], r_max[lane]);
+        sums[2] += div2[lane];
+    }
+}
+
+void project(const StencilGrids &grids, const StencilBlock &block, const float *pressure) {
+    for_cells(grids, block, [&](auto lanes, size_t i, uint32_t, uint32_t, uint32_t) {
+        project_cells<decltype(lanes)>(grids, i, pressure);
+    });
+}
+
+}
+
+const StencilTable &STENCIL_TABLE() {
+    static const StencilTable table = {
+        STENCILS::LANE_NAME,
+        STENCILS::advect,
+        STENCILS::divergence,
+        STENCILS::jacobi,
+        STENCILS::residual,
+        STENCILS::project,
+    };
+    return table;
+}
+
+}
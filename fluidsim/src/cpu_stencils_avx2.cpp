@@ -0,0 +1,7 @@
+//
+// The stencils of cpu_stencils.cpp once more, compiled with -mavx2 into
+// avx2_stencils. Only built when the compiler takes the flag, and only run
+// where the CPU has AVX2, see CpuSolver
+//
+#define CPU_STENCILS_AVX2
+#include "cpu_stencils.cpp"
@@ -1,13 +1,81 @@
+#include <algorithm>
+#include <cmath>
 #include <iostream>
+#include <string>
 #include "fluidsim/fluidsim.h"
 
 #include <engine/texture.h>
 #include <engine/framebuffer.h>
 #include <engine/shader.h>
+#include <engine/kernel_tuner.h>
+#include <engine/gpu_profiler.h>
 #include <glad/glad.h>
 
 namespace Fluidsim {
 
+//
+// GPU side copy for the rare case where a solve returns its initial guess
+// untouched and the result still has to land in a different texture
+//
+static void copy_texture(ComputeBarriers &barriers, const Texture3D &src, const Texture3D &dst) {
+    barriers.begin_pass({ ComputeResource::texture_update(src) }, { ComputeResource::texture_update(dst) });
+    glCopyImageSubData(src.id, GL_TEXTURE_3D, 0, 0, 0, 0,
+                       dst.id, GL_TEXTURE_3D, 0, 0, 0, 0,
+                       src.width, src.height, src.depth);
+    barriers.end_pass();
+}
+
+//
+// Bricks of the sparse scheduler, and the number of indirect commands
+// fs_brick_dispatch_args writes (one per power of two workgroups per brick)
+//
+static const uint32_t BRICK_SIZE = 8;
+static const uint32_t BRICK_CELLS = BRICK_SIZE * BRICK_SIZE * BRICK_SIZE;
+static const uint32_t BRICK_DISPATCH_COMMANDS = 10;
+
+//
+// Commands fs_brick_dispatch_args writes after those when the fields are
+// stored in the brick pool: its expand and collapse lists with a workgroup
+// per brick, then with an invocation per brick in workgroups of 64
+//
+enum BrickPoolCommand {
+    EXPAND_BRICKS = BRICK_DISPATCH_COMMANDS,
+    COLLAPSE_BRICKS,
+    EXPAND_SLOTS,
+    COLLAPSE_SLOTS,
+    BRICK_POOL_COMMANDS_END,
+};
+
+//
+// Operations of fs_brick_field.comp and fs_brick_slots.comp
+//
+enum BrickFieldOperation {
+    BRICK_FIELD_TEST,
+    BRICK_FIELD_COLLAPSE,
+    BRICK_FIELD_EXPAND,
+    BRICK_FIELD_MOVE,
+    BRICK_FIELD_UNPACK,
+    BRICK_FIELD_PACK,
+};
+
+enum BrickSlotsOperation {
+    BRICK_SLOTS_RELEASE,
+    BRICK_SLOTS_ALLOCATE,
+    BRICK_SLOTS_GROW,
+};
+
+//
+// Head of the BrickPool buffer, followed by its free stack, expand list,
+// collapse list and collapse flags of one brick count each. Only this part
+// is read back
+//
+struct BrickPoolHeader {
+    int32_t free_count;
+    uint32_t failed_count;
+    uint32_t expand_count;
+    uint32_t collapse_count;
+};
+
 void Engine::fluidsim_testing123() {
 
     Texture3D grid0(100, 100, 100, 0);
@@ -58,17 +126,8 @@ void Engine::fluidsim_testing123() {
     std::cout << "Hello from fluidsim!" << std::endl;
 }
 
-Engine::Engine(uint32_t w, uint32_t h, uint32_t d, float dx, float dy, float dz) {
-    fs_apply_world_mask_overlay = KernelProgram("src/kernels/fs_apply_world_mask_overlay.comp");
-    fs_advect_diffuse = KernelProgram("src/kernels/fs_advect_diffuse.comp");
-    fs_advect_diffuse_free = KernelProgram("src/kernels/fs_advect_diffuse_free_surface.comp");
-    fs_advect_mc = KernelProgram("src/kernels/fs_advect_maccormack.comp");
-    fs_apply_force = KernelProgram("src/kernels/fs_apply_force.comp");
-    fs_div = KernelProgram("src/kernels/fs_divergence.comp");
-    fs_jacobi_iter = KernelProgram("src/kernels/fs_jacobi_iter_pressure_obstacle.comp");
-    fs_pressure_proj = KernelProgram("src/kernels/fs_pressure_projection_obstacle.comp");
-    fs_write_to = KernelProgram("src/kernels/fs_write_to.comp");
-
+Engine::Engine(uint32_t w, uint32_t h, uint32_t d, float dx, float dy, float dz, PressureSolver solver, FieldFormats field_formats,
+               FieldStorage field_storage) {
     grid_width = w;
     grid_height = h;
     grid_depth = d;
@@ -77,31 +136,438 @@ Engine::Engine(uint32_t w, uint32_t h, uint32_t d, float dx, float dy, float dz)
     scly = dy;
     sclz = dz;
 
-    u               = Texture3D(grid_width, grid_height, grid_depth, 1, Texture3D::zero(grid_width, grid_height, grid_depth));
-    world_mask      = Texture3D(grid_width, grid_height, grid_depth, 2, Texture3D::world_mask(grid_width, grid_height, grid_depth), GL_NEAREST);
-    lin_buffer      = Texture3D(grid_width, grid_height, grid_depth, 3, Texture3D::zero(grid_width, grid_height, grid_depth));
-    nearest_buffer  = Texture3D(grid_width, grid_height, grid_depth, 4, Texture3D::zero(grid_width, grid_height, grid_depth), GL_NEAREST);
-    zero            = Texture3D(grid_width, grid_height, grid_depth, 5, Texture3D::zero(grid_width, grid_height, grid_depth));
-    q               = Texture3D(grid_width, grid_height, grid_depth, 6, Texture3D::q(grid_width, grid_height, grid_depth));
-    forces          = Texture3D(grid_width, grid_height, grid_depth, 7, Texture3D::forces(grid_width, grid_height, grid_depth));
-    temp            = Texture3D(grid_width, grid_height, grid_depth, 8, Texture3D::temperature(grid_width, grid_height, grid_depth));
-    divq            = Texture3D(grid_width, grid_height, grid_depth, 9, Texture3D::zero(grid_width, grid_height, grid_depth));
-    pres            = Texture3D(grid_width, grid_height, grid_depth, 10, Texture3D::zero(grid_width, grid_height, grid_depth));
-    lin_buffer2     = Texture3D(grid_width, grid_height, grid_depth, 11, Texture3D::zero(grid_width, grid_height, grid_depth));
-    temp_solid      = Texture3D(grid_width, grid_height, grid_depth, 12, Texture3D::temperatureSolid(grid_width, grid_height, grid_depth));
-    prescpy[0]      = Texture3D(grid_width, grid_height, grid_depth, 13, Texture3D::zero(grid_width, grid_height, grid_depth));
-    prescpy[1]      = Texture3D(grid_width, grid_height, grid_depth, 14, Texture3D::zero(grid_width, grid_height, grid_depth));
-    prescpy[2]      = Texture3D(grid_width, grid_height, grid_depth, 15, Texture3D::zero(grid_width, grid_height, grid_depth));
+    formats = field_formats;
+    storage = field_storage;
+    pressure_solver = solver;
+
+    // THE BRICKS OF THE SCHEDULER ARE ALSO THE BRICKS OF THE POOL, WHOSE ATLASES START WITH ONE TILE TEXEL PER BRICK
+    brick_count_x = (grid_width + BRICK_SIZE - 1) / BRICK_SIZE;
+    brick_count_y = (grid_height + BRICK_SIZE - 1) / BRICK_SIZE;
+    brick_count_z = (grid_depth + BRICK_SIZE - 1) / BRICK_SIZE;
+    uint32_t brick_total = brick_count_x * brick_count_y * brick_count_z;
+    uint32_t tiles_per_layer = BRICK_SIZE * brick_count_x * BRICK_SIZE * brick_count_y;
+    brick_pool_tile_layers = (brick_total + tiles_per_layer - 1) / tiles_per_layer;
+
+    // ALLOCATE STEP PARAMETER UNIFORM BUFFER, BOUND BEFORE THE KERNELS ARE TUNED SINCE THEY TAKE THE GRID SIZE FROM IT
+    step_params.scale = glm::vec3(sclx, scly, sclz);
+    step_params.dt = 0.0f;
+    step_params.velocity_air = glm::vec4(0.0f);
+    step_params.quantity_air = glm::vec4(0.0f);
+    step_params.temperature_air = glm::vec4(293.15f, 0.0f, 0.0f, 0.0f);
+    step_params.rho = 1.0f;
+    step_params.g = -9.8f;
+    step_params.buoyancy_temperature = 293.15f + 100.0f;
+    step_params.pressure_air = 0.0f;
+    step_params.brick_count = glm::uvec3(brick_count_x, brick_count_y, brick_count_z);
+    step_params.sparse_bricks = 0;
+    step_params.grid_size = glm::uvec3(grid_width, grid_height, grid_depth);
+    step_params.pool_tile_layers = brick_pool_tile_layers;
+
+    glGenBuffers(1, &step_params_ubo);
+    glBindBuffer(GL_UNIFORM_BUFFER, step_params_ubo);
+    glBufferData(GL_UNIFORM_BUFFER, sizeof(StepParameters), &step_params, GL_DYNAMIC_DRAW);
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+    glBindBufferBase(GL_UNIFORM_BUFFER, 0, step_params_ubo);
+
+    // ALLOCATE BRICK POOL, EVERY BRICK STARTS OUT ACTIVE SO EVERY BRICK STARTS OUT WITH A SLOT
+    if (storage == FIELD_STORAGE_BRICK_POOL) {
+        std::vector<uint32_t> table(brick_total);
+        for (uint32_t brick = 0; brick < brick_total; brick++) {
+            table[brick] = brick + 1;
+        }
+        glGenBuffers(1, &brick_table_ssbo);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, brick_table_ssbo);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, table.size() * sizeof(uint32_t), table.data(), GL_DYNAMIC_COPY);
+
+        std::vector<uint32_t> pool(sizeof(BrickPoolHeader) / sizeof(uint32_t) + 4 * brick_total, 0);
+        glGenBuffers(1, &brick_pool_ssbo);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, brick_pool_ssbo);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, pool.size() * sizeof(uint32_t), pool.data(), GL_DYNAMIC_COPY);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+        brick_pool_capacity = brick_total;
+        brick_pool_used = brick_total;
+        brick_pool_expanded = true;
+        brick_pool_readback = AsyncReadback(sizeof(BrickPoolHeader), 3);
+        bind_brick_pool();
+    }
+
+    load_kernels();
+
+    // THE SPARSE DISPATCH SPLITS EVERY BRICK EVENLY BETWEEN WHOLE WORKGROUPS
+    for (const KernelProgram *kernel : { &fs_advect_fused, &fs_advect_mc, &fs_advect_diffuse, &fs_apply_force, &fs_div,
+                                         &fs_jacobi_iter, &fs_jacobi_block2, &fs_jacobi_block4, &fs_force_div, &fs_pressure_proj }) {
+        uint32_t invocations = kernel->local_size.x * kernel->local_size.y * kernel->local_size.z;
+        if (BRICK_CELLS % invocations != 0 || BRICK_CELLS / invocations >= (1u << BRICK_DISPATCH_COMMANDS)) {
+            std::cout << "ERROR::FLUIDSIM::WORKGROUP SIZE " << invocations << " DOES NOT DIVIDE A BRICK, SPARSE BRICKS DISABLED" << std::endl;
+            sparse_bricks = false;
+        }
+    }
+
+    // THE BRICK POOL ONLY RUNS OVER THE BRICK LIST, SO IT GOES WITH THE SPARSE DISPATCH
+    if (!sparse_bricks && storage == FIELD_STORAGE_BRICK_POOL) {
+        std::cout << "ERROR::FLUIDSIM::BRICK POOL NEEDS SPARSE BRICKS, FIELDS ARE STORED DENSELY" << std::endl;
+        glDeleteBuffers(1, &brick_table_ssbo);
+        glDeleteBuffers(1, &brick_pool_ssbo);
+        brick_table_ssbo = brick_pool_ssbo = 0;
+        brick_pool_capacity = brick_pool_used = 0;
+        brick_pool_readback.destroy();
+        storage = FIELD_STORAGE_DENSE;
+
+        destroy_kernels();
+        load_kernels();
+    }
+
+    u               = Texture3DPair(field_texture(1, GL_LINEAR, GL_RGBA16F),
+                                    field_texture(2, GL_LINEAR, GL_RGBA16F));
+    world_mask      = Texture3DPair(field_texture(3, GL_NEAREST, formats.world_mask),
+                                    field_texture(4, GL_NEAREST, formats.world_mask));
+    zero            = Texture3D(grid_width, grid_height, grid_depth, 5);
+    q               = Texture3DPair(field_texture(6, GL_LINEAR, GL_RGBA16F),
+                                    field_texture(7, GL_LINEAR, GL_RGBA16F));
+    forces          = field_texture(8, GL_LINEAR, GL_RGBA16F);
+    temp            = Texture3DPair(field_texture(9, GL_LINEAR, formats.temperature),
+                                    field_texture(10, GL_LINEAR, formats.temperature));
+    divq            = field_texture(11, GL_LINEAR, formats.divergence);
+    pres            = Texture3DPair(field_texture(12, GL_LINEAR, formats.pressure),
+                                    field_texture(13, GL_LINEAR, formats.pressure));
+    temp_solid      = Texture3D(grid_width, grid_height, grid_depth, 14, GL_LINEAR, formats.temperature);
+    prescpy[0]      = field_texture(15, GL_LINEAR, formats.pressure);
+    prescpy[1]      = field_texture(16, GL_LINEAR, formats.pressure);
+    prescpy[2]      = field_texture(17, GL_LINEAR, formats.pressure);
+
+    // CONSTANT FIELDS ARE CLEARED, THE PATTERNED ONES ARE WRITTEN BY ONE KERNEL
+    u.front.clear(0.0f);
+    zero.clear(0.0f);
+    divq.clear(0.0f);
+    temp_solid.clear(400.0f, 0.0f, 0.0f, 1.0f);
+    for (Texture3D &history : prescpy) {
+        history.clear(0.0f);
+    }
+
+    q.front.use(6, 0);
+    world_mask.front.use(3, 1);
+    forces.use(8, 2);
+    temp.front.use(9, 3);
+    fs_initialize_fields.use();
+    fs_initialize_fields.dispatch(grid_width, grid_height, grid_depth);
+    glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT | GL_TEXTURE_FETCH_BARRIER_BIT | GL_TEXTURE_UPDATE_BARRIER_BIT);
+
+    // ALLOCATE BRICK SCHEDULER BUFFERS, EVERY BRICK STARTS OUT ACTIVE
+    glGenBuffers(1, &brick_state_ssbo);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, brick_state_ssbo);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, brick_total * sizeof(uint32_t), NULL, GL_DYNAMIC_COPY);
+    reset_brick_state();
+
+    std::vector<uint32_t> empty_list(1 + brick_total, 0);
+    glGenBuffers(1, &brick_list_ssbo);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, brick_list_ssbo);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, empty_list.size() * sizeof(uint32_t), empty_list.data(), GL_DYNAMIC_COPY);
+
+    glGenBuffers(1, &brick_dispatch_buffer);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, brick_dispatch_buffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, BRICK_POOL_COMMANDS_END * 3 * sizeof(uint32_t), NULL, GL_DYNAMIC_COPY);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+    // ALLOCATE RESIDUAL REDUCTION BUFFERS, ONE PARTIAL PER WORKGROUP OF A DENSE OR A SPARSE DISPATCH
+    glm::uvec3 residual_local = fs_residual_norm.local_size;
+    residual_partial_count = ((grid_width + residual_local.x - 1) / residual_local.x)
+                             * ((grid_height + residual_local.y - 1) / residual_local.y)
+                             * ((grid_depth + residual_local.z - 1) / residual_local.z);
+    uint32_t residual_brick_groups = BRICK_CELLS / (residual_local.x * residual_local.y * residual_local.z);
+
+    glGenBuffers(1, &residual_partials_ssbo);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, residual_partials_ssbo);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, std::max(residual_partial_count, brick_total * residual_brick_groups) * 4 * sizeof(float),
+                 NULL, GL_DYNAMIC_COPY);
+
+    glGenBuffers(1, &residual_result_ssbo);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, residual_result_ssbo);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, 4 * sizeof(float), NULL, GL_DYNAMIC_COPY);
+
+    // A CHECK IS READ WHILE THE NEXT ONE IS IN FLIGHT, THE THIRD SLOT KEEPS A STALE ONE FROM BLOCKING
+    residual_readback = AsyncReadback(4 * sizeof(float), 3);
+
+    // ALLOCATE MAX VELOCITY RESULT, EVERY MEASUREMENT IS COPIED OUT OF IT INTO THE READBACK RING
+    glGenBuffers(1, &velocity_result_ssbo);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, velocity_result_ssbo);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, 4 * sizeof(float), NULL, GL_DYNAMIC_COPY);
+
+    velocity_readback = AsyncReadback(4 * sizeof(float), VELOCITY_READBACK_SLOTS);
+
+    // ALLOCATE SURFACE FORCE BUFFERS, THE RESULTS ARE READ BACK THROUGH A RING OF THEIR OWN
+    glGenBuffers(1, &surface_bodies_ssbo);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, surface_bodies_ssbo);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, MAX_SURFACE_BODIES * sizeof(SurfaceBody), NULL, GL_DYNAMIC_DRAW);
+
+    glGenBuffers(1, &surface_forces_ssbo);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, surface_forces_ssbo);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, MAX_SURFACE_BODIES * sizeof(SurfaceForce), NULL, GL_DYNAMIC_COPY);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+    surface_force_readback = AsyncReadback(MAX_SURFACE_BODIES * sizeof(SurfaceForce), 3);
+
+    // BUILD MULTIGRID HIERARCHY, COARSENING UNTIL THE SMALLEST SIDE REACHES 4 CELLS
+    if (pressure_solver != PRESSURE_SOLVER_JACOBI) {
+        MultigridLevel finest;
+        finest.width = grid_width;
+        finest.height = grid_height;
+        finest.depth = grid_depth;
+        finest.residual = field_texture(0, GL_NEAREST, formats.divergence);
+        mg_levels.push_back(finest);
+
+        while (true) {
+            const MultigridLevel &fine = mg_levels.back();
+            if (std::min(fine.width, std::min(fine.height, fine.depth)) <= 4) break;
+
+            MultigridLevel coarse;
+            coarse.width = (fine.width + 1) / 2;
+            coarse.height = (fine.height + 1) / 2;
+            coarse.depth = (fine.depth + 1) / 2;
+            coarse.pressure      = Texture3D(coarse.width, coarse.height, coarse.depth, 0, GL_NEAREST, formats.pressure);
+            coarse.pressure_next = Texture3D(coarse.width, coarse.height, coarse.depth, 0, GL_NEAREST, formats.pressure);
+            coarse.rhs           = Texture3D(coarse.width, coarse.height, coarse.depth, 0, GL_NEAREST, formats.divergence);
+            coarse.residual      = Texture3D(coarse.width, coarse.height, coarse.depth, 0, GL_NEAREST, formats.divergence);
+            coarse.world_mask    = Texture3D(coarse.width, coarse.height, coarse.depth, 0, GL_NEAREST, formats.world_mask);
+            mg_levels.push_back(coarse);
+        }
+    }
+}
+
+Engine::~Engine() {
+    destroy_kernels();
+
+    // MULTIGRID LEVEL 0 SHARES THE ENGINE'S TEXTURES, ITS RESIDUAL IS LISTED WITH THE POOLED ONES
+    for (PooledQuantity &quantity : pooled_quantities()) {
+        for (Texture3D *texture : quantity.textures) {
+            texture->destroy();
+        }
+    }
+    for (size_t level = 1; level < mg_levels.size(); level++) {
+        MultigridLevel &l = mg_levels[level];
+        for (Texture3D *texture : { &l.pressure, &l.pressure_next, &l.rhs, &l.residual, &l.world_mask }) {
+            texture->destroy();
+        }
+    }
+    for (auto &view : dense_views) {
+        view.second.destroy();
+    }
+    zero.destroy();
+    temp_solid.destroy();
+
+    for (uint32_t *buffer : { &step_params_ubo, &residual_partials_ssbo, &residual_result_ssbo, &brick_state_ssbo, &brick_list_ssbo,
+                              &brick_dispatch_buffer, &brick_table_ssbo, &brick_pool_ssbo, &velocity_result_ssbo,
+                              &surface_bodies_ssbo, &surface_forces_ssbo }) {
+        glDeleteBuffers(1, buffer);
+        *buffer = 0;
+    }
+
+    residual_readback.destroy();
+    brick_pool_readback.destroy();
+    velocity_readback.destroy();
+    surface_force_readback.destroy();
+    for (AsyncReadback &readback : region_readbacks) {
+        readback.destroy();
+    }
+}
+
+//
+// Compiles every kernel for the current formats and field storage. Per-cell
+// kernels get the fastest workgroup size for this grid and GPU, the blocked
+// Jacobi, reduction and brick kernels have fixed shapes
+//
+void Engine::load_kernels() {
+    uint32_t w = grid_width, h = grid_height, d = grid_depth;
+    KernelTuner tuner("kernel_tuning.cache");
+    tuner.uniform_blocks[0] = step_params_ubo;
+
+    // EVERY KERNEL DECLARES ITS IMAGES WITH THE FORMATS OF THE FIELDS THEY ARE BOUND TO,
+    // AND GETS THE STEP PARAMETER BLOCK AND THE POOL ADDRESSING FROM THE SAME PREFIX
+    const std::string defines = format_defines();
+
+    fs_apply_world_mask_overlay = tuner.load("src/kernels/fs_apply_world_mask_overlay.comp", w, h, d, defines);
+    fs_advect_diffuse = tuner.load("src/kernels/fs_advect_diffuse.comp", w, h, d, defines + "#define QUANTITY_FORMAT " + image_format_qualifier(formats.temperature) + "\n");
+    fs_advect_diffuse_free = KernelProgram("src/kernels/fs_advect_diffuse_free_surface.comp");
+    fs_advect_mc = tuner.load("src/kernels/fs_advect_maccormack.comp", w, h, d, defines);
+    fs_advect_fused = tuner.load("src/kernels/fs_advect_fused.comp", w, h, d, defines + "#define NUM_SCALAR_FIELDS " + std::to_string(scalars.size()) + "\n");
+    fs_apply_force = tuner.load("src/kernels/fs_apply_force.comp", w, h, d, defines);
+    fs_div = tuner.load("src/kernels/fs_divergence.comp", w, h, d, defines);
+    fs_jacobi_iter = tuner.load("src/kernels/fs_jacobi_iter_pressure_obstacle.comp", w, h, d, defines);
+    fs_jacobi_block2 = KernelProgram("src/kernels/fs_jacobi_blocked_pressure_obstacle.comp", defines + "#define SWEEPS 2\n");
+    fs_jacobi_block4 = KernelProgram("src/kernels/fs_jacobi_blocked_pressure_obstacle.comp", defines + "#define SWEEPS 4\n");
+    fs_force_div = KernelProgram("src/kernels/fs_force_divergence.comp", defines);
+    fs_pressure_proj = tuner.load("src/kernels/fs_pressure_projection_obstacle.comp", w, h, d, defines);
+    fs_initialize_fields = KernelProgram("src/kernels/fs_initialize_fields.comp", defines);
+    fs_residual_norm = KernelProgram("src/kernels/fs_residual_norm.comp", defines);
+    fs_reduce_norm = KernelProgram("src/kernels/fs_reduce_norm.comp");
+    fs_brick_activity = KernelProgram("src/kernels/fs_brick_activity.comp", defines);
+    fs_brick_compact = KernelProgram("src/kernels/fs_brick_compact.comp", defines);
+    fs_brick_dispatch_args = KernelProgram("src/kernels/fs_brick_dispatch_args.comp", defines);
+    fs_max_velocity = KernelProgram("src/kernels/fs_max_velocity.comp", defines);
+    fs_surface_force = KernelProgram("src/kernels/fs_surface_force.comp", defines);
+
+    if (pressure_solver != PRESSURE_SOLVER_JACOBI) {
+        fs_mg_smooth = tuner.load("src/kernels/fs_mg_smooth.comp", w, h, d, defines);
+        fs_mg_residual = tuner.load("src/kernels/fs_mg_residual.comp", w, h, d, defines);
+        fs_mg_restrict = tuner.load("src/kernels/fs_mg_restrict.comp", w / 2, h / 2, d / 2, defines);
+        fs_mg_prolong = tuner.load("src/kernels/fs_mg_prolong.comp", w, h, d, defines);
+    }
+
+    // ONE BRICK FIELD KERNEL PER FORMAT OF THE POOLED FIELDS
+    if (storage == FIELD_STORAGE_BRICK_POOL) {
+        fs_brick_slots = KernelProgram("src/kernels/fs_brick_slots.comp", defines);
+        for (GLenum format : { (GLenum) GL_RGBA16F, formats.temperature, formats.pressure, formats.divergence, formats.world_mask }) {
+            if (fs_brick_field.count(format) == 0) {
+                fs_brick_field[format] = KernelProgram("src/kernels/fs_brick_field.comp",
+                                                       defines + "#define FIELD_FORMAT " + image_format_qualifier(format) + "\n");
+            }
+        }
+    }
+
+    tuner.save();
+}
+
+void Engine::destroy_kernels() {
+    for (KernelProgram *kernel : { &fs_apply_world_mask_overlay, &fs_advect_diffuse, &fs_advect_diffuse_free, &fs_advect_mc, &fs_advect_fused,
+                                   &fs_apply_force, &fs_div, &fs_jacobi_iter, &fs_jacobi_block2, &fs_jacobi_block4, &fs_force_div,
+                                   &fs_pressure_proj, &fs_initialize_fields, &fs_residual_norm, &fs_reduce_norm, &fs_brick_activity,
+                                   &fs_brick_compact, &fs_brick_dispatch_args, &fs_max_velocity, &fs_surface_force, &fs_mg_smooth,
+                                   &fs_mg_residual, &fs_mg_restrict, &fs_mg_prolong, &fs_brick_slots }) {
+        kernel->destroy();
+    }
+    for (auto &kernel : fs_brick_field) {
+        kernel.second.destroy();
+    }
+    fs_brick_field.clear();
 }
 
 void Engine::step(float dt, Texture3D *solid_mask, Texture3D *velocity_mask, Texture3D *temperature_mask, int max_steps) {
 
-    const float timestep = 1.0 / 60.0;
-    while (dt >= timestep && max_steps > 0) {
-        step(timestep, solid_mask, velocity_mask, temperature_mask);
-        dt -= timestep;
-        max_steps--;
+    if (!adaptive_timestep) {
+        const float timestep = 1.0 / 60.0;
+        substeps = 0;
+        while (dt >= timestep && max_steps > 0) {
+            step(timestep, solid_mask, velocity_mask, temperature_mask);
+            dt -= timestep;
+            max_steps--;
+            substeps++;
+        }
+        return;
+    }
+
+    // PICK UP WHATEVER MAX VELOCITY READBACKS HAVE LANDED SINCE THE LAST FRAME
+    poll_max_velocity();
+
+    // SPLIT DT EVENLY INTO STABLE SUBSTEPS, DROPPING THE TIME THAT DOES NOT FIT IN MAX_STEPS
+    float stable_dt = cfl_timestep();
+    substeps = std::min((int) std::ceil(dt / stable_dt), max_steps);
+    if (dt <= 0.0f || substeps <= 0) {
+        substeps = 0;
+        return;
+    }
+
+    float substep_dt = std::min(dt / substeps, stable_dt);
+    for (int i = 0; i < substeps; i++) {
+        step(substep_dt, solid_mask, velocity_mask, temperature_mask);
+    }
+}
+
+float Engine::cfl_timestep() const {
+    float speed = max_velocity * max_velocity_margin;
+    if (speed <= 0.0f) {
+        return max_timestep;
+    }
+
+    float cell = std::min(sclx, std::min(scly, sclz));
+    return std::min(max_timestep, cfl_number * cell / speed);
+}
+
+void Engine::integrate_surface_forces(std::vector<SurfaceBody> bodies, glm::vec3 grid_offset) {
+    GpuZone zone("surface_forces");
+    if (bodies.size() > (size_t) MAX_SURFACE_BODIES) {
+        std::cout << "ERROR::FLUIDSIM::ONLY THE FIRST " << MAX_SURFACE_BODIES << " OF " << bodies.size() << " SURFACE BODIES ARE INTEGRATED" << std::endl;
+        bodies.resize(MAX_SURFACE_BODIES);
+    }
+    if (bodies.empty()) {
+        return;
+    }
+
+    // SAMPLE EVERY SIDE ALONG ITS WORLD SPACE LENGTH, SO THE COST SCALES WITH THE SURFACE AREA
+    float cell = std::min(sclx, std::min(scly, sclz));
+    for (SurfaceBody &body : bodies) {
+        for (int axis = 0; axis < 3; axis++) {
+            float length = glm::length(glm::vec3(body.object_m[axis])) * body.extent[axis];
+            float samples = std::ceil(length / cell * surface_samples_per_cell);
+            body.samples[axis] = (uint32_t) std::max(1.0f, std::min(samples, 256.0f));
+        }
+    }
+
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, surface_bodies_ssbo);
+    glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, bodies.size() * sizeof(SurfaceBody), bodies.data());
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+    sync_cpu_state(1u << CPU_PRESSURE);
+    bind_brick_pool();
+    barriers.begin_pass({ ComputeResource::texture(pressure()) }, { ComputeResource::storage(surface_forces_ssbo) });
+    pressure().use(0, 0);
+    fs_surface_force.use();
+    fs_surface_force.setVec3("grid_offset", grid_offset);
+    fs_surface_force.setVec3("grid_extent", glm::vec3(grid_width * sclx, grid_height * scly, grid_depth * sclz));
+    fs_surface_force.setInt("body_count", bodies.size());
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, surface_bodies_ssbo);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, surface_forces_ssbo);
+
+    glDispatchCompute(bodies.size(), 1, 1);
+    barriers.end_pass();
+
+    // ONLY A FORCE AND A TORQUE PER BODY COME BACK TO THE CPU
+    barriers.begin_pass({ ComputeResource::buffer_update(surface_forces_ssbo) }, {});
+    surface_force_readback.read_buffer(surface_forces_ssbo, bodies.size() * sizeof(SurfaceForce));
+    barriers.end_pass();
+}
+
+const SurfaceForce *Engine::latest_surface_forces() {
+    return (const SurfaceForce *) surface_force_readback.latest();
+}
+
+bool Engine::read_regions(ReadbackField field, const std::vector<ReadbackRegion> &regions) {
+    Texture3D &texture = dense_view(field == READBACK_VELOCITY ? u.front : (field == READBACK_TEMPERATURE ? temp.front : pressure()));
+    GLenum format = field == READBACK_VELOCITY ? GL_RGB : GL_RED;
+    size_t channels = field == READBACK_VELOCITY ? 3 : 1;
+
+    // THE SLOTS FIT THE WHOLE FIELD, ONLY THE REQUESTED CELLS ARE EVER COPIED INTO THEM
+    if (!region_readbacks[field].allocated()) {
+        region_readbacks[field] = AsyncReadback((size_t) grid_width * grid_height * grid_depth * channels * sizeof(float), 3);
     }
+
+    barriers.begin_pass({ ComputeResource::texture_update(texture) }, {});
+    bool queued = region_readbacks[field].read_regions(texture, regions, format, GL_FLOAT);
+    barriers.end_pass();
+    return queued;
+}
+
+const float *Engine::latest_regions(ReadbackField field, const std::vector<ReadbackRegion> **regions) {
+    const float *data = (const float *) region_readbacks[field].latest();
+    *regions = &region_readbacks[field].latest_regions();
+    return data;
+}
+
+ReadbackRegion Engine::region_around(glm::vec3 world_min, glm::vec3 world_max, glm::vec3 grid_offset, uint32_t margin) const {
+    glm::vec3 cell(sclx, scly, sclz);
+    glm::vec3 grid(grid_width, grid_height, grid_depth);
+
+    // SAME WORLD TO CELL MAPPING AS THE COUPLING, THE GRID IS CENTERED ON GRID_OFFSET AND STORED Y/Z SWAPPED
+    glm::vec3 grid_min(world_min.x - grid_offset.x, world_min.z - grid_offset.z, world_min.y - grid_offset.y);
+    glm::vec3 grid_max(world_max.x - grid_offset.x, world_max.z - grid_offset.z, world_max.y - grid_offset.y);
+    glm::vec3 least = glm::floor(grid_min / cell + grid * 0.5f) - glm::vec3((float) margin);
+    glm::vec3 most = glm::floor(grid_max / cell + grid * 0.5f) + glm::vec3((float) margin + 1.0f);
+    least = glm::clamp(least, glm::vec3(0.0f), grid);
+    most = glm::clamp(most, least, grid);
+
+    ReadbackRegion region;
+    region.origin = glm::uvec3(least);
+    region.size = glm::uvec3(most) - region.origin;
+    return region;
 }
 
 void Engine::step(float dt, Texture3D *solid_mask, Texture3D *velocity_mask, Texture3D *temperature_mask) {
@@ -120,47 +586,273 @@ void Engine::step(float dt, Texture3D *solid_mask, Texture3D *velocity_mask, Tex
      * 
      * (4) PRESSURE PROJECTION
      *      (a) DIVERGENCE OF  UNPROJECTED VELOCITY
-     *      (b) JACOBI ITERATIONS FOR PRESSURE
+     *      (b) JACOBI OR MULTIGRID SOLVE FOR PRESSURE
      *      (c) PROJECTION STEP FOR PRESSURE
+     *
+     * Every pass reads the front texture of a field and writes the back
+     * texture, then the pair is swapped, so no pass exists just to copy.
+     * The passes around the pressure solve are recorded once into compute
+     * graphs that declare what each pass reads and writes, so barriers are
+     * only issued between passes that depend on each other.
     */
-    glMemoryBarrier(GL_ALL_BARRIER_BITS);
+    GpuZone step_zone(backend == BACKEND_CPU ? "fluid_step_cpu" : "fluid_step");
+
+    step_params.dt = dt;
+    step_params.sparse_bricks = brick_list() ? 1 : 0;
+    step_solid_mask = *solid_mask;
+    step_velocity_mask = *velocity_mask;
+    step_temperature_mask = *temperature_mask;
 
-    // ADVANCE ITERATION
-    iter += 1;
-    if (iter % 3 == 0) iter = 0;
+    if (backend == BACKEND_CPU) {
+        step_cpu();
+        return;
+    }
 
-    // WRITE TO CURRENT SOLID MASK
-    solid_mask->use(1, 1);
-    world_mask.use(2, 2);
-    nearest_buffer.use(3, 3);
+    // PICK UP THE CPU'S STATE, WHICH MAY HAVE MOVED FLUID IN BRICKS THE SCHEDULER THINKS ARE AT REST
+    if (cpu_state_current) {
+        sync_cpu_state(CPU_STATE_FIELDS);
+        reset_brick_state();
+        cpu_state_current = false;
+    }
 
-    fs_apply_world_mask_overlay.use();
-    fs_apply_world_mask_overlay.setInt("world_overlay", 1);
-    fs_apply_world_mask_overlay.setInt("world_mask", 2);
-    fs_apply_world_mask_overlay.setInt("world_mask_next", 3);
+    // WITHOUT SPARSE BRICKS THE POOL STILL RUNS OVER THE BRICK LIST, WITH EVERY BRICK KEPT AWAKE.
+    // THE POOL IS RESIZED BEFORE THE STEP, FROM THE LATEST COUNTS THAT CAME BACK
+    if (storage == FIELD_STORAGE_BRICK_POOL) {
+        if (!sparse_bricks) {
+            reset_brick_state();
+        }
+        update_brick_pool();
+        brick_pool_expanded = false;
+    }
 
-    glDispatchCompute((GLuint) grid_width, (GLuint) grid_depth, (GLuint) grid_height);
-    glMemoryBarrier(GL_ALL_BARRIER_BITS);
+    // RECORD THE GRAPHS ON THE FIRST STEP, AND AGAIN WHENEVER THE PATH SETTINGS CHANGE
+    if (advance_graph.empty()
+        || recorded_fused_advection != fused_advection
+        || recorded_fused_projection != fused_projection
+        || recorded_sparse_bricks != sparse_bricks
+        || recorded_scalar_count != scalars.size()) {
+        record_step_graphs();
+    }
 
-    // WRITE WORLD_MASK_NEXT TO WORLD_MASK    
-    fs_write_to.use();
-    fs_write_to.setInt("q_in", 3);
-    fs_write_to.setInt("q_out", 2);
+    // UPLOAD THE STEP PARAMETERS, EVERY KERNEL OF THE STEP READS THEM FROM BINDING 0
+    glBindBuffer(GL_UNIFORM_BUFFER, step_params_ubo);
+    glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(StepParameters), &step_params);
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+    bind_brick_pool();
+
+    // BRICK SCHEDULING AND POOL, MASK OVERLAY, ADVECTION, EXTERNAL FORCES AND DIVERGENCE
+    advance_graph.replay();
+
+    // SOLVE FOR PRESSURE, WARM STARTING FROM THE LATEST RING SLOT
+    {
+        GpuZone zone("pressure_solve");
+        if (pressure_solver == PRESSURE_SOLVER_JACOBI) {
+            solve_pressure_jacobi();
+        } else {
+            solve_pressure_multigrid();
+        }
+    }
 
-    glDispatchCompute((GLuint) grid_width, (GLuint) grid_height, (GLuint) grid_depth);
-    glMemoryBarrier(GL_ALL_BARRIER_BITS);
+    // ROTATE THE RESULT INTO THE PRESSURE RING, THE SLOT'S OLD TEXTURE BECOMES SCRATCH
+    iter = (iter + 1) % 3;
+    std::swap(pres.front, prescpy[iter]);
 
-    // ADVECTION
-    u.use(1, 1);
-    world_mask.use(2, 2);
-    lin_buffer.use(3, 3);
-    nearest_buffer.use(4, 4);
-    velocity_mask->use(5, 5);
-    q.use(6, 6);
-    lin_buffer2.use(7, 7);
+    // Presure Projection Time!!!!
+    projection_graph.replay();
 
+    // REDUCE MAX |U| OF THE NEW VELOCITY FOR THE CFL TIMESTEP, READ BACK BY A LATER STEP
+    if (adaptive_timestep) {
+        measure_max_velocity();
+    }
+
+    // THE RESULTS ARE SAMPLED AND READ BACK BY CODE OUTSIDE THE GRAPHS
+    barriers.flush(GL_TEXTURE_FETCH_BARRIER_BIT | GL_TEXTURE_UPDATE_BARRIER_BIT);
+}
+
+//
+// One step on the CpuSolver. The inputs are downloaded every step, the state
+// only when the previous step ran on the GPU. The results stay on the CPU
+// and only mark their textures stale, see sync_cpu_state
+//
+void Engine::step_cpu() {
+    if (!cpu_solver) {
+        cpu_solver = std::make_unique<CpuSolver>(grid_width, grid_height, grid_depth);
+    }
+
+    std::vector<float> rgba((size_t) grid_width * grid_height * grid_depth * 4);
+    const GLsizei bytes = rgba.size() * sizeof(float);
+
+    auto download = [&](Texture3D &texture, CpuField field) {
+        barriers.begin_pass({ ComputeResource::texture_update(texture) }, {});
+        glGetTextureImage(texture.id, 0, GL_RGBA, GL_FLOAT, bytes, rgba.data());
+        barriers.end_pass();
+        cpu_solver->write(field, rgba.data());
+    };
+
+    if (!cpu_state_current) {
+        download(dense_view(u.front), CPU_VELOCITY);
+        download(dense_view(q.front), CPU_QUANTITY);
+        download(dense_view(temp.front), CPU_TEMPERATURE);
+        download(dense_view(pressure()), CPU_PRESSURE);
+        download(dense_view(world_mask.front), CPU_WORLD_MASK);
+    }
+
+    download(step_solid_mask, CPU_SOLID_OVERLAY);
+    download(step_velocity_mask, CPU_SOLID_VELOCITY);
+    download(step_temperature_mask, CPU_SOLID_TEMPERATURE);
+    download(dense_view(forces), CPU_FORCES);
+
+    cpu_solver->step(step_params, max_iterations, pressure_tolerance, residual_check_interval);
+    cpu_state_current = true;
+    stale_fields = CPU_STATE_FIELDS;
+
+    const CpuSolveStats &stats = cpu_solver->stats();
+    pressure_stats = { stats.iterations, stats.residual_l2, stats.residual_linf };
+
+    // THE MEASUREMENT IS ALREADY ON THE CPU, NO READBACK RING NEEDED
+    if (adaptive_timestep) {
+        max_velocity = cpu_solver->max_velocity();
+    }
+
+}
+
+//
+// The texture the GPU path keeps a field of the CPU's state in, or nullptr
+// for the inputs of a step
+//
+Texture3D *Engine::cpu_field_texture(CpuField field) {
+    switch (field) {
+    case CPU_VELOCITY: return &u.front;
+    case CPU_QUANTITY: return &q.front;
+    case CPU_TEMPERATURE: return &temp.front;
+    case CPU_PRESSURE: return &pressure();
+    case CPU_WORLD_MASK: return &world_mask.front;
+    case CPU_DIVERGENCE: return &divq;
+    default: return nullptr;
+    }
+}
+
+//
+// Uploads those of fields (bits 1 << CpuField) that are stale to their
+// textures. Pooled fields go through their dense scratch textures, and
+// every brick gets a slot before the first upload
+//
+void Engine::sync_cpu_state(uint32_t fields) {
+    fields &= stale_fields;
+    if (fields == 0) {
+        return;
+    }
+
+    if (storage == FIELD_STORAGE_BRICK_POOL && !brick_pool_expanded) {
+        expand_brick_pool();
+    }
+
+    std::vector<float> rgba((size_t) grid_width * grid_height * grid_depth * 4);
+    for (int field = 0; field < CPU_FIELD_COUNT; field++) {
+        if (fields & (1u << field)) {
+            cpu_solver->read((CpuField) field, rgba.data());
+            upload_field(*cpu_field_texture((CpuField) field), rgba.data());
+        }
+    }
+    stale_fields &= ~fields;
+}
+
+void Engine::record_step_graphs() {
+    advance_graph = ComputeGraph(&barriers);
+    projection_graph = ComputeGraph(&barriers);
+
+    ComputeResource latest_pressure = { [this]() { return pressure().id; }, false, COMPUTE_ACCESS_IMAGE };
+
+    // PASSES DISPATCHED OVER THE ACTIVE BRICKS ALSO READ THE LIST AND ITS COMMANDS, AND POOLED FIELDS THE TABLE
+    auto pooled = [this](std::vector<ComputeResource> reads) {
+        if (storage == FIELD_STORAGE_BRICK_POOL) {
+            reads.push_back(ComputeResource::storage(brick_table_ssbo));
+        }
+        return reads;
+    };
+    auto scheduled = [this, pooled](std::vector<ComputeResource> reads) {
+        if (brick_list()) {
+            reads.push_back(ComputeResource::storage(brick_list_ssbo));
+            reads.push_back(ComputeResource::indirect(brick_dispatch_buffer));
+        }
+        return pooled(reads);
+    };
+
+    // SCHEDULE THE BRICKS THAT MOVED, ARE FORCED, HEATED OR CHANGE MASK WITH THIS STEP'S OVERLAY. THE
+    // TEMPERATURE OF THE LAST STEP IS IN FRONT AND THE ONE BEFORE IT IN BACK. THE POOL NEVER STARTS
+    // OVER WITH EVERY BRICK AWAKE, THAT WOULD EXPAND EVERY BRICK
+    if (brick_list()) {
+        if (storage != FIELD_STORAGE_BRICK_POOL) {
+            reset_brick_state();
+        }
+
+        advance_graph.add("brick_activity",
+            pooled({ ComputeResource::image(u.front), ComputeResource::image(world_mask.front), ComputeResource::image(step_solid_mask),
+                     ComputeResource::image(step_velocity_mask), ComputeResource::image(forces), ComputeResource::image(temp.front),
+                     ComputeResource::image(temp.back), ComputeResource::image(divq), ComputeResource::storage(brick_state_ssbo) }),
+            { ComputeResource::storage(brick_state_ssbo) },
+            [this]() {
+                u.front.use(1, 1);
+                world_mask.front.use(2, 2);
+                step_solid_mask.use(3, 3);
+                step_velocity_mask.use(4, 4);
+                forces.use(5, 5);
+                temp.front.use(6, 6);
+                temp.back.use(7, 7);
+                divq.use(8, 8);
+                glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, brick_state_ssbo);
+
+                fs_brick_activity.use();
+                fs_brick_activity.setFloat("velocity_threshold", brick_velocity_threshold);
+                fs_brick_activity.setFloat("temperature_threshold", brick_temperature_threshold);
+                fs_brick_activity.setInt("hysteresis", brick_hysteresis);
+                fs_brick_activity.dispatch(grid_width, grid_height, grid_depth);
+            });
+
+        std::vector<ComputeResource> lists = { ComputeResource::storage(brick_list_ssbo) };
+        if (storage == FIELD_STORAGE_BRICK_POOL) {
+            lists.push_back(ComputeResource::storage(brick_table_ssbo));
+            lists.push_back(ComputeResource::storage(brick_pool_ssbo));
+        }
+
+        std::vector<ComputeResource> compact_reads = lists;
+        compact_reads.push_back(ComputeResource::storage(brick_state_ssbo));
+        advance_graph.add("brick_compact", compact_reads, lists,
+            [this]() {
+                glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, brick_list_ssbo);
+                glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, brick_state_ssbo);
+
+                fs_brick_compact.use();
+                fs_brick_compact.dispatch(brick_count_x * brick_count_y * brick_count_z, 1, 1);
+            });
+
+        std::vector<ComputeResource> args_writes = lists;
+        args_writes.push_back(ComputeResource::storage(brick_dispatch_buffer));
+        advance_graph.add("brick_dispatch_args", lists, args_writes,
+            [this]() {
+                glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, brick_list_ssbo);
+                glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, brick_dispatch_buffer);
+
+                fs_brick_dispatch_args.use();
+                glDispatchCompute(1, 1, 1);
+            });
+
+        // COLLAPSE THE BRICKS THAT LEFT THE SCHEDULE AND EXPAND THE ONES THAT JOINED IT
+        if (storage == FIELD_STORAGE_BRICK_POOL) {
+            record_brick_pool();
+        }
+    }
+
+    // WRITE TO CURRENT SOLID MASK, ONLY IN SCHEDULED BRICKS WHEN THE FIELDS ARE POOLED
+    advance_graph.add("apply_world_mask_overlay",
+        pooled({ ComputeResource::image(step_solid_mask), ComputeResource::image(world_mask.front) }),
+        { ComputeResource::image(world_mask.back) },
+        [this]() { apply_world_mask_overlay(); });
+
+    // ADVECTION
     // // TODO: PROPER FREE SURFACE ADVECTION
     // // ADVECT THE WORLD_MASK FIELD
+    // world_mask.back.use(4, 4);
     // fs_advect_diffuse_free.use();
     // fs_advect_diffuse_free.setInt("u", 1);
     // fs_advect_diffuse_free.setInt("world_mask", 2);
@@ -168,207 +860,1059 @@ void Engine::step(float dt, Texture3D *solid_mask, Texture3D *velocity_mask, Tex
     // fs_advect_diffuse_free.setFloat("dt", dt);
     // fs_advect_diffuse_free.setVec3("scale", sclx, scly, sclz);
 
-    // glDispatchCompute((GLuint) grid_width, (GLuint) grid_depth, (GLuint) grid_height);
+    // fs_advect_diffuse_free.dispatch(grid_width, grid_height, grid_depth);
     // glMemoryBarrier(GL_ALL_BARRIER_BITS);
+    // world_mask.swap();
+
+    if (fused_advection) {
+        std::vector<ComputeResource> reads = {
+            ComputeResource::texture(u.front), ComputeResource::texture(world_mask.front),
+            ComputeResource::texture(step_velocity_mask), ComputeResource::texture(step_temperature_mask),
+            ComputeResource::texture(q.front), ComputeResource::texture(temp.front),
+        };
+        std::vector<ComputeResource> writes = {
+            ComputeResource::image(u.back), ComputeResource::image(q.back), ComputeResource::image(temp.back),
+        };
+        for (Texture3DPair &scalar : scalars) {
+            reads.push_back(ComputeResource::texture(scalar.front));
+            writes.push_back(ComputeResource::image(scalar.back));
+        }
+
+        advance_graph.add("advect_fused", scheduled(reads), writes, [this]() { advect_fused(); });
+    } else {
+        // THE THREE FIELDS ONLY SHARE INPUTS, SO THESE PASSES MAY OVERLAP
+        advance_graph.add("advect_velocity",
+            scheduled({ ComputeResource::texture(u.front), ComputeResource::image(step_velocity_mask), ComputeResource::image(world_mask.front) }),
+            { ComputeResource::image(u.back) },
+            [this]() { advect_velocity(); });
+
+        advance_graph.add("advect_q",
+            scheduled({ ComputeResource::texture(u.front), ComputeResource::texture(q.front), ComputeResource::image(zero), ComputeResource::image(world_mask.front) }),
+            { ComputeResource::image(q.back) },
+            [this]() { advect_q(); });
+
+        advance_graph.add("advect_temperature",
+            scheduled({ ComputeResource::texture(u.front), ComputeResource::texture(temp.front), ComputeResource::image(step_temperature_mask), ComputeResource::image(world_mask.front) }),
+            { ComputeResource::image(temp.back) },
+            [this]() { advect_temperature(); });
+    }
+
+    // ADVECTED VELOCITY BECOMES CURRENT ONCE EVERYTHING ELSE WAS ADVECTED BY THE OLD ONE
+    advance_graph.add("swap_velocity", {}, {}, [this]() { u.swap(); });
+
+    if (fused_projection) {
+        // EXTERNAL FORCES AND THEIR DIVERGENCE IN ONE PASS
+        advance_graph.add("force_divergence",
+            scheduled({ ComputeResource::image(u.front), ComputeResource::image(world_mask.front), ComputeResource::image(step_velocity_mask),
+                        ComputeResource::image(forces), ComputeResource::image(temp.front), latest_pressure }),
+            { ComputeResource::image(u.back), ComputeResource::image(divq) },
+            [this]() { force_divergence(); });
+    } else {
+        // EXTERNAL FORCES
+        advance_graph.add("apply_force",
+            scheduled({ ComputeResource::image(u.front), ComputeResource::image(world_mask.front),
+                        ComputeResource::image(forces), ComputeResource::image(temp.front), latest_pressure }),
+            { ComputeResource::image(u.back) },
+            [this]() { apply_force(); });
+
+        // APPLY DIVERGENCE TO W the JACOBBIIIBIBIBIBIBBIBBIBIBIBIBI
+        advance_graph.add("divergence",
+            scheduled({ ComputeResource::image(u.front), ComputeResource::image(world_mask.front), ComputeResource::image(step_velocity_mask) }),
+            { ComputeResource::image(divq) },
+            [this]() { divergence(); });
+    }
+
+    // THE FUSED PATH PROJECTS IN PLACE, EACH CELL ONLY READS ITS OWN VELOCITY
+    projection_graph.add("pressure_projection",
+        scheduled({ ComputeResource::image(u.front), ComputeResource::image(world_mask.front), ComputeResource::image(step_velocity_mask), latest_pressure }),
+        { ComputeResource::image(fused_projection ? u.front : u.back) },
+        [this]() { project(); });
+
+    recorded_fused_advection = fused_advection;
+    recorded_fused_projection = fused_projection;
+    recorded_sparse_bricks = sparse_bricks;
+    recorded_scalar_count = scalars.size();
+}
 
-    // ADVECT SOME VELOCITY FIELD
-    velocity_mask->use(5, 5);
+//
+// Passes of the brick pool, recorded after the scheduler: the collapse
+// candidates are tested against every pooled quantity, the ones that are
+// uniform in all of them write their tiles and give their slots back, then
+// the newly scheduled bricks take slots and are filled from their tiles.
+// The pool's counts are read back to resize it a few steps later
+//
+void Engine::record_brick_pool() {
+    std::vector<ComputeResource> fields = pooled_resources();
+    std::vector<ComputeResource> lists = {
+        ComputeResource::storage(brick_table_ssbo), ComputeResource::storage(brick_pool_ssbo),
+        ComputeResource::storage(brick_dispatch_buffer), ComputeResource::indirect(brick_dispatch_buffer),
+    };
+    std::vector<ComputeResource> field_reads = fields;
+    field_reads.insert(field_reads.end(), lists.begin(), lists.end());
+
+    advance_graph.add("brick_collapse_test", field_reads, { ComputeResource::storage(brick_pool_ssbo) },
+        [this]() {
+            for (PooledQuantity &quantity : pooled_quantities()) {
+                brick_field(*quantity.source, *quantity.source, BRICK_FIELD_TEST);
+            }
+        });
+
+    advance_graph.add("brick_collapse", field_reads, fields, [this]() { collapse_bricks(); });
+
+    advance_graph.add("brick_release", lists, { ComputeResource::storage(brick_table_ssbo), ComputeResource::storage(brick_pool_ssbo) },
+        [this]() {
+            glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, brick_dispatch_buffer);
+            fs_brick_slots.use();
+            fs_brick_slots.setInt("operation", BRICK_SLOTS_RELEASE);
+            fs_brick_slots.dispatch_indirect(brick_dispatch_buffer, COLLAPSE_SLOTS * 3 * sizeof(uint32_t));
+        });
+
+    advance_graph.add("brick_allocate", lists, { ComputeResource::storage(brick_table_ssbo), ComputeResource::storage(brick_pool_ssbo) },
+        [this]() { allocate_bricks(); });
+
+    advance_graph.add("brick_expand", field_reads, fields,
+        [this]() {
+            for (PooledQuantity &quantity : pooled_quantities()) {
+                for (Texture3D *texture : quantity.textures) {
+                    brick_field(*texture, *texture, BRICK_FIELD_EXPAND);
+                }
+            }
+        });
+
+    advance_graph.add("brick_pool_readback", { ComputeResource::buffer_update(brick_pool_ssbo) }, {},
+        [this]() { brick_pool_readback.read_buffer(brick_pool_ssbo, sizeof(BrickPoolHeader)); });
+}
+
+void Engine::apply_world_mask_overlay() {
+    step_solid_mask.use(1, 1);
+    world_mask.front.use(2, 2);
+    world_mask.back.use(3, 3);
+
+    fs_apply_world_mask_overlay.use();
+    fs_apply_world_mask_overlay.dispatch(grid_width, grid_height, grid_depth);
+
+    world_mask.swap();
+}
+
+//
+// Units used by the fused advection kernel. Every input and output gets its
+// own unit so that no sampler binding is clobbered by an image binding. The
+// kernel reads scalar i from unit 10 + i and writes it to unit 10 + N + i
+//
+static const uint32_t ADVECT_SCALAR_FIRST_UNIT = 10;
+
+void Engine::reset_brick_state() {
+    std::vector<uint32_t> state(brick_count_x * brick_count_y * brick_count_z, (uint32_t) brick_hysteresis);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, brick_state_ssbo);
+    glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, state.size() * sizeof(uint32_t), state.data());
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+}
+
+//
+// Whether the per-cell kernels run over the scheduler's brick list, which
+// the brick pool needs even with sparse_bricks off
+//
+bool Engine::brick_list() const {
+    return sparse_bricks || storage == FIELD_STORAGE_BRICK_POOL;
+}
+
+//
+// Dispatches a per-cell (or brick sized tile) kernel over the whole grid,
+// or over the active bricks with the indirect command matching its
+// workgroup size
+//
+void Engine::dispatch_cells(const KernelProgram &kernel) {
+    if (!brick_list()) {
+        kernel.dispatch(grid_width, grid_height, grid_depth);
+        return;
+    }
+
+    uint32_t groups_per_brick = BRICK_CELLS / (kernel.local_size.x * kernel.local_size.y * kernel.local_size.z);
+    uint32_t command = 0;
+    while ((1u << command) < groups_per_brick) command++;
+
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, brick_list_ssbo);
+    kernel.dispatch_indirect(brick_dispatch_buffer, command * 3 * sizeof(uint32_t));
+}
+
+//
+// Prefix of every kernel the engine compiles: the image formats of the
+// fields, the StepParameters uniform block and the pool_* addressing
+//
+std::string Engine::format_defines() const {
+    return std::string("#define TEMPERATURE_FORMAT ") + image_format_qualifier(formats.temperature) + "\n"
+           + "#define PRESSURE_FORMAT " + image_format_qualifier(formats.pressure) + "\n"
+           + "#define DIVERGENCE_FORMAT " + image_format_qualifier(formats.divergence) + "\n"
+           + "#define WORLD_MASK_FORMAT " + image_format_qualifier(formats.world_mask) + "\n"
+           + (storage == FIELD_STORAGE_BRICK_POOL ? "#define BRICK_POOL\n" : "")
+           + STEP_PARAMETERS_GLSL
+           + BRICK_POOL_GLSL;
+}
+
+//
+// A texture for a simulated field: grid sized when the fields are dense,
+// otherwise an atlas with the tile layers and brick_pool_capacity slots.
+// Atlases are only ever read texel by texel, pool_sample filters them
+//
+Texture3D Engine::field_texture(uint32_t unit, GLint sampling_type, GLenum format) const {
+    if (storage != FIELD_STORAGE_BRICK_POOL) {
+        return Texture3D(grid_width, grid_height, grid_depth, unit, sampling_type, format);
+    }
+
+    uint32_t layer = brick_count_x * brick_count_y;
+    uint32_t slot_layers = (brick_pool_capacity + layer - 1) / layer;
+    return Texture3D(BRICK_SIZE * brick_count_x, BRICK_SIZE * brick_count_y, brick_pool_tile_layers + BRICK_SIZE * slot_layers,
+                     unit, GL_NEAREST, format);
+}
+
+//
+// Every pooled quantity with the textures that share its layout. Looked up
+// again on every use, the pairs swap and the pressure ring rotates
+//
+std::vector<PooledQuantity> Engine::pooled_quantities() {
+    std::vector<PooledQuantity> quantities = {
+        { &u.front, { &u.front, &u.back } },
+        { &q.front, { &q.front, &q.back } },
+        { &temp.front, { &temp.front, &temp.back } },
+        { &world_mask.front, { &world_mask.front, &world_mask.back } },
+        { &forces, { &forces } },
+        { &divq, { &divq } },
+        { &pressure(), { &prescpy[0], &prescpy[1], &prescpy[2], &pres.front, &pres.back } },
+    };
+
+    // THE FINEST MULTIGRID RESIDUAL IS SCRATCH, IT ONLY HAS TO FOLLOW THE LAYOUT
+    if (!mg_levels.empty()) {
+        quantities[5].textures.push_back(&mg_levels[0].residual);
+    }
+    for (Texture3DPair &scalar : scalars) {
+        quantities.push_back({ &scalar.front, { &scalar.front, &scalar.back } });
+    }
+    return quantities;
+}
+
+std::vector<ComputeResource> Engine::pooled_resources() {
+    std::vector<ComputeResource> resources;
+    for (PooledQuantity &quantity : pooled_quantities()) {
+        for (Texture3D *texture : quantity.textures) {
+            resources.push_back(ComputeResource::image(*texture));
+        }
+    }
+    return resources;
+}
+
+//
+// The step parameters at uniform binding 0 and, when the fields are pooled,
+// the brick table at storage binding 5 and the pool at 6. Rebound before
+// running kernels from outside the step, whose bindings others may reuse
+//
+void Engine::bind_brick_pool() {
+    glBindBufferBase(GL_UNIFORM_BUFFER, 0, step_params_ubo);
+    if (storage == FIELD_STORAGE_BRICK_POOL) {
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 5, brick_table_ssbo);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 6, brick_pool_ssbo);
+    }
+}
+
+//
+// One fs_brick_field operation on a pooled field, over the list it works
+// on or over the grid. BRICK_FIELD_MOVE is dispatched by the relayout
+//
+void Engine::brick_field(Texture3D &field, Texture3D &target, int operation) {
+    KernelProgram &kernel = fs_brick_field[field.format];
+    field.use(1, 1);
+    target.use(2, 2);
+    kernel.use();
+    kernel.setInt("operation", operation);
+
+    if (operation == BRICK_FIELD_TEST || operation == BRICK_FIELD_COLLAPSE) {
+        kernel.dispatch_indirect(brick_dispatch_buffer, COLLAPSE_BRICKS * 3 * sizeof(uint32_t));
+    } else if (operation == BRICK_FIELD_EXPAND) {
+        kernel.dispatch_indirect(brick_dispatch_buffer, EXPAND_BRICKS * 3 * sizeof(uint32_t));
+    } else {
+        kernel.dispatch(grid_width, grid_height, grid_depth);
+    }
+}
+
+void Engine::collapse_bricks() {
+    for (PooledQuantity &quantity : pooled_quantities()) {
+        for (Texture3D *texture : quantity.textures) {
+            brick_field(*quantity.source, *texture, BRICK_FIELD_COLLAPSE);
+        }
+    }
+}
+
+void Engine::allocate_bricks() {
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, brick_dispatch_buffer);
+    fs_brick_slots.use();
+    fs_brick_slots.setInt("operation", BRICK_SLOTS_ALLOCATE);
+    fs_brick_slots.dispatch_indirect(brick_dispatch_buffer, EXPAND_SLOTS * 3 * sizeof(uint32_t));
+}
+
+//
+// Resizes the pool from the newest counts read back since its last layout
+// change. It grows when allocations failed or the free slots ran below half
+// the headroom, and is compacted once less than a quarter of it is in use
+//
+void Engine::update_brick_pool() {
+    const BrickPoolHeader *header = (const BrickPoolHeader *) brick_pool_readback.latest();
+    if (!header || brick_pool_readback.frames_issued - brick_pool_readback.latency() <= brick_pool_layout_frame) {
+        return;
+    }
+
+    uint32_t total = brick_count_x * brick_count_y * brick_count_z;
+    uint32_t layer = brick_count_x * brick_count_y;
+    uint32_t free_slots = (uint32_t) std::max(header->free_count, 0);
+    brick_pool_used = brick_pool_capacity - std::min(free_slots, brick_pool_capacity);
+    brick_pool_failed = header->failed_count;
+
+    if ((brick_pool_failed > 0 || free_slots < brick_pool_capacity * brick_pool_headroom / 2.0f) && brick_pool_capacity < total) {
+        float wanted = (brick_pool_used + brick_pool_failed) * (1.0f + brick_pool_headroom);
+        uint32_t capacity = ((uint32_t) std::ceil(wanted) + layer - 1) / layer * layer;
+        resize_brick_pool(std::min(std::max(capacity, brick_pool_capacity + layer), total));
+    } else if (brick_pool_used < brick_pool_capacity / 4 && brick_pool_capacity > layer) {
+        compact_brick_pool();
+    }
+}
+
+//
+// Grows every atlas to capacity slots with a copy on the GPU, then pushes
+// the new slots onto the free stack. The table stays as it is
+//
+void Engine::resize_brick_pool(uint32_t capacity) {
+    GpuZone zone("brick_pool_resize");
+    uint32_t first_slot = brick_pool_capacity;
+    brick_pool_capacity = capacity;
+
+    for (PooledQuantity &quantity : pooled_quantities()) {
+        for (Texture3D *texture : quantity.textures) {
+            Texture3D grown = field_texture(texture->unit, GL_NEAREST, texture->format);
+            barriers.begin_pass({ ComputeResource::texture_update(*texture) }, { ComputeResource::texture_update(grown) });
+            glCopyImageSubData(texture->id, GL_TEXTURE_3D, 0, 0, 0, 0,
+                               grown.id, GL_TEXTURE_3D, 0, 0, 0, 0,
+                               texture->width, texture->height, texture->depth);
+            barriers.end_pass();
+            texture->destroy();
+            *texture = grown;
+        }
+    }
+
+    bind_brick_pool();
+    barriers.begin_pass({ ComputeResource::storage(brick_pool_ssbo) }, { ComputeResource::storage(brick_pool_ssbo) });
+    fs_brick_slots.use();
+    fs_brick_slots.setInt("operation", BRICK_SLOTS_GROW);
+    fs_brick_slots.setInt("first_slot", first_slot);
+    fs_brick_slots.setInt("slot_count", capacity - first_slot);
+    glDispatchCompute(1, 1, 1);
+    barriers.end_pass();
+
+    brick_pool_layout_frame = brick_pool_readback.frames_issued;
+}
+
+//
+// Rebuilds the pool with the bricks that have a slot numbered in brick
+// order from slot 0, or every brick when expand_all is set. Reads the table
+// back, so it waits for the GPU
+//
+void Engine::relayout_brick_pool(bool expand_all) {
+    GpuZone zone("brick_pool_relayout");
+    uint32_t total = brick_count_x * brick_count_y * brick_count_z;
+    uint32_t layer = brick_count_x * brick_count_y;
+
+    bind_brick_pool();
+    barriers.begin_pass({ ComputeResource::buffer_update(brick_table_ssbo) }, {});
+    std::vector<uint32_t> table(total);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, brick_table_ssbo);
+    glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, total * sizeof(uint32_t), table.data());
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    barriers.end_pass();
+
+    // THE SCHEDULED BIT STAYS WITH ITS BRICK
+    std::vector<glm::uvec2> moves;
+    for (uint32_t brick = 0; brick < total; brick++) {
+        uint32_t scheduled = table[brick] & 0x80000000u;
+        if ((table[brick] & 0x7fffffffu) != 0 || expand_all) {
+            moves.push_back(glm::uvec2(brick, moves.size()));
+            table[brick] = (uint32_t) moves.size() | scheduled;
+        } else {
+            table[brick] = scheduled;
+        }
+    }
+
+    uint32_t used = moves.size();
+    uint32_t capacity = (uint32_t) std::ceil(std::max(used, 1u) * (1.0f + brick_pool_headroom));
+    capacity = std::min((capacity + layer - 1) / layer * layer, total);
+    if (expand_all) {
+        capacity = total;
+    }
+    brick_pool_capacity = capacity;
+    brick_pool_used = used;
+
+    uint32_t moves_ssbo;
+    glGenBuffers(1, &moves_ssbo);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, moves_ssbo);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, std::max<size_t>(moves.size(), 1) * sizeof(glm::uvec2), moves.data(), GL_STREAM_DRAW);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 7, moves_ssbo);
+
+    // THE TILES KEEP THEIR PLACE, THE SLOTS ARE MOVED WITH THE OLD TABLE STILL BOUND
+    for (PooledQuantity &quantity : pooled_quantities()) {
+        for (Texture3D *texture : quantity.textures) {
+            Texture3D moved = field_texture(texture->unit, GL_NEAREST, texture->format);
+            barriers.begin_pass({ ComputeResource::texture_update(*texture) }, { ComputeResource::texture_update(moved) });
+            glCopyImageSubData(texture->id, GL_TEXTURE_3D, 0, 0, 0, 0,
+                               moved.id, GL_TEXTURE_3D, 0, 0, 0, 0,
+                               texture->width, texture->height, brick_pool_tile_layers);
+            barriers.end_pass();
+
+            if (used > 0) {
+                barriers.begin_pass({ ComputeResource::image(*texture), ComputeResource::storage(brick_table_ssbo), ComputeResource::storage(moves_ssbo) },
+                                    { ComputeResource::image(moved) });
+                KernelProgram &kernel = fs_brick_field[texture->format];
+                texture->use(1, 1);
+                moved.use(2, 2);
+                kernel.use();
+                kernel.setInt("operation", BRICK_FIELD_MOVE);
+                glDispatchCompute(used, 1, 1);
+                barriers.end_pass();
+            }
+
+            texture->destroy();
+            *texture = moved;
+        }
+    }
+    glDeleteBuffers(1, &moves_ssbo);
+
+    // THE FREE STACK HOLDS EVERY SLOT PAST THE ONES IN USE
+    std::vector<uint32_t> pool(sizeof(BrickPoolHeader) / sizeof(uint32_t) + (capacity - used), 0);
+    BrickPoolHeader *header = (BrickPoolHeader *) pool.data();
+    header->free_count = capacity - used;
+    for (uint32_t slot = used; slot < capacity; slot++) {
+        pool[sizeof(BrickPoolHeader) / sizeof(uint32_t) + slot - used] = slot;
+    }
+
+    barriers.begin_pass({}, { ComputeResource::buffer_update(brick_table_ssbo), ComputeResource::buffer_update(brick_pool_ssbo) });
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, brick_table_ssbo);
+    glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, total * sizeof(uint32_t), table.data());
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, brick_pool_ssbo);
+    glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, pool.size() * sizeof(uint32_t), pool.data());
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    barriers.end_pass();
+
+    brick_pool_layout_frame = brick_pool_readback.frames_issued;
+}
+
+//
+// Gives every brick a slot, so the fields can be written without going
+// through the scheduler
+//
+void Engine::expand_brick_pool() {
+    relayout_brick_pool(true);
+    brick_pool_expanded = true;
+}
+
+void Engine::compact_brick_pool() {
+    if (storage == FIELD_STORAGE_BRICK_POOL) {
+        relayout_brick_pool(false);
+    }
+}
+
+Texture3D &Engine::dense_scratch(GLenum format) {
+    auto scratch = dense_views.find(format);
+    if (scratch == dense_views.end()) {
+        scratch = dense_views.emplace(format, Texture3D(grid_width, grid_height, grid_depth, 0, GL_LINEAR, format)).first;
+    }
+    return scratch->second;
+}
+
+Texture3D &Engine::dense_view(Texture3D &field) {
+    // A FIELD THE CPU STEPPED LAST IS ONLY UPLOADED ONCE SOMETHING LOOKS AT IT
+    for (int state = 0; state < CPU_FIELD_COUNT; state++) {
+        if ((stale_fields & (1u << state)) && cpu_field_texture((CpuField) state) == &field) {
+            sync_cpu_state(1u << state);
+        }
+    }
+
+    if (storage != FIELD_STORAGE_BRICK_POOL) {
+        return field;
+    }
+
+    Texture3D &view = dense_scratch(field.format);
+    bind_brick_pool();
+    barriers.begin_pass({ ComputeResource::image(field), ComputeResource::storage(brick_table_ssbo) }, { ComputeResource::image(view) });
+    brick_field(field, view, BRICK_FIELD_UNPACK);
+    barriers.end_pass();
+    return view;
+}
+
+//
+// Writes 4 floats per cell into a field, through a dense scratch texture
+// when it is pooled. Every brick of a pooled field needs a slot
+//
+void Engine::upload_field(Texture3D &field, const float *rgba) {
+    Texture3D &dense = storage == FIELD_STORAGE_BRICK_POOL ? dense_scratch(field.format) : field;
+    barriers.begin_pass({}, { ComputeResource::texture_update(dense) });
+    glTextureSubImage3D(dense.id, 0, 0, 0, 0, grid_width, grid_height, grid_depth, GL_RGBA, GL_FLOAT, rgba);
+    barriers.end_pass();
+
+    if (storage == FIELD_STORAGE_BRICK_POOL) {
+        bind_brick_pool();
+        barriers.begin_pass({ ComputeResource::image(dense), ComputeResource::storage(brick_table_ssbo) }, { ComputeResource::image(field) });
+        brick_field(field, dense, BRICK_FIELD_PACK);
+        barriers.end_pass();
+    }
+}
+
+size_t Engine::field_memory() {
+    size_t bytes = 0;
+    for (PooledQuantity &quantity : pooled_quantities()) {
+        for (Texture3D *texture : quantity.textures) {
+            bytes += texture->bytes();
+        }
+    }
+    for (auto &view : dense_views) {
+        bytes += view.second.bytes();
+    }
+    return bytes;
+}
+
+void Engine::load_fused_advection() {
+    fs_advect_fused.destroy();
+
+    KernelTuner tuner("kernel_tuning.cache");
+    fs_advect_fused = tuner.load("src/kernels/fs_advect_fused.comp", grid_width, grid_height, grid_depth,
+                                 format_defines() + "#define NUM_SCALAR_FIELDS " + std::to_string(scalars.size()) + "\n");
+    tuner.save();
+}
+
+int Engine::add_scalar_field() {
+    GLint max_image_units, max_combined_units, max_compute_images, max_compute_samplers;
+    glGetIntegerv(GL_MAX_IMAGE_UNITS, &max_image_units);
+    glGetIntegerv(GL_MAX_COMBINED_TEXTURE_IMAGE_UNITS, &max_combined_units);
+    glGetIntegerv(GL_MAX_COMPUTE_IMAGE_UNIFORMS, &max_compute_images);
+    glGetIntegerv(GL_MAX_COMPUTE_TEXTURE_IMAGE_UNITS, &max_compute_samplers);
+
+    // WITH N + 1 FIELDS THE SCALARS TAKE UNITS 10 UP TO 11 + 2N,
+    // ON TOP OF 3 OUTPUT IMAGES AND 6 SAMPLERS FOR THE BUILT-IN FIELDS
+    int n = (int) scalars.size();
+    int last_unit = ADVECT_SCALAR_FIRST_UNIT + 2 * n + 1;
+    if (last_unit >= std::min(max_image_units, max_combined_units)
+        || 3 + n + 1 > max_compute_images
+        || 6 + n + 1 > max_compute_samplers) {
+        std::cout << "ERROR::FLUIDSIM::NO UNITS LEFT FOR SCALAR FIELD " << n << std::endl;
+        return -1;
+    }
+
+    scalars.push_back(Texture3DPair(field_texture(0, GL_LINEAR, GL_RGBA16F),
+                                    field_texture(0, GL_LINEAR, GL_RGBA16F)));
+    scalars.back().front.clear(0.0f);
+    load_fused_advection();
+
+    return n;
+}
+
+void Engine::advect_fused() {
+    u.front.use(1, 1);
+    world_mask.front.use(2, 2);
+    u.back.use(3, 3);
+    step_temperature_mask.use(4, 4);
+    step_velocity_mask.use(5, 5);
+    q.front.use(6, 6);
+    q.back.use(7, 7);
+    temp.front.use(8, 8);
+    temp.back.use(9, 9);
+
+    fs_advect_fused.use();
+    for (uint32_t i = 0; i < scalars.size(); i++) {
+        uint32_t prev_unit = ADVECT_SCALAR_FIRST_UNIT + i;
+        uint32_t next_unit = ADVECT_SCALAR_FIRST_UNIT + scalars.size() + i;
+        scalars[i].front.use(prev_unit, prev_unit);
+        scalars[i].back.use(next_unit, next_unit);
+    }
+
+    dispatch_cells(fs_advect_fused);
+
+    q.swap();
+    temp.swap();
+    for (Texture3DPair &scalar : scalars) {
+        scalar.swap();
+    }
+}
+
+//
+// Reference path with one dispatch per field, kept for A/B comparison
+// against the fused kernel. Extra scalar fields are not advected here
+//
+void Engine::advect_velocity() {
+    // u IS BOTH THE ADVECTING FIELD AND THE ADVECTED QUANTITY
+    u.front.use(1, 1);
+    world_mask.front.use(2, 2);
+    step_velocity_mask.use(5, 5);
+    u.front.use(6, 6);
+    u.back.use(7, 7);
 
     fs_advect_mc.use();
-    fs_advect_mc.setInt("u", 1);
-    fs_advect_mc.setInt("q_prev", 1);
-    fs_advect_mc.setInt("q_solid", 5);
-    fs_advect_mc.setInt("q_next", 3);
-    fs_advect_mc.setInt("world_mask", 2);
-    fs_advect_mc.setFloat("dt", dt);
-    fs_advect_mc.setVec3("scale", sclx, scly, sclz);
     fs_advect_mc.setVec4("q_air", 0.0f, 0.0f, 0.0f, 0.0f);
 
-    glDispatchCompute((GLuint) grid_width, (GLuint) grid_depth, (GLuint) grid_height);
-    glMemoryBarrier(GL_ALL_BARRIER_BITS);
-    
+    dispatch_cells(fs_advect_mc);
+}
+
+void Engine::advect_q() {
+    u.front.use(1, 1);
+    world_mask.front.use(2, 2);
     zero.use(5, 5);
+    q.front.use(6, 6);
+    q.back.use(7, 7);
 
-    // ADVECT SOME QUANTITY Q
     fs_advect_mc.use();
-    fs_advect_mc.setInt("u", 1);
-    fs_advect_mc.setInt("q_prev", 6);
-    fs_advect_mc.setInt("q_solid", 5);
-    fs_advect_mc.setInt("q_next", 7);
-    fs_advect_mc.setInt("world_mask", 2);
-    fs_advect_mc.setFloat("dt", dt);
-    fs_advect_mc.setVec3("scale", sclx, scly, sclz);
     fs_advect_mc.setVec4("q_air", 0.0f, 0.0f, 0.0f, 0.0f);
 
-    glDispatchCompute((GLuint) grid_width, (GLuint) grid_depth, (GLuint) grid_height);
-    glMemoryBarrier(GL_ALL_BARRIER_BITS);
-
-    // WRITE Q_NEXT TO Q
-    fs_write_to.use();
-    fs_write_to.setInt("q_in", 7);
-    fs_write_to.setInt("q_out", 6);
+    dispatch_cells(fs_advect_mc);
 
-    glDispatchCompute((GLuint) grid_width, (GLuint) grid_height, (GLuint) grid_depth);
-    glMemoryBarrier(GL_ALL_BARRIER_BITS);
+    q.swap();
+}
 
-    // ADVECT TEMPERATURE FIELD
-    temp.use(6, 6);
-    temperature_mask->use(4, 4);
+void Engine::advect_temperature() {
+    u.front.use(1, 1);
+    world_mask.front.use(2, 2);
+    step_temperature_mask.use(4, 4);
+    temp.front.use(6, 6);
+    temp.back.use(7, 7);
 
     fs_advect_diffuse.use();
-    fs_advect_diffuse.setInt("u", 1);
-    fs_advect_diffuse.setInt("q_prev", 6);
-    fs_advect_diffuse.setInt("q_solid", 4);
-    fs_advect_diffuse.setInt("q_next", 7);
-    fs_advect_diffuse.setInt("world_mask", 2);
-    fs_advect_diffuse.setFloat("dt", dt);
-    fs_advect_diffuse.setVec3("scale", sclx, scly, sclz);
     fs_advect_diffuse.setVec4("q_air", 293.15f, 0.0f, 0.0f, 0.0f);
 
-    glDispatchCompute((GLuint) grid_width, (GLuint) grid_depth, (GLuint) grid_height);
-    glMemoryBarrier(GL_ALL_BARRIER_BITS);
+    dispatch_cells(fs_advect_diffuse);
 
-    // WRITE NEXT_TEMP TO TEMP
-    fs_write_to.use();
-    fs_write_to.setInt("q_in", 7);
-    fs_write_to.setInt("q_out", 6);
+    temp.swap();
+}
 
-    glDispatchCompute((GLuint) grid_width, (GLuint) grid_height, (GLuint) grid_depth);
-    glMemoryBarrier(GL_ALL_BARRIER_BITS);
+void Engine::force_divergence() {
+    u.front.use(1, 1);
+    world_mask.front.use(2, 2);
+    u.back.use(3, 3);
+    step_velocity_mask.use(4, 4);
+    forces.use(5, 5);
+    temp.front.use(6, 6);
+    pressure().use(7, 7);
+    divq.use(8, 8);
 
-    nearest_buffer.use(4, 4);
+    fs_force_div.use();
+    dispatch_cells(fs_force_div);
 
-    // // WRITE WORLD_MASK_NEXT TO WORLDMASK
-    // fs_write_to.use();
-    // fs_write_to.setInt("q_in", 4);
-    // fs_write_to.setInt("q_out", 2);
+    u.swap();
+}
 
-    // glDispatchCompute((GLuint) grid_width, (GLuint) grid_height, (GLuint) grid_depth);
-    // glMemoryBarrier(GL_ALL_BARRIER_BITS);
+void Engine::apply_force() {
+    u.front.use(1, 1);
+    world_mask.front.use(2, 2);
+    u.back.use(3, 3);
+    forces.use(5, 5);
+    temp.front.use(6, 6);
+    pressure().use(7, 7);
 
-    // WRITE W_NEXT TO U    
-    fs_write_to.use();
-    fs_write_to.setInt("q_in", 3);
-    fs_write_to.setInt("q_out", 1);
+    fs_apply_force.use();
+    dispatch_cells(fs_apply_force);
 
-    glDispatchCompute((GLuint) grid_width, (GLuint) grid_height, (GLuint) grid_depth);
-    glMemoryBarrier(GL_ALL_BARRIER_BITS);
+    u.swap();
+}
 
-    
-    // EXTERNAL FORCES
-    u.use(1, 1);
-    world_mask.use(2, 2);
-    lin_buffer.use(3, 3);
-    zero.use(4, 4);
-    forces.use(5, 5);
-    temp.use(6, 6);
-    pres.use(7, 7);
+void Engine::divergence() {
+    u.front.use(1, 1);
+    world_mask.front.use(2, 2);
+    step_velocity_mask.use(4, 4);
+    divq.use(5, 5);
 
-    fs_apply_force.use();
-    fs_apply_force.setInt("w", 1);
-    fs_apply_force.setInt("f", 5);
+    fs_div.use();
+    dispatch_cells(fs_div);
+}
+
+void Engine::project() {
+    u.front.use(1, 1);
+    world_mask.front.use(2, 2);
+    if (fused_projection) {
+        u.front.use(3, 3);
+    } else {
+        u.back.use(3, 3);
+    }
+    step_velocity_mask.use(4, 4);
+    pressure().use(6, 6);
+
+    fs_pressure_proj.use();
+    dispatch_cells(fs_pressure_proj);
+
+    if (!fused_projection) {
+        u.swap();
+    }
+}
 
-    fs_apply_force.setInt("temp", 6);
-    fs_apply_force.setInt("pressure", 7);
+//
+// Both pressure solvers take the latest pressure (the current ring slot) as
+// their initial guess without writing to it, and leave their result in
+// pres.front with pres.back as scratch.
+//
+void Engine::solve_pressure_jacobi() {
+    pressure_stats = { 0, -1.0f, -1.0f };
+    residual_pending = 0;
+
+    // THE FIRST SWEEP READS THE RING, EVERY LATER ONE THE PREVIOUS RESULT
+    Texture3D *current = &pressure();
+    bool converged = false;
+    int next_check = 0;
+
+    while (pressure_stats.iterations < max_iterations) {
+        if (pressure_tolerance > 0.0f && pressure_stats.iterations >= next_check) {
+            next_check = pressure_stats.iterations + std::max(residual_check_interval, 1);
+            converged = check_pressure_residual(*current);
+            if (converged) break;
+        }
+
+        // ONE ITERATION IS TWO SWEEPS, EITHER AS TWO DISPATCHES OR IN SHARED MEMORY
+        int remaining = max_iterations - pressure_stats.iterations;
+        KernelProgram *kernel = &fs_jacobi_iter;
+        int dispatches = 2;
+        int iterations = 1;
+
+        if (jacobi_sweeps_per_dispatch >= 4 && remaining >= 2) {
+            kernel = &fs_jacobi_block4;
+            dispatches = 1;
+            iterations = 2;
+        } else if (jacobi_sweeps_per_dispatch >= 2) {
+            kernel = &fs_jacobi_block2;
+            dispatches = 1;
+        }
+
+        for (int i = 0; i < dispatches; i++) {
+            current->use(6, 6);
+            divq.use(5, 5);
+            pres.back.use(3, 3);
+            world_mask.front.use(2, 2);
+
+            // JACOBOBBOBOIBSOFIBODFIBODFIBODBIBOIIIII
+            GpuZone zone("jacobi_sweep");
+            std::vector<ComputeResource> reads = { ComputeResource::image(*current), ComputeResource::image(divq), ComputeResource::image(world_mask.front) };
+            if (brick_list()) {
+                reads.push_back(ComputeResource::storage(brick_list_ssbo));
+                reads.push_back(ComputeResource::indirect(brick_dispatch_buffer));
+            }
+            barriers.begin_pass(reads, { ComputeResource::image(pres.back) });
+            kernel->use();
+            dispatch_cells(*kernel);
+            barriers.end_pass();
+
+            pres.swap();
+            current = &pres.front;
+        }
+
+        pressure_stats.iterations += iterations;
+    }
 
-    fs_apply_force.setFloat("rho", 1.0f);
-    fs_apply_force.setFloat("g", -9.8f);
+    // REPORT THE LAST CHECK, THE SWEEPS ISSUED AFTER IT KEEP THE GPU BUSY WHILE IT IS READ
+    if (!converged) {
+        read_pressure_residual();
+    }
 
-    fs_apply_force.setFloat("temp_air", 293.15f + 100.0f);
+    // THE INITIAL GUESS WAS ALREADY GOOD ENOUGH, IT STILL HAS TO END UP IN PRES.FRONT
+    if (current != &pres.front) {
+        copy_texture(barriers, *current, pres.front);
+    }
+}
 
-    fs_apply_force.setVec3("scale", sclx, scly, sclz);
-    fs_apply_force.setFloat("dt", dt);
-    fs_apply_force.setInt("w_next", 3);
-    fs_apply_force.setInt("world_mask", 2);
+void Engine::solve_pressure_multigrid() {
+    // THE FINEST LEVEL SOLVES DIRECTLY INTO THE ENGINE'S OWN TEXTURES
+    MultigridLevel &finest = mg_levels[0];
+    finest.pressure = pres.front;
+    finest.pressure_next = pres.back;
+    finest.rhs = divq;
+    finest.world_mask = world_mask.front;
+
+    pressure_stats = { 0, -1.0f, -1.0f };
+    residual_pending = 0;
+    bool converged = false;
+
+    if (pressure_solver == PRESSURE_SOLVER_MULTIGRID_V_CYCLE) {
+        // ONE SMOOTHING SWEEP MOVES THE WARM START OUT OF THE RING
+        finest.pressure = pressure();
+        finest.pressure_next = pres.front;
+        mg_smooth(0, 1);
+        finest.pressure_next = pres.back;
+    }
 
-    glDispatchCompute((GLuint) grid_width, (GLuint) grid_height, (GLuint) grid_depth);
-    glMemoryBarrier(GL_ALL_BARRIER_BITS);
+    if (pressure_solver == PRESSURE_SOLVER_MULTIGRID_FMG) {
+        // RESTRICT THE RIGHT HAND SIDE ALL THE WAY DOWN, SOLVE ON THE COARSEST
+        // LEVEL AND WORK BACK UP, USING EACH SOLUTION AS THE NEXT INITIAL GUESS
+        for (uint32_t level = 0; level + 1 < mg_levels.size(); level++) {
+            mg_restrict(level, mg_levels[level].rhs);
+        }
+        mg_smooth(mg_levels.size() - 1, mg_coarse_sweeps);
+
+        for (int level = (int) mg_levels.size() - 2; level >= 0; level--) {
+            mg_prolong(level, false);
+            mg_vcycle(level);
+        }
+        pressure_stats.iterations++;
+
+        converged = pressure_tolerance > 0.0f && (check_pressure_residual(finest.pressure) || read_pressure_residual());
+    }
 
-    // WRITE TO NEW VALUES
-    fs_write_to.use();
-    fs_write_to.setInt("q_in", 3);
-    fs_write_to.setInt("q_out", 1);
+    // A CYCLE OUTWEIGHS DRAINING THE PIPELINE, SO EVERY CHECK IS READ RIGHT AWAY RATHER THAN ONE CYCLE LATE
+    while (!converged && pressure_stats.iterations < mg_cycles) {
+        mg_vcycle(0);
+        pressure_stats.iterations++;
 
-    glDispatchCompute((GLuint) grid_width, (GLuint) grid_height, (GLuint) grid_depth);
-    glMemoryBarrier(GL_ALL_BARRIER_BITS);
+        converged = pressure_tolerance > 0.0f && (check_pressure_residual(finest.pressure) || read_pressure_residual());
+    }
 
-    
-    // APPLY DIVERGENCE TO W the JACOBBIIIBIBIBIBIBBIBBIBIBIBIBI
-    u.use(1, 1);
-    world_mask.use(2, 2);
-    lin_buffer.use(3, 3);
-    velocity_mask->use(4, 4);
+    // HAND THE RESULT BACK, WHICHEVER TEXTURE THE SMOOTHER LEFT IT IN
+    pres.front = finest.pressure;
+    pres.back = finest.pressure_next;
+}
+
+//
+// Queues the residual reduction of a pressure field against divq and its
+// readback, then reads the check queued before it. Returns whether that
+// earlier check had reached pressure_tolerance. Only waiting on the older
+// check leaves the GPU the sweeps issued since, so the solve never drains
+// the pipeline, at the price of stopping one check late
+//
+bool Engine::check_pressure_residual(Texture3D &pressure_field) {
+    GpuZone zone("pressure_residual");
+    std::vector<ComputeResource> reads = { ComputeResource::image(pressure_field), ComputeResource::image(divq), ComputeResource::image(world_mask.front) };
+    if (brick_list()) {
+        reads.push_back(ComputeResource::storage(brick_list_ssbo));
+        reads.push_back(ComputeResource::indirect(brick_dispatch_buffer));
+    }
+    barriers.begin_pass(reads, { ComputeResource::storage(residual_partials_ssbo) });
+    pressure_field.use(6, 6);
     divq.use(5, 5);
-    pres.use(6, 6);
+    world_mask.front.use(2, 2);
+    fs_residual_norm.use();
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, residual_partials_ssbo);
 
-    fs_div.use();
-    fs_div.setInt("q", 1);
-    fs_div.setInt("q_solid", 4);
-    fs_div.setInt("div_q", 5);
-    fs_div.setInt("world_mask", 2);
+    dispatch_cells(fs_residual_norm);
+    barriers.end_pass();
 
-    glDispatchCompute((GLuint) grid_width, (GLuint) grid_height, (GLuint) grid_depth);
-    glMemoryBarrier(GL_ALL_BARRIER_BITS);
+    // ONLY THE GPU KNOWS HOW MANY PARTIALS A SPARSE DISPATCH WROTE
+    std::vector<ComputeResource> partials = { ComputeResource::storage(residual_partials_ssbo) };
+    if (brick_list()) {
+        partials.push_back(ComputeResource::storage(brick_dispatch_buffer));
+    }
+    barriers.begin_pass(partials, { ComputeResource::storage(residual_result_ssbo) });
+    fs_reduce_norm.use();
+    fs_reduce_norm.setInt("partial_count", residual_partial_count);
+    glm::uvec3 residual_local = fs_residual_norm.local_size;
+    fs_reduce_norm.setInt("brick_groups", brick_list() ? BRICK_CELLS / (residual_local.x * residual_local.y * residual_local.z) : 0);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, residual_result_ssbo);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, brick_dispatch_buffer);
+
+    glDispatchCompute(1, 1, 1);
+    barriers.end_pass();
+
+    barriers.begin_pass({ ComputeResource::buffer_update(residual_result_ssbo) }, {});
+    bool queued = residual_readback.read_buffer(residual_result_ssbo, 4 * sizeof(float));
+    barriers.end_pass();
+
+    bool converged = read_pressure_residual();
+    residual_pending = queued ? residual_readback.frames_issued : 0;
+    return converged;
+}
+
+//
+// Waits for the pending residual check, if any, and copies it into
+// pressure_stats. Returns whether it had reached pressure_tolerance
+//
+bool Engine::read_pressure_residual() {
+    if (!residual_pending) {
+        return false;
+    }
+
+    // x: sum r^2, y: max |r|, z: sum div^2
+    const float *result = (const float *) residual_readback.wait(residual_pending);
+    residual_pending = 0;
+    if (!result) {
+        return false;
+    }
 
-    // JACOBBBBBBIIIIIIIIIIII
+    float r_norm = std::sqrt(result[0]);
+    float b_norm = std::sqrt(result[2]);
 
-    for(int iter = 0; iter < max_iterations; iter++) {
-        // JACOBOBBOBOIBSOFIBODFIBODFIBODBIBOIIIII
-        fs_jacobi_iter.use();
-        fs_jacobi_iter.setInt("pressure", 6);
-        fs_jacobi_iter.setInt("div_w", 5);
-        fs_jacobi_iter.setInt("pressure_next", 3);
-        fs_jacobi_iter.setInt("world_mask", 2);
-        fs_jacobi_iter.setFloat("pressure_air", 0.0f);
+    pressure_stats.residual_l2 = b_norm > 0.0f ? r_norm / b_norm : r_norm;
+    pressure_stats.residual_linf = result[1];
 
-        glDispatchCompute((GLuint) grid_width, (GLuint) grid_height, (GLuint) grid_depth);
-        glMemoryBarrier(GL_ALL_BARRIER_BITS);
+    return r_norm <= pressure_tolerance * b_norm;
+}
 
-        fs_jacobi_iter.use();
-        fs_jacobi_iter.setInt("pressure", 3);
-        fs_jacobi_iter.setInt("div_w", 5);
-        fs_jacobi_iter.setInt("pressure_next", 6);
-        fs_jacobi_iter.setInt("world_mask", 2);
-        fs_jacobi_iter.setFloat("pressure_air", 0.0f);
+//
+// Reduces max |u| over the fluid and air cells and queues its readback.
+// Nothing waits on the result, poll_max_velocity picks it up once it has
+// landed. When every slot of the ring is still in flight the copy is
+// skipped
+//
+void Engine::measure_max_velocity() {
+    GpuZone zone("max_velocity");
+    barriers.begin_pass({ ComputeResource::image(u.front), ComputeResource::image(world_mask.front) },
+                        { ComputeResource::storage(residual_partials_ssbo) });
+    u.front.use(1, 1);
+    world_mask.front.use(2, 2);
+    fs_max_velocity.use();
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, residual_partials_ssbo);
+
+    fs_max_velocity.dispatch(grid_width, grid_height, grid_depth);
+    barriers.end_pass();
+
+    // THE PARTIALS HAVE THE RESIDUAL LAYOUT, SO THE RESIDUAL REDUCTION FOLDS THEM (Y: MAX |U|)
+    barriers.begin_pass({ ComputeResource::storage(residual_partials_ssbo) }, { ComputeResource::storage(velocity_result_ssbo) });
+    fs_reduce_norm.use();
+    fs_reduce_norm.setInt("partial_count", residual_partial_count);
+    fs_reduce_norm.setInt("brick_groups", 0);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, velocity_result_ssbo);
+
+    glDispatchCompute(1, 1, 1);
+    barriers.end_pass();
+
+    barriers.begin_pass({ ComputeResource::buffer_update(velocity_result_ssbo) }, {});
+    velocity_readback.read_buffer(velocity_result_ssbo, 4 * sizeof(float));
+    barriers.end_pass();
+}
 
-        glDispatchCompute((GLuint) grid_width, (GLuint) grid_height, (GLuint) grid_depth);
-        glMemoryBarrier(GL_ALL_BARRIER_BITS);
+//
+// Takes the newest max |u| reduction that has landed into max_velocity.
+// Never waits on the GPU
+//
+void Engine::poll_max_velocity() {
+    const float *result = (const float *) velocity_readback.latest();
+    if (result) {
+        max_velocity = result[1];
     }
+}
 
-    // Presure Projection Time!!!!
-    fs_pressure_proj.use();
-    fs_pressure_proj.setInt("w", 1);
-    fs_pressure_proj.setInt("pressure", 6);
-    fs_pressure_proj.setInt("u_next", 3);
-    fs_pressure_proj.setInt("u_solid", 4);
-    fs_pressure_proj.setInt("world_mask", 2);
-
-    glDispatchCompute((GLuint) grid_width, (GLuint) grid_height, (GLuint) grid_depth);
-    glMemoryBarrier(GL_ALL_BARRIER_BITS);
-
-    // WRITE TO NEW VALUES
-    fs_write_to.use();
-    fs_write_to.setInt("q_in", 3);
-    fs_write_to.setInt("q_out", 1);
-
-    glDispatchCompute((GLuint) grid_width, (GLuint) grid_height, (GLuint) grid_depth);
-    glMemoryBarrier(GL_ALL_BARRIER_BITS);
-    
-    // WRITE TO PRESSURE BUFFER
-    if (iter % 3 == 0) {
-        prescpy[0].use(7, 7);
-    } else if (iter % 3 == 1) {
-        prescpy[1].use(7, 7);
-    } else {
-        prescpy[2].use(7, 7);
+void Engine::mg_vcycle(uint32_t level) {
+    if (level + 1 == mg_levels.size()) {
+        mg_smooth(level, mg_coarse_sweeps);
+        return;
     }
 
-    fs_write_to.use();
-    fs_write_to.setInt("q_in", 6);
-    fs_write_to.setInt("q_out", 7);
+    mg_smooth(level, mg_pre_sweeps);
+    mg_residual(level);
+    mg_restrict(level, mg_levels[level].residual);
+    mg_vcycle(level + 1);
+    mg_prolong(level, true);
+    mg_smooth(level, mg_post_sweeps);
+}
+
+void Engine::mg_smooth(uint32_t level, int sweeps) {
+    GpuZone zone("mg_smooth");
+    MultigridLevel &l = mg_levels[level];
+
+    l.rhs.use(2, 2);
+    l.world_mask.use(4, 4);
+
+    fs_mg_smooth.use();
+    fs_mg_smooth.setFloat("omega", mg_omega);
+    fs_mg_smooth.setBool("pooled", level == 0 && storage == FIELD_STORAGE_BRICK_POOL);
+
+    // Swapping the handles after every sweep keeps the result in l.pressure
+    for (int sweep = 0; sweep < sweeps; sweep++) {
+        barriers.begin_pass({ ComputeResource::image(l.pressure), ComputeResource::image(l.rhs), ComputeResource::image(l.world_mask) },
+                            { ComputeResource::image(l.pressure_next) });
+        l.pressure.use(1, 1);
+        l.pressure_next.use(3, 3);
+
+        fs_mg_smooth.dispatch(l.width, l.height, l.depth);
+        barriers.end_pass();
+
+        std::swap(l.pressure, l.pressure_next);
+    }
+}
+
+void Engine::mg_residual(uint32_t level) {
+    GpuZone zone("mg_residual");
+    MultigridLevel &l = mg_levels[level];
+
+    barriers.begin_pass({ ComputeResource::image(l.pressure), ComputeResource::image(l.rhs), ComputeResource::image(l.world_mask) },
+                        { ComputeResource::image(l.residual) });
+    l.pressure.use(1, 1);
+    l.rhs.use(2, 2);
+    l.residual.use(3, 3);
+    l.world_mask.use(4, 4);
+
+    fs_mg_residual.use();
+    fs_mg_residual.setBool("pooled", level == 0 && storage == FIELD_STORAGE_BRICK_POOL);
+    fs_mg_residual.dispatch(l.width, l.height, l.depth);
+    barriers.end_pass();
+}
+
+void Engine::mg_restrict(uint32_t level, Texture3D &fine) {
+    GpuZone zone("mg_restrict");
+    MultigridLevel &f = mg_levels[level];
+    MultigridLevel &c = mg_levels[level + 1];
+
+    barriers.begin_pass({ ComputeResource::image(fine), ComputeResource::image(f.world_mask) },
+                        { ComputeResource::image(c.rhs), ComputeResource::image(c.world_mask), ComputeResource::image(c.pressure) });
+    fine.use(1, 1);
+    f.world_mask.use(2, 2);
+    c.rhs.use(3, 3);
+    c.world_mask.use(4, 4);
+    c.pressure.use(5, 5);
+
+    fs_mg_restrict.use();
+    fs_mg_restrict.setBool("fine_pooled", level == 0 && storage == FIELD_STORAGE_BRICK_POOL);
+    fs_mg_restrict.dispatch(c.width, c.height, c.depth);
+    barriers.end_pass();
+}
+
+void Engine::mg_prolong(uint32_t level, bool accumulate) {
+    GpuZone zone("mg_prolong");
+    MultigridLevel &f = mg_levels[level];
+    MultigridLevel &c = mg_levels[level + 1];
+
+    barriers.begin_pass({ ComputeResource::image(c.pressure), ComputeResource::image(c.world_mask),
+                          ComputeResource::image(f.pressure), ComputeResource::image(f.world_mask) },
+                        { ComputeResource::image(f.pressure) });
+    c.pressure.use(1, 1);
+    c.world_mask.use(2, 2);
+    f.pressure.use(3, 3);
+    f.world_mask.use(4, 4);
+
+    fs_mg_prolong.use();
+    fs_mg_prolong.setFloat("accumulate", accumulate ? 1.0f : 0.0f);
+    fs_mg_prolong.setBool("fine_pooled", level == 0 && storage == FIELD_STORAGE_BRICK_POOL);
+
+    fs_mg_prolong.dispatch(f.width, f.height, f.depth);
+    barriers.end_pass();
+}
+
+FieldDifference field_difference(Engine &a, Engine &b) {
+    if (a.grid_width != b.grid_width || a.grid_height != b.grid_height || a.grid_depth != b.grid_depth) {
+        std::cout << "ERROR::FLUIDSIM::FIELD DIFFERENCE OF ENGINES ON DIFFERENT GRIDS" << std::endl;
+        return { -1.0f, -1.0f, -1.0f, -1.0f, -1.0f };
+    }
+
+    auto max_difference = [&](Texture3D &field_a, Texture3D &field_b, GLenum format, int channels) {
+        Engine *engines[2] = { &a, &b };
+        Texture3D *fields[2] = { &field_a, &field_b };
+        std::vector<float> cells[2];
+
+        for (int i = 0; i < 2; i++) {
+            Texture3D &texture = engines[i]->dense_view(*fields[i]);
+            engines[i]->barriers.flush(GL_TEXTURE_UPDATE_BARRIER_BIT);
+            cells[i].resize((size_t) texture.width * texture.height * texture.depth * channels);
+            glGetTextureImage(texture.id, 0, format, GL_FLOAT, cells[i].size() * sizeof(float), cells[i].data());
+        }
+
+        float difference = 0.0f;
+        for (size_t i = 0; i < cells[0].size(); i++) {
+            difference = std::max(difference, std::fabs(cells[0][i] - cells[1][i]));
+        }
+        return difference;
+    };
 
-    glDispatchCompute((GLuint) grid_width, (GLuint) grid_height, (GLuint) grid_depth);
-    glMemoryBarrier(GL_ALL_BARRIER_BITS);
+    FieldDifference difference;
+    difference.velocity = max_difference(a.u.front, b.u.front, GL_RGB, 3);
+    difference.quantity = max_difference(a.q.front, b.q.front, GL_RGBA, 4);
+    difference.temperature = max_difference(a.temp.front, b.temp.front, GL_RED, 1);
+    difference.pressure = max_difference(a.pressure(), b.pressure(), GL_RED, 1);
+    difference.world_mask = max_difference(a.world_mask.front, b.world_mask.front, GL_RED, 1);
+    return difference;
 }
 
 }
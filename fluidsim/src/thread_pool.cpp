@@ -0,0 +1,104 @@
+#include "fluidsim/thread_pool.h"
+
+using namespace Fluidsim;
+
+ThreadPool::ThreadPool(unsigned thread_count) {
+    thread_count = thread_count == 0 ? 1 : thread_count;
+    for (unsigned i = 0; i < thread_count; i++) {
+        queues.push_back(std::make_unique<Queue>());
+    }
+
+    // WORKER 0 IS WHOEVER CALLS PARALLEL_FOR
+    for (unsigned i = 1; i < thread_count; i++) {
+        threads.emplace_back(&ThreadPool::worker, this, i);
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (std::thread &thread : threads) {
+        thread.join();
+    }
+}
+
+void ThreadPool::parallel_for(int begin, int end, int grain, const std::function<void(int, int)> &fn) {
+    if (end <= begin) {
+        return;
+    }
+    grain = grain < 1 ? 1 : grain;
+
+    // DEAL THE CHUNKS ROUND ROBIN, EACH CARRIES THE FUNCTION SO A LATE STEALER CAN'T MIX UP LOOPS
+    int chunks = (end - begin + grain - 1) / grain;
+    remaining = chunks;
+    for (int i = 0; i < chunks; i++) {
+        int chunk_begin = begin + i * grain;
+        int chunk_end = chunk_begin + grain < end ? chunk_begin + grain : end;
+
+        Queue &queue = *queues[i % queues.size()];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        queue.tasks.push_back({ chunk_begin, chunk_end, &fn });
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        generation++;
+    }
+    wake.notify_all();
+
+    while (run_one(0)) {}
+
+    // OTHER WORKERS MAY STILL BE FINISHING THE LAST CHUNKS
+    std::unique_lock<std::mutex> lock(mutex);
+    finished.wait(lock, [this]() { return remaining.load() == 0; });
+}
+
+void ThreadPool::worker(unsigned index) {
+    uint64_t seen = 0;
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            wake.wait(lock, [&]() { return stopping || generation != seen; });
+            if (stopping) return;
+            seen = generation;
+        }
+
+        while (run_one(index)) {}
+    }
+}
+
+bool ThreadPool::run_one(unsigned index) {
+    Task task = { 0, 0, nullptr };
+
+    // OWN QUEUE FROM THE FRONT, THEN STEAL FROM THE BACK OF THE OTHERS
+    for (size_t i = 0; i < queues.size() && !task.fn; i++) {
+        Queue &queue = *queues[(index + i) % queues.size()];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (queue.tasks.empty()) {
+            continue;
+        }
+
+        if (i == 0) {
+            task = queue.tasks.front();
+            queue.tasks.pop_front();
+        } else {
+            task = queue.tasks.back();
+            queue.tasks.pop_back();
+        }
+    }
+
+    if (!task.fn) {
+        return false;
+    }
+
+    (*task.fn)(task.begin, task.end);
+
+    if (--remaining == 0) {
+        std::lock_guard<std::mutex> lock(mutex);
+        finished.notify_all();
+    }
+    return true;
+}
@@ -0,0 +1,359 @@
+#include <glad/glad.h>
+
+#define STB_IMAGE_IMPLEMENTATION
+#include <stb_image.h>
+
+#include <glm/glm.hpp>
+#include <nlohmann/json.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "engine/headless.h"
+#include "engine/gpu_profiler.h"
+#include "engine/texture.h"
+
+#include <fluidsim/fluidsim.h>
+
+using json = nlohmann::json;
+
+//
+// Times Fluidsim::Engine steps over a sweep of grid sizes and pressure
+// solvers without a window, and writes per-stage percentiles to a
+// directory:
+//
+//   fluidsim_bench [--sizes 32,64,128] [--solvers jacobi,vcycle,fmg]
+//                  [--backend gpu|cpu] [--warmup N] [--steps N]
+//                  [--tolerance T] [--cross-check] [--out DIR]
+//
+// Stages are the GpuProfiler zones of Engine::step, summed over a step.
+// "total" is the wall clock time of a step run to completion with
+// glFinish. Results go to results.json and results.csv. --cross-check
+// steps a second engine on the other backend after every timed step and
+// records the largest field difference over the measured steps, for the
+// jacobi runs only since the CPU backend has no multigrid
+//
+struct BenchOptions {
+    std::vector<uint32_t> sizes = { 32, 64, 128 };
+    std::vector<std::string> solvers = { "jacobi", "vcycle" };
+    std::string out = "bench_out";
+    Fluidsim::Backend backend = Fluidsim::BACKEND_GPU;
+    int warmup = 5;
+    int steps = 30;
+    float tolerance = -1.0f;        // < 0 keeps the engine's default
+    bool cross_check = false;
+    float size = 150.0f;
+    float dt = 1.0f / 60.0f;
+};
+
+static const std::map<std::string, Fluidsim::PressureSolver> SOLVERS = {
+    { "jacobi", Fluidsim::PRESSURE_SOLVER_JACOBI },
+    { "vcycle", Fluidsim::PRESSURE_SOLVER_MULTIGRID_V_CYCLE },
+    { "fmg", Fluidsim::PRESSURE_SOLVER_MULTIGRID_FMG },
+};
+
+static std::vector<std::string> split(const std::string &list) {
+    std::vector<std::string> items;
+    std::stringstream stream(list);
+    std::string item;
+    while (std::getline(stream, item, ',')) {
+        if (!item.empty()) items.push_back(item);
+    }
+    return items;
+}
+
+static bool parse_options(int argc, char **argv, BenchOptions &options) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+
+        if (arg == "--sizes" && has_value) {
+            options.sizes.clear();
+            for (const std::string &size : split(argv[++i])) {
+                options.sizes.push_back(std::stoul(size));
+            }
+        } else if (arg == "--solvers" && has_value) {
+            options.solvers = split(argv[++i]);
+            for (const std::string &solver : options.solvers) {
+                if (!SOLVERS.count(solver)) return false;
+            }
+        } else if (arg == "--backend" && has_value) {
+            std::string backend = argv[++i];
+            if (backend != "gpu" && backend != "cpu") return false;
+            options.backend = backend == "cpu" ? Fluidsim::BACKEND_CPU : Fluidsim::BACKEND_GPU;
+        } else if (arg == "--warmup" && has_value) {
+            options.warmup = std::stoi(argv[++i]);
+        } else if (arg == "--steps" && has_value) {
+            options.steps = std::stoi(argv[++i]);
+        } else if (arg == "--tolerance" && has_value) {
+            options.tolerance = std::stof(argv[++i]);
+        } else if (arg == "--cross-check") {
+            options.cross_check = true;
+        } else if (arg == "--out" && has_value) {
+            options.out = argv[++i];
+        } else {
+            return false;
+        }
+    }
+    return !options.sizes.empty() && !options.solvers.empty() && options.steps > 0 && options.warmup >= 0;
+}
+
+//
+// Masks of a fixed set of obstacles, placed relative to the grid so every
+// size sees the same scene: a hot sphere moving sideways, a cold sphere
+// moving down and a static wall
+//
+struct SyntheticObstacles {
+    Texture3D solid, velocity, temperature;
+
+    SyntheticObstacles(uint32_t n) {
+        std::vector<float> solid_data((size_t) n * n * n * 4, 0.0f);
+        std::vector<float> velocity_data(solid_data.size(), 0.0f);
+        std::vector<float> temperature_data(solid_data.size(), 0.0f);
+
+        struct Sphere {
+            glm::vec3 center;
+            float radius;
+            glm::vec3 velocity;
+            float temperature;
+        };
+        const Sphere spheres[] = {
+            { glm::vec3(0.3f, 0.35f, 0.5f), 0.12f, glm::vec3(4.0f, 0.0f, 0.0f), 293.15f + 600.0f },
+            { glm::vec3(0.7f, 0.6f, 0.4f), 0.1f, glm::vec3(0.0f, -3.0f, 2.0f), 293.15f },
+        };
+        const glm::vec3 wall_least(0.45f, 0.1f, 0.2f), wall_most(0.55f, 0.3f, 0.8f);
+
+        for (uint32_t z = 0; z < n; z++) {
+            for (uint32_t y = 0; y < n; y++) {
+                for (uint32_t x = 0; x < n; x++) {
+                    glm::vec3 p = (glm::vec3(x, y, z) + 0.5f) / (float) n;
+                    size_t i = 4 * (x + (size_t) n * (y + (size_t) n * z));
+
+                    bool in_wall = p.x >= wall_least.x && p.y >= wall_least.y && p.z >= wall_least.z &&
+                                   p.x <= wall_most.x && p.y <= wall_most.y && p.z <= wall_most.z;
+                    if (in_wall) {
+                        solid_data[i + 3] = 1.0f;
+                        temperature_data[i] = 293.15f;
+                    }
+
+                    for (const Sphere &sphere : spheres) {
+                        if (glm::length(p - sphere.center) <= sphere.radius) {
+                            solid_data[i + 3] = 1.0f;
+                            velocity_data[i + 0] = sphere.velocity.x;
+                            velocity_data[i + 1] = sphere.velocity.y;
+                            velocity_data[i + 2] = sphere.velocity.z;
+                            temperature_data[i] = sphere.temperature;
+                        }
+                    }
+                }
+            }
+        }
+
+        solid = Texture3D(n, n, n, 0, solid_data, GL_NEAREST);
+        velocity = Texture3D(n, n, n, 0, velocity_data, GL_NEAREST);
+        temperature = Texture3D(n, n, n, 0, temperature_data, GL_NEAREST);
+    }
+};
+
+//
+// Nearest rank percentile of a sorted list
+//
+static double percentile(const std::vector<double> &sorted, double p) {
+    if (sorted.empty()) {
+        return 0.0;
+    }
+    size_t rank = (size_t) std::ceil(p * sorted.size());
+    return sorted[std::min(std::max(rank, (size_t) 1), sorted.size()) - 1];
+}
+
+struct StageSamples {
+    std::vector<double> ms;         // One sample per measured step
+    uint32_t calls = 0;             // Over all measured steps
+};
+
+int main(int argc, char **argv)
+{
+    BenchOptions options;
+    if (!parse_options(argc, argv, options)) {
+        std::cout << "usage: fluidsim_bench [--sizes 32,64,128] [--solvers jacobi,vcycle,fmg] [--backend gpu|cpu]"
+                     " [--warmup N] [--steps N] [--tolerance T] [--cross-check] [--out DIR]" << std::endl;
+        return 1;
+    }
+
+    //
+    // Set up context, no window or imgui
+    //
+    HeadlessContext context;
+    std::cout << "OpenGL " << glGetString(GL_VERSION) << " on " << glGetString(GL_RENDERER) << std::endl;
+
+    std::error_code error;
+    std::filesystem::create_directories(options.out, error);
+    if (error) {
+        std::cout << "ERROR::BENCH::FAILED TO CREATE " << options.out << std::endl;
+        return 1;
+    }
+
+    GpuProfiler profiler;
+    profiler.enabled = true;
+
+    json runs = json::array();
+    std::ofstream csv(options.out + "/results.csv");
+    csv << "size,solver,backend,stage,calls_per_step,mean_ms,p50_ms,p95_ms,p99_ms" << std::endl;
+
+    // SIZES RUN IN THE ORDER GIVEN, ONE ENGINE EACH, FREED BEFORE THE NEXT ONE IS BUILT
+    for (uint32_t n : options.sizes) {
+        for (const std::string &solver : options.solvers) {
+            float scl = options.size / (float) n;
+            Fluidsim::Engine fs(n, n, n, scl, scl, scl, SOLVERS.at(solver));
+            fs.backend = options.backend;
+            fs.adaptive_timestep = false;
+            if (options.tolerance >= 0.0f) {
+                fs.pressure_tolerance = options.tolerance;
+            }
+
+            // THE REFERENCE STARTS FROM THE SAME STATE AND SEES THE SAME OBSTACLES
+            std::unique_ptr<Fluidsim::Engine> reference;
+            if (options.cross_check && SOLVERS.at(solver) == Fluidsim::PRESSURE_SOLVER_JACOBI) {
+                reference = std::make_unique<Fluidsim::Engine>(n, n, n, scl, scl, scl, SOLVERS.at(solver));
+                reference->backend = options.backend == Fluidsim::BACKEND_CPU ? Fluidsim::BACKEND_GPU : Fluidsim::BACKEND_CPU;
+                reference->adaptive_timestep = false;
+                reference->pressure_tolerance = fs.pressure_tolerance;
+            }
+            Fluidsim::FieldDifference max_difference = { 0.0f, 0.0f, 0.0f, 0.0f, 0.0f };
+
+            SyntheticObstacles obstacles(n);
+
+            std::map<std::string, StageSamples> stages;
+            std::vector<std::string> stage_order = { "total" };
+            std::vector<double> iterations;
+
+            for (int step = 0; step < options.warmup + options.steps; step++) {
+                bool measured = step >= options.warmup;
+
+                // EVERY STEP RESOLVES BEFORE THE NEXT STARTS, SO THE PROFILER NEVER SKIPS ONE
+                glFinish();
+                profiler.begin_frame();
+                auto start = std::chrono::steady_clock::now();
+
+                fs.step(options.dt, &obstacles.solid, &obstacles.velocity, &obstacles.temperature);
+
+                profiler.end_frame();
+                glFinish();
+                double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+                profiler.wait();
+
+                // OUTSIDE THE PROFILED FRAME, SO THE REFERENCE ADDS NOTHING TO THE STAGES
+                if (reference) {
+                    reference->step(options.dt, &obstacles.solid, &obstacles.velocity, &obstacles.temperature);
+                    if (measured) {
+                        Fluidsim::FieldDifference difference = Fluidsim::field_difference(fs, *reference);
+                        max_difference.velocity = std::max(max_difference.velocity, difference.velocity);
+                        max_difference.quantity = std::max(max_difference.quantity, difference.quantity);
+                        max_difference.temperature = std::max(max_difference.temperature, difference.temperature);
+                        max_difference.pressure = std::max(max_difference.pressure, difference.pressure);
+                        max_difference.world_mask = std::max(max_difference.world_mask, difference.world_mask);
+                    }
+                }
+
+                if (!measured) {
+                    continue;
+                }
+
+                stages["total"].ms.push_back(ms);
+                stages["total"].calls++;
+                iterations.push_back(fs.pressure_stats.iterations);
+
+                std::map<std::string, double> step_ms;
+                for (const GpuZoneTiming &zone : profiler.latest_frame()) {
+                    if (!stages.count(zone.name)) {
+                        stage_order.push_back(zone.name);
+                    }
+                    step_ms[zone.name] += zone.end_ms - zone.start_ms;
+                    stages[zone.name].calls++;
+                }
+                for (auto &stage : step_ms) {
+                    stages[stage.first].ms.push_back(stage.second);
+                }
+            }
+
+            //
+            // Percentiles per stage. A stage that is skipped in some steps
+            // (e.g. residual checks) only counts the steps it ran in
+            //
+            json stage_results = json::object();
+            for (const std::string &name : stage_order) {
+                StageSamples &samples = stages[name];
+                std::sort(samples.ms.begin(), samples.ms.end());
+
+                double mean = 0.0;
+                for (double ms : samples.ms) mean += ms;
+                mean /= std::max<size_t>(samples.ms.size(), 1);
+
+                double calls_per_step = (double) samples.calls / options.steps;
+                double p50 = percentile(samples.ms, 0.50), p95 = percentile(samples.ms, 0.95), p99 = percentile(samples.ms, 0.99);
+
+                stage_results[name] = { { "calls_per_step", calls_per_step }, { "mean_ms", mean }, { "p50_ms", p50 }, { "p95_ms", p95 }, { "p99_ms", p99 } };
+                csv << n << "," << solver << "," << (options.backend == Fluidsim::BACKEND_CPU ? "cpu" : "gpu") << "," << name << ","
+                    << calls_per_step << "," << mean << "," << p50 << "," << p95 << "," << p99 << std::endl;
+            }
+
+            double mean_iterations = 0.0;
+            for (double it : iterations) mean_iterations += it;
+            mean_iterations /= iterations.size();
+
+            runs.push_back({
+                { "size", n },
+                { "solver", solver },
+                { "mean_pressure_iterations", mean_iterations },
+                { "stages", stage_results },
+            });
+
+            std::cout << n << "^3 " << solver << ": p50 " << stage_results["total"]["p50_ms"] << " ms, p95 "
+                      << stage_results["total"]["p95_ms"] << " ms, p99 " << stage_results["total"]["p99_ms"] << " ms per step" << std::endl;
+
+            if (reference) {
+                runs.back()["max_difference"] = {
+                    { "velocity", max_difference.velocity },
+                    { "quantity", max_difference.quantity },
+                    { "temperature", max_difference.temperature },
+                    { "pressure", max_difference.pressure },
+                    { "world_mask", max_difference.world_mask },
+                };
+                std::cout << n << "^3 " << solver << ": largest difference to the " << (reference->backend == Fluidsim::BACKEND_CPU ? "cpu" : "gpu")
+                          << " backend: velocity " << max_difference.velocity << ", quantity " << max_difference.quantity
+                          << ", temperature " << max_difference.temperature << ", pressure " << max_difference.pressure
+                          << ", world mask " << max_difference.world_mask << std::endl;
+            } else if (options.cross_check) {
+                std::cout << n << "^3 " << solver << ": not cross-checked, the cpu backend only runs jacobi" << std::endl;
+            }
+        }
+    }
+
+    json results;
+    results["renderer"] = (const char *) glGetString(GL_RENDERER);
+    results["version"] = (const char *) glGetString(GL_VERSION);
+    results["backend"] = options.backend == Fluidsim::BACKEND_CPU ? "cpu" : "gpu";
+    results["warmup"] = options.warmup;
+    results["steps"] = options.steps;
+    results["dt"] = options.dt;
+    results["runs"] = runs;
+
+    std::ofstream json_file(options.out + "/results.json");
+    json_file << results.dump(4) << std::endl;
+    if (!json_file || !csv) {
+        std::cout << "ERROR::BENCH::FAILED TO WRITE RESULTS TO " << options.out << std::endl;
+        return 1;
+    }
+
+    std::cout << "Results written to " << options.out << std::endl;
+    return 0;
+}
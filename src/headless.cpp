@@ -0,0 +1,315 @@
+#include <glad/glad.h>
+
+#define STB_IMAGE_IMPLEMENTATION
+#include <stb_image.h>
+
+#include <glm/glm.hpp>
+#include <nlohmann/json.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "engine/headless.h"
+#include "engine/camera.h"
+#include "engine/fsrender.h"
+#include "engine/kernel.h"
+#include "engine/model.h"
+#include "engine/physics.h"
+#include "engine/scene.h"
+#include "engine/texture.h"
+#include "engine/vertex.h"
+
+#include <fluidsim/fluidsim.h>
+
+using json = nlohmann::json;
+
+//
+// Runs the fluid simulation of a scene for a fixed number of steps without
+// a window, and writes the final fields and per-step timings to a
+// directory:
+//
+//   fluidsim_headless [scene.json] [--steps N] [--dt SECONDS] [--grid N]
+//                     [--size METERS] [--backend gpu|cpu] [--physics]
+//                     [--storage dense|pool] [--write-every N] [--cross-check]
+//                     [--out DIR]
+//
+// Every field is written as raw little endian float32, x fastest, then y,
+// then z, with the channel count listed in run.json. --cross-check steps a
+// second engine on the other backend with the same masks, outside the
+// timed part of each step, and records the largest field difference
+// between the two after every step
+//
+struct HeadlessOptions {
+    std::string scene = "src/scenes/test.json";
+    std::string out = "headless_out";
+    int steps = 60;
+    float dt = 1.0f / 60.0f;
+    uint32_t grid = 32;
+    float size = 150.0f;
+    Fluidsim::Backend backend = Fluidsim::BACKEND_GPU;
+    Fluidsim::FieldStorage storage = Fluidsim::FIELD_STORAGE_DENSE;
+    bool physics = false;
+    int write_every = 0;
+    bool cross_check = false;
+};
+
+static bool parse_options(int argc, char **argv, HeadlessOptions &options) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+
+        if (arg == "--steps" && has_value) {
+            options.steps = std::stoi(argv[++i]);
+        } else if (arg == "--dt" && has_value) {
+            options.dt = std::stof(argv[++i]);
+        } else if (arg == "--grid" && has_value) {
+            options.grid = std::stoul(argv[++i]);
+        } else if (arg == "--size" && has_value) {
+            options.size = std::stof(argv[++i]);
+        } else if (arg == "--backend" && has_value) {
+            std::string backend = argv[++i];
+            if (backend != "gpu" && backend != "cpu") return false;
+            options.backend = backend == "cpu" ? Fluidsim::BACKEND_CPU : Fluidsim::BACKEND_GPU;
+        } else if (arg == "--storage" && has_value) {
+            std::string storage = argv[++i];
+            if (storage != "dense" && storage != "pool") return false;
+            options.storage = storage == "pool" ? Fluidsim::FIELD_STORAGE_BRICK_POOL : Fluidsim::FIELD_STORAGE_DENSE;
+        } else if (arg == "--physics") {
+            options.physics = true;
+        } else if (arg == "--write-every" && has_value) {
+            options.write_every = std::stoi(argv[++i]);
+        } else if (arg == "--cross-check") {
+            options.cross_check = true;
+        } else if (arg == "--out" && has_value) {
+            options.out = argv[++i];
+        } else if (arg.rfind("--", 0) != 0) {
+            options.scene = arg;
+        } else {
+            return false;
+        }
+    }
+    return options.steps >= 0 && options.grid > 0 && options.dt > 0.0f;
+}
+
+//
+// Writes channels floats per cell of a field and returns its entry for
+// run.json
+//
+static json write_field(const std::string &path, Fluidsim::Engine &fs, Texture3D &field, GLenum format, int channels) {
+    Texture3D &texture = fs.dense_view(field);
+    fs.barriers.flush(GL_TEXTURE_UPDATE_BARRIER_BIT);
+
+    std::vector<float> data((size_t) texture.width * texture.height * texture.depth * channels);
+    glGetTextureImage(texture.id, 0, format, GL_FLOAT, data.size() * sizeof(float), data.data());
+
+    std::ofstream file(path, std::ios::binary);
+    file.write((const char *) data.data(), data.size() * sizeof(float));
+    if (!file) {
+        std::cout << "ERROR::HEADLESS::FAILED TO WRITE " << path << std::endl;
+    }
+
+    return { { "file", std::filesystem::path(path).filename().string() }, { "channels", channels } };
+}
+
+static json write_fields(const std::string &dir, const std::string &suffix, Fluidsim::Engine &fs) {
+    json fields;
+    fields["pressure"] = write_field(dir + "/pressure" + suffix + ".raw", fs, fs.pressure(), GL_RED, 1);
+    fields["velocity"] = write_field(dir + "/velocity" + suffix + ".raw", fs, fs.u.front, GL_RGB, 3);
+    fields["temperature"] = write_field(dir + "/temperature" + suffix + ".raw", fs, fs.temp.front, GL_RED, 1);
+    fields["quantity"] = write_field(dir + "/quantity" + suffix + ".raw", fs, fs.q.front, GL_RGBA, 4);
+    fields["world_mask"] = write_field(dir + "/world_mask" + suffix + ".raw", fs, fs.world_mask.front, GL_RED, 1);
+    return fields;
+}
+
+static json difference_json(const Fluidsim::FieldDifference &difference) {
+    return {
+        { "velocity", difference.velocity },
+        { "quantity", difference.quantity },
+        { "temperature", difference.temperature },
+        { "pressure", difference.pressure },
+        { "world_mask", difference.world_mask },
+    };
+}
+
+int main(int argc, char **argv)
+{
+    HeadlessOptions options;
+    if (!parse_options(argc, argv, options)) {
+        std::cout << "usage: fluidsim_headless [scene.json] [--steps N] [--dt SECONDS] [--grid N] [--size METERS]"
+                     " [--backend gpu|cpu] [--physics] [--storage dense|pool] [--write-every N] [--cross-check] [--out DIR]" << std::endl;
+        return 1;
+    }
+
+    uint32_t grid_width = options.grid, grid_height = options.grid, grid_depth = options.grid;
+    float dim_x = options.size, dim_y = options.size, dim_z = options.size;
+    float scl_x = dim_x / (float) grid_width;
+    float scl_y = dim_y / (float) grid_height;
+    float scl_z = dim_z / (float) grid_depth;
+
+    //
+    // Set up context, no window or imgui
+    //
+    HeadlessContext context;
+    std::cout << "OpenGL " << glGetString(GL_VERSION) << " on " << glGetString(GL_RENDERER) << std::endl;
+
+    std::error_code error;
+    std::filesystem::create_directories(options.out, error);
+    if (error) {
+        std::cout << "ERROR::HEADLESS::FAILED TO CREATE " << options.out << std::endl;
+        return 1;
+    }
+
+    Physics *physics = new Physics();
+
+    VertexBuffer vertex_buffer;
+    Scene scene(options.scene, &vertex_buffer);
+    vertex_buffer.buffer_data();
+
+    //
+    // Init Fluidsim
+    //
+    Fluidsim::Engine fs(grid_width, grid_height, grid_depth, scl_x, scl_y, scl_z, Fluidsim::PRESSURE_SOLVER_JACOBI,
+                        Fluidsim::FieldFormats(), options.storage);
+    fs.backend = options.backend;
+    Physics::instance->fs = &fs;
+
+    // THE REFERENCE ONLY FOLLOWS THE MASKS, THE BODIES ARE MOVED BY FS'S SURFACE FORCES
+    std::unique_ptr<Fluidsim::Engine> reference;
+    if (options.cross_check) {
+        reference = std::make_unique<Fluidsim::Engine>(grid_width, grid_height, grid_depth, scl_x, scl_y, scl_z,
+                                                       Fluidsim::PRESSURE_SOLVER_JACOBI, Fluidsim::FieldFormats(), options.storage);
+        reference->backend = options.backend == Fluidsim::BACKEND_CPU ? Fluidsim::BACKEND_GPU : Fluidsim::BACKEND_CPU;
+    }
+
+    // ONLY THE MASK OVERLAY OF THE DEBUG RENDERER IS USED, IT IS NEVER DRAWN
+    Camera camera(0.0f, 0.0f, 3.0f);
+    glm::vec3 grid_offset = glm::vec3(0.0f, 0.0f, 0.0f);
+    FluidDebugRenderer fsdebug(&camera, 10.0f, 5.0f, -10.0f, grid_offset, {dim_x, dim_y, dim_z});
+
+    std::vector<Mask> mesh_masks = scene.get_mesh_masks({scl_x, scl_y, scl_z});
+
+    Texture3D output_solid_mask(grid_width, grid_height, grid_depth, 0, GL_NEAREST);
+    Texture3D output_velocity_mask(grid_width, grid_height, grid_depth, 0, GL_NEAREST);
+    Texture3D output_temperature_mask(grid_width, grid_height, grid_depth, 0, GL_NEAREST);
+    output_solid_mask.clear(0.0f);
+    output_velocity_mask.clear(0.0f);
+    output_temperature_mask.clear(0.0f);
+
+    //
+    // Mask passes, the same as the interactive build's except that the
+    // bodies' velocities are not jittered, so runs are reproducible
+    //
+    ComputeGraph mask_graph(&fs.barriers);
+
+    mask_graph.add("overlay_masks", {},
+        { ComputeResource::image(output_solid_mask), ComputeResource::image(output_velocity_mask), ComputeResource::image(output_temperature_mask) },
+        [&]() {
+            std::vector<MaskBody> bodies;
+            for (Mask &mask : mesh_masks) {
+                bodies.push_back(FluidDebugRenderer::mask_body(mask, mask.parent->physics_obj->get_velocity(), 293.15f + 600.0f));
+            }
+            fsdebug.overlay_masks(bodies, &output_solid_mask, &output_velocity_mask, &output_temperature_mask);
+        });
+
+    //
+    // Step loop, every step is timed to completion
+    //
+    json steps = json::array();
+    json snapshots = json::array();
+    double total_ms = 0.0;
+    Fluidsim::FieldDifference max_difference = { 0.0f, 0.0f, 0.0f, 0.0f, 0.0f };
+
+    for (int step = 0; step < options.steps; step++) {
+        auto start = std::chrono::steady_clock::now();
+
+        if (options.physics) {
+            std::vector<Model> models = scene.get_models();
+            std::vector<Fluidsim::SurfaceBody> bodies;
+            for (Model &model : models) {
+                bodies.push_back(model.surface_body(fs, model.model()));
+            }
+            fs.integrate_surface_forces(bodies, grid_offset);
+
+            const Fluidsim::SurfaceForce *forces = fs.latest_surface_forces();
+            for (size_t i = 0; forces && i < models.size() && i < (size_t) Fluidsim::MAX_SURFACE_BODIES; i++) {
+                models[i].apply_surface_force(forces[i]);
+            }
+        }
+
+        mask_graph.replay();
+        fs.step(options.dt, &output_solid_mask, &output_velocity_mask, &output_temperature_mask);
+
+        if (options.physics) {
+            physics->tick(options.dt);
+        }
+
+        glFinish();
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        total_ms += ms;
+
+        steps.push_back({
+            { "ms", ms },
+            { "pressure_iterations", fs.pressure_stats.iterations },
+            { "residual_l2", fs.pressure_stats.residual_l2 },
+            { "residual_linf", fs.pressure_stats.residual_linf },
+            { "field_bytes", fs.field_memory() },
+        });
+
+        // THE MASKS WERE WRITTEN UNDER FS'S BARRIERS, THE REFERENCE DOES NOT TRACK THEM
+        if (reference) {
+            fs.barriers.flush();
+            reference->step(options.dt, &output_solid_mask, &output_velocity_mask, &output_temperature_mask);
+
+            Fluidsim::FieldDifference difference = Fluidsim::field_difference(fs, *reference);
+            max_difference.velocity = std::max(max_difference.velocity, difference.velocity);
+            max_difference.quantity = std::max(max_difference.quantity, difference.quantity);
+            max_difference.temperature = std::max(max_difference.temperature, difference.temperature);
+            max_difference.pressure = std::max(max_difference.pressure, difference.pressure);
+            max_difference.world_mask = std::max(max_difference.world_mask, difference.world_mask);
+            steps.back()["difference"] = difference_json(difference);
+        }
+
+        if (options.write_every > 0 && (step + 1) % options.write_every == 0 && step + 1 < options.steps) {
+            json snapshot = write_fields(options.out, "_" + std::to_string(step + 1), fs);
+            snapshots.push_back({ { "step", step + 1 }, { "fields", snapshot } });
+        }
+    }
+
+    //
+    // Write the final fields and the run summary
+    //
+    json run;
+    run["scene"] = options.scene;
+    run["renderer"] = (const char *) glGetString(GL_RENDERER);
+    run["backend"] = options.backend == Fluidsim::BACKEND_CPU ? "cpu" : "gpu";
+    run["storage"] = options.storage == Fluidsim::FIELD_STORAGE_BRICK_POOL ? "pool" : "dense";
+    run["grid"] = { grid_width, grid_height, grid_depth };
+    run["cell_size"] = { scl_x, scl_y, scl_z };
+    run["dt"] = options.dt;
+    run["steps"] = steps;
+    run["total_ms"] = total_ms;
+    run["mean_ms"] = options.steps > 0 ? total_ms / options.steps : 0.0;
+    run["fields"] = write_fields(options.out, "", fs);
+    run["snapshots"] = snapshots;
+    if (reference) {
+        run["max_difference"] = difference_json(max_difference);
+    }
+
+    std::ofstream run_file(options.out + "/run.json");
+    run_file << run.dump(4) << std::endl;
+
+    std::cout << options.steps << " steps in " << total_ms << " ms, written to " << options.out << std::endl;
+    if (reference) {
+        std::cout << "Largest difference to the " << (reference->backend == Fluidsim::BACKEND_CPU ? "cpu" : "gpu")
+                  << " backend: velocity " << max_difference.velocity << ", quantity " << max_difference.quantity
+                  << ", temperature " << max_difference.temperature << ", pressure " << max_difference.pressure
+                  << ", world mask " << max_difference.world_mask << std::endl;
+    }
+    return 0;
+}
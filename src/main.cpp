@@ -10,6 +10,7 @@
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtc/type_ptr.hpp>
 
+#include <string>
 #include <vector>
 
 #include "engine/shader.h"
@@ -25,6 +26,8 @@
 #include "engine/scene.h"
 #include "engine/framebuffer.h"
 #include "engine/debug.h"
+#include "engine/gpu_profiler.h"
+#include "engine/trace.h"
 
 #include <fluidsim/fluidsim.h>
 #include "engine/kernel.h"
@@ -36,8 +39,27 @@ Model construct_sphere(VertexBuffer *, float, int, int, MeshShaderType);
 const unsigned int SCR_WIDTH = 800;
 const unsigned int SCR_HEIGHT = 600;
 
-int main()
+//
+// fluidsim [--trace-frames N] [--trace-out FILE]
+//
+// --trace-frames captures a Chrome trace of the first N frames, including
+// loading the scene. F9 starts and stops a capture at any time
+//
+int main(int argc, char **argv)
 {
+    int trace_frames = 0;
+    std::string trace_out = "trace.json";
+    for (int i = 1; i + 1 < argc; i += 2) {
+        std::string arg = argv[i];
+        if (arg == "--trace-frames") {
+            trace_frames = std::stoi(argv[i + 1]);
+        } else if (arg == "--trace-out") {
+            trace_out = argv[i + 1];
+        } else {
+            std::cout << "ERROR::MAIN::UNKNOWN OPTION " << arg << std::endl;
+        }
+    }
+
     uint32_t grid_width = 32, grid_height = 32, grid_depth = 32;
     float dim_x = 150.0f, dim_y = 150.0f, dim_z = 150.0f;
     float scl_x = dim_x / (float) grid_width;
@@ -62,12 +84,29 @@ int main()
     //glfwSwapInterval(0);
 
     Physics *physics = new Physics();
-    VertexBuffer::init_pbos(grid_width, grid_height, grid_depth);
 
     //
     // Set up imgui instance
     //
     ImGuiInstance imgui_instance(window.window, &camera.position);
+
+    //
+    // Set up GPU profiler, shown in its own imgui window while enabled
+    //
+    GpuProfiler gpu_profiler;
+
+    //
+    // Set up trace capture, fed with the CPU zones and every frame the GPU
+    // profiler resolves
+    //
+    TraceRecorder trace;
+    trace.capture_path = trace_out;
+    gpu_profiler.on_resolve = [&](const GpuProfiler &profiler) {
+        trace.add_gpu_frame(profiler);
+    };
+    if (trace_frames > 0) {
+        trace.start(trace_out, trace_frames);
+    }
     
     Framebuffer fb(window.window);
     fb.add_color_attachment();
@@ -95,13 +134,39 @@ int main()
     glm::vec3 grid_offset = glm::vec3(0.0f, 0.0f, 0.0f);
     FluidDebugRenderer fsdebug(&camera, 10.0f, 5.0f, -10.0f, grid_offset, {dim_x, dim_y, dim_z});    
 
-    std::vector<Mask> mesh_masks = scene.get_mesh_masks();
+    std::vector<Mask> mesh_masks = scene.get_mesh_masks({scl_x, scl_y, scl_z});
     
-    Texture3D output_solid_mask(grid_width, grid_height, grid_depth, 0, Texture3D::zero(grid_width, grid_height, grid_depth), GL_NEAREST);
-    Texture3D output_velocity_mask(grid_width, grid_height, grid_depth, 0, Texture3D::zero(grid_width, grid_height, grid_depth), GL_NEAREST);
-    Texture3D output_temperature_mask(grid_width, grid_height, grid_depth, 0, Texture3D::zero(grid_width, grid_height, grid_depth), GL_NEAREST);
+    Texture3D output_solid_mask(grid_width, grid_height, grid_depth, 0, GL_NEAREST);
+    Texture3D output_velocity_mask(grid_width, grid_height, grid_depth, 0, GL_NEAREST);
+    Texture3D output_temperature_mask(grid_width, grid_height, grid_depth, 0, GL_NEAREST);
+    output_solid_mask.clear(0.0f);
+    output_velocity_mask.clear(0.0f);
+    output_temperature_mask.clear(0.0f);
 
-    Texture3D zero = Texture3D(grid_width, grid_height, grid_depth, 5, Texture3D::zero(grid_width, grid_height, grid_depth));
+    //
+    // Mask passes, recorded once and replayed every frame. They share the
+    // fluid engine's barrier tracking, so only dependent passes are ordered
+    //
+    ComputeGraph mask_graph(&fs.barriers);
+
+    // Stick every object in the worldview into the world, velocity and temperature masks at once
+    mask_graph.add("overlay_masks", {},
+        { ComputeResource::image(output_solid_mask), ComputeResource::image(output_velocity_mask), ComputeResource::image(output_temperature_mask) },
+        [&]() {
+            std::vector<MaskBody> bodies;
+            for (Mask &mask : mesh_masks) {
+                glm::vec3 velocity = mask.parent->physics_obj->get_velocity();
+                if (length(velocity) < 0.01f) {
+                    velocity = glm::vec3(
+                        0.1f * (static_cast <float> (rand()) / static_cast <float> (RAND_MAX) + 0.1f),
+                        0.1f * (static_cast <float> (rand()) / static_cast <float> (RAND_MAX) + 0.1f),
+                        0.1f * (static_cast <float> (rand()) / static_cast <float> (RAND_MAX) + 0.1f)
+                    );
+                }
+                bodies.push_back(FluidDebugRenderer::mask_body(mask, velocity, 293.15f + 600.0f));
+            }
+            fsdebug.overlay_masks(bodies, &output_solid_mask, &output_velocity_mask, &output_temperature_mask);
+        });
 
 
     //
@@ -124,6 +189,10 @@ int main()
     
     while (!window.should_close())
     {
+        trace.begin_frame();
+        gpu_profiler.enabled = ImGuiInstance::gpu_profiler || trace.capturing();
+        gpu_profiler.begin_frame();
+
         if (ImGuiInstance::msaa) {
             msfb.bind();
         } else {
@@ -147,90 +216,113 @@ int main()
         //model.model = glm::rotate(glm::mat4(1.0f), (float) glfwGetTime() * 0.02f, glm::vec3(0.0, 1.0, 0.0));
 
         glCheckError();
-        for (Model &model : scene.get_models()) {
-            //model.physics_obj->apply_force_to_center({0.0, 0.0, -1.0});
-            model.pressure_force(fs, 32, 2, grid_offset, model.model());
+
+        if (ImGuiInstance::gpu_pressure_forces) {
+            TraceZone zone("surface_forces");
+
+            // INTEGRATE EVERY MODEL'S PRESSURE FORCE IN ONE DISPATCH, AND APPLY THE NEWEST RESULTS THAT HAVE LANDED
+            std::vector<Model> models = scene.get_models();
+            std::vector<Fluidsim::SurfaceBody> bodies;
+            for (Model &model : models) {
+                bodies.push_back(model.surface_body(fs, model.model()));
+            }
+            fs.integrate_surface_forces(bodies, grid_offset);
+
+            const Fluidsim::SurfaceForce *forces = fs.latest_surface_forces();
+            for (size_t i = 0; forces && i < models.size() && i < (size_t) Fluidsim::MAX_SURFACE_BODIES; i++) {
+                models[i].apply_surface_force(forces[i]);
+            }
+        } else {
+            // READ BACK ONLY THE PRESSURE AROUND EACH MODEL, ONCE PER FRAME
+            std::vector<Model> models = scene.get_models();
+            std::vector<ReadbackRegion> regions;
+            float margin = 1.0001f * sqrt(scl_x * scl_x + scl_y * scl_y + scl_z * scl_z);
+            for (Model &model : models) {
+                glm::vec3 least, most;
+                model.sample_bounds(model.model(), margin, least, most);
+                regions.push_back(fs.region_around(least, most, grid_offset));
+            }
+            fs.read_regions(Fluidsim::READBACK_PRESSURE, regions);
+
+            // THE MODELS USE THE NEWEST COPY THAT HAS LANDED
+            const std::vector<ReadbackRegion> *landed = nullptr;
+            const float *pressure = fs.latest_regions(Fluidsim::READBACK_PRESSURE, &landed);
+            for (size_t i = 0; pressure && i < models.size() && i < landed->size(); i++) {
+                //model.physics_obj->apply_force_to_center({0.0, 0.0, -1.0});
+                models[i].pressure_force(fs, 32, 2, grid_offset, models[i].model(), pressure, (*landed)[i]);
+            }
+        }
+
+        {
+            GpuZone zone("scene_draw");
+            scene.draw(&camera);
         }
-        scene.draw(&camera);
 
         //
         // Fluid Simulation (TODO: move to scene.draw)
         //
-        zero.use(1, 1);
-        output_solid_mask.use(2, 2);
-        output_velocity_mask.use(3, 3);
-        output_temperature_mask.use(4, 4);
-
-        // Zero the World Mask
-        fs.fs_write_to.use();
-        fs.fs_write_to.setInt("q_in", 1);
-        fs.fs_write_to.setInt("q_out", 2);
-
-        glDispatchCompute((GLuint) grid_width, (GLuint) grid_height, (GLuint) grid_depth);
-
-        // Zero the Velocity Mask
-        fs.fs_write_to.use();
-        fs.fs_write_to.setInt("q_in", 1);
-        fs.fs_write_to.setInt("q_out", 3);
-
-        glDispatchCompute((GLuint) grid_width, (GLuint) grid_height, (GLuint) grid_depth);
-
-        // Zero the Texture Mask
-        fs.fs_write_to.use();
-        fs.fs_write_to.setInt("q_in", 1);
-        fs.fs_write_to.setInt("q_out", 4);
-
-        glDispatchCompute((GLuint) grid_width, (GLuint) grid_height, (GLuint) grid_depth);
-        glMemoryBarrier(GL_ALL_BARRIER_BITS);
-
-        // Get Objects in the Worldview and Stick into World Mask
-        for (Mask &mask : mesh_masks) {
-            glm::vec3 velocity = mask.parent->physics_obj->get_velocity();
-            fsdebug.overlay_mask(mask, &output_solid_mask, glm::vec3(0.0, 0.0, 0.0));
-            if (length(velocity) < 0.01f) {
-                velocity = glm::vec3(
-                    0.1f * (static_cast <float> (rand()) / static_cast <float> (RAND_MAX) + 0.1f),
-                    0.1f * (static_cast <float> (rand()) / static_cast <float> (RAND_MAX) + 0.1f),
-                    0.1f * (static_cast <float> (rand()) / static_cast <float> (RAND_MAX) + 0.1f)
-                );
-            }
-            fsdebug.overlay_mask(mask, &output_velocity_mask, velocity);
-            fsdebug.overlay_mask(mask, &output_temperature_mask, glm::vec3(293.15f + 600.0f, 0.0, 0.0));
+        {
+            TraceZone zone("mask_graph");
+            mask_graph.replay();
         }
 
         // Fluid Physics
         if (ImGuiInstance::physics_enabled) {
+            TraceZone zone("fluid_step");
             double current_time = glfwGetTime();
             double frame_time = current_time - Physics::instance->previous_time;
-            fs.step(frame_time, &output_solid_mask, &output_velocity_mask, &output_temperature_mask, 1);
+            fs.backend = ImGuiInstance::cpu_fluid_backend ? Fluidsim::BACKEND_CPU : Fluidsim::BACKEND_GPU;
+            fs.step(frame_time, &output_solid_mask, &output_velocity_mask, &output_temperature_mask, 4);
             Physics::instance->tick(frame_time);
             Physics::instance->previous_time = current_time;
         }
 
-        // Fluid Debugger
-        if (ImGuiInstance::mask_overlay) {
-            fsdebug.draw(output_solid_mask, ImGuiInstance::fsdebug_scalar);
-        } else if (ImGuiInstance::fluid_velocity_overlay) {
-            fsdebug.draw(fs.u, ImGuiInstance::fsdebug_scalar);
-        } else if (ImGuiInstance::fluid_pressure_overlay) {
-            fsdebug.draw(fs.q, ImGuiInstance::fsdebug_scalar);
+        // Fluid Debugger, the fields are drawn through their dense views
+        {
+            GpuZone zone("fluid_debug_draw");
+            Texture3D *debug_field = nullptr;
+            if (ImGuiInstance::mask_overlay) {
+                debug_field = &output_solid_mask;
+            } else if (ImGuiInstance::fluid_velocity_overlay) {
+                debug_field = &fs.dense_view(fs.u.front);
+            } else if (ImGuiInstance::fluid_pressure_overlay) {
+                debug_field = &fs.dense_view(fs.q.front);
+            }
+
+            fs.barriers.flush(GL_TEXTURE_FETCH_BARRIER_BIT);
+            if (debug_field) {
+                fsdebug.draw(*debug_field, ImGuiInstance::fsdebug_scalar);
+            }
         }
         
         //
         // End Fluid Simulation
         //
 
-        imgui_instance.draw();
+        {
+            TraceZone trace_zone("imgui");
+            GpuZone zone("imgui");
+            imgui_instance.draw();
+        }
 
         if (ImGuiInstance::msaa) {
+            GpuZone zone("msaa_resolve");
             msfb.resolve_to_framebuffer(fb);
         }
         Framebuffer::unbind();
 
         glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-        fb.draw();
+        {
+            GpuZone zone("present");
+            fb.draw();
+        }
+
+        gpu_profiler.end_frame();
 
-        window.swap_buffers();
+        {
+            TraceZone zone("swap_buffers");
+            window.swap_buffers();
+        }
         window.poll_events();
     }
     return 0;